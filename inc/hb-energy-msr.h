@@ -6,6 +6,20 @@
  * CPU IDs, e.g.:
  *   export HEARTBEAT_ENERGY_MSRS=0,4,8,12
  *
+ * HEARTBEAT_ENERGY_MSR_DOMAIN selects "package" (default) or "core" energy.
+ * On AMD, core energy is per physical core, and without
+ * HEARTBEAT_ENERGY_MSRS the cores in the process's CPU affinity mask are
+ * summed, once per core however many of its SMT siblings are in the mask,
+ * attributing to an application pinned to its own cores only their energy.
+ * On Intel, core energy is the PP0 domain of each listed CPU's package.
+ *
+ * HEARTBEAT_ENERGY_MSR_VENDOR ("intel" or "amd") overrides detection, and
+ * HEARTBEAT_ENERGY_MSR_PATH overrides the device path format (one %d for the
+ * CPU ID), e.g. to read fake MSR files in tests. Registers are read as 8
+ * bytes at their address, so only the Intel layout can be faked with regular
+ * files: AMD's unit, core and package registers are at adjacent addresses
+ * and their reads overlap.
+ *
  * @author Hank Hoffmann
  * @author Connor Imes
  */
@@ -22,6 +36,10 @@ extern "C" {
 /* Environment variable for specifying the MSRs to use */
 #define HB_ENERGY_MSR_ENV_VAR "HEARTBEAT_ENERGY_MSRS"
 #define HB_ENERGY_MSRS_DELIMS ", :;|"
+#define HB_ENERGY_MSR_DOMAIN_ENV_VAR "HEARTBEAT_ENERGY_MSR_DOMAIN"
+#define HB_ENERGY_MSR_VENDOR_ENV_VAR "HEARTBEAT_ENERGY_MSR_VENDOR"
+#define HB_ENERGY_MSR_PATH_ENV_VAR "HEARTBEAT_ENERGY_MSR_PATH"
+#define HB_ENERGY_MSR_DEFAULT_PATH "/dev/cpu/%d/msr"
 
 int hb_energy_init_msr(void);
 
@@ -10,14 +10,68 @@ typedef struct {
   heartbeat_record_t* log;
   FILE* file;
   char filename[256];
+  uint64_t generation;
+  /* records in the attached log */
+  int64_t log_depth;
 
 } heart_rate_monitor_t;
 
+/* One application's state as captured by hrm_snapshot_many() */
+typedef struct {
+  int valid;                 /* 0 if it has not beaten or could not be read */
+  int pid;
+  int64_t features;          /* HB_FEATURE_* */
+  int64_t capture_time;      /* same for every application in a sweep (ns) */
+
+  /* the last record */
+  int64_t beat;
+  int tag;
+  int64_t timestamp;
+  double global_rate;
+  double window_rate;
+  double instant_rate;
+  double accuracy[3];        /* global, window, instant; 0 without accuracy */
+  double power[3];           /* global, window, instant; 0 without power */
+  double ipc;
+  double misses;
+  double mhz;
+
+  /* targets and window */
+  double min_rate;
+  double max_rate;
+  int64_t window_size;
+  int64_t effective_window;
+
+  /* derived at capture_time */
+  int64_t age;               /* capture_time - timestamp (ns) */
+  double forecast_rate;      /* see hrm_get_forecast_rate() */
+  double forecast_power;
+  double rate_trend;         /* forecast slope (per ns) */
+  double power_trend;
+  double global_cpu_rate;    /* see hrm_get_global_cpu_rate() */
+  double window_cpu_rate;
+  double instant_cpu_rate;
+  double progress;           /* see hrm_get_eta() */
+  int64_t eta;
+  int64_t eta_low;
+  int64_t eta_high;
+} hrm_snapshot_t;
+
 int heart_rate_monitor_init(heart_rate_monitor_t* hrm,
 			    int pid);
 
 void heart_rate_monitor_finish(heart_rate_monitor_t* heart);
 
+/* sizeof(heart_rate_monitor_t), for bindings that lay the struct out
+   themselves */
+size_t hrm_monitor_size(void);
+
+/* Re-attaches the log if the application resized it. The hrm_get_* and
+   hrm_reduce_history functions do this themselves; callers that read
+   hrm->log directly call it first. Returns 1 if the log moved, 0 if not,
+   -1 on error. */
+int hrm_refresh(heart_rate_monitor_t volatile * hrm);
+
 int hrm_get_current(heart_rate_monitor_t volatile * hb,
 		    heartbeat_record_t volatile * record);
 
@@ -25,6 +79,13 @@ int hrm_get_history(heart_rate_monitor_t volatile * hb,
 		    heartbeat_record_t volatile * record,
 		    int n);
 
+/* Statistics of the selected fields over the last n records, computed in
+   place; see hb_reduce_history() */
+int64_t hrm_reduce_history(heart_rate_monitor_t volatile * hb,
+			   int64_t n,
+			   uint32_t fields,
+			   hb_reduction_t* out);
+
 double hrm_get_global_rate(heart_rate_monitor_t volatile * hb);
 
 double hrm_get_windowed_rate(heart_rate_monitor_t volatile * hb);
@@ -35,4 +96,66 @@ double hrm_get_max_rate(heart_rate_monitor_t volatile * hb);
 
 int64_t hrm_get_window_size(heart_rate_monitor_t volatile * hb);
 
+/* Posts a command (see heartbeat-command.h) to the application. Safe to call
+   from several monitors at once. Returns 0, or -1 if the queue is full. */
+int hrm_post_command(heart_rate_monitor_t volatile * hb,
+		     const hb_command_t* cmd);
+
+/* Rate and power expected horizon_ns after the application's last heartbeat;
+   see hb_get_forecast_rate(). Power is 0 unless the application uses the
+   accuracy-power implementation. */
+double hrm_get_forecast_rate(heart_rate_monitor_t volatile * hb,
+			     int64_t horizon_ns);
+
+double hrm_get_forecast_power(heart_rate_monitor_t volatile * hb,
+			      int64_t horizon_ns);
+
+/* Resource usage over the application's last sampling interval; returns -1
+   if it has not sampled one (see heartbeat_set_rusage_sampling()) or stays
+   inside a sample (e.g. it is stopped) */
+int hrm_get_rusage(heart_rate_monitor_t volatile * hb, hb_rusage_t* rusage);
+
+/* Captures the last record, targets and derived metrics of n monitored
+   applications in one pass, each consistent with a single heartbeat and all
+   against one capture time (CLOCK_REALTIME, the clock of the accuracy
+   implementations) taken when the pass ends, so that no record is newer
+   than it. An application caught in the middle of a heartbeat is
+   retried a few times and then reported with valid 0 rather than waited
+   for. Returns the number of valid snapshots. */
+int64_t hrm_snapshot_many(heart_rate_monitor_t* const* hrms,
+			  int64_t n,
+			  hrm_snapshot_t* out);
+
+/* Fraction of the total work done, 0 without a total */
+double hrm_get_progress(heart_rate_monitor_t volatile * hb);
+
+/* Estimated completion time of the application's total work with bounds,
+   read consistently; see hb_get_eta(). Returns the completion time, 0 while
+   unknown or without a total, and also 0, leaving low and high untouched,
+   if the application stays inside a heartbeat (e.g. it is stopped). */
+int64_t hrm_get_eta(heart_rate_monitor_t volatile * hb,
+		    int64_t* low,
+		    int64_t* high);
+
+/* Heart rates per CPU-second; 0 unless the application enabled them with
+   heartbeat_set_cpu_clock() */
+double hrm_get_global_cpu_rate(heart_rate_monitor_t volatile * hb);
+
+double hrm_get_windowed_cpu_rate(heart_rate_monitor_t volatile * hb);
+
+double hrm_get_instant_cpu_rate(heart_rate_monitor_t volatile * hb);
+
+/* Time the application's heartbeats were held back by pacing (ns) */
+int64_t hrm_get_pacing_time(heart_rate_monitor_t volatile * hb);
+
+/* Number of heartbeats the current window rate is computed over */
+int64_t hrm_get_effective_window_size(heart_rate_monitor_t volatile * hb);
+
+/* Size in bytes of the application's records; larger than
+   sizeof(heartbeat_record_t) for the accuracy/power implementations */
+int64_t hrm_get_record_size(heart_rate_monitor_t volatile * hb);
+
+/* HB_FEATURE_* bits describing the application's records */
+int64_t hrm_get_features(heart_rate_monitor_t volatile * hb);
+
 #endif
@@ -85,6 +85,16 @@ double hb_get_windowed_power(heartbeat_t volatile * hb);
  */
 double hb_get_instant_power(heartbeat_t volatile * hb);
 
+/**
+ * Returns the power expected horizon_ns after the last heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param horizon_ns int64_t
+ * @return the forecast power (double)
+ * @see hb_get_forecast_rate()
+ */
+double hb_get_forecast_power(heartbeat_t volatile * hb, int64_t horizon_ns);
+
 /**
  * Returns the global power recorded in this record.
  *
@@ -0,0 +1,142 @@
+/**
+ * Actuators: the knobs controllers turn to move heart rates.
+ *
+ * Every actuator exposes one knob with a range, either a set of discrete
+ * settings or a continuous interval, together with how long a change takes
+ * to make and to take effect. Settings are clamped (and rounded to the
+ * nearest discrete setting), and a setting equal to the last one applied is
+ * not written again, so a control loop can call hb_actuator_set() on every
+ * iteration. The files and descriptors an actuator writes are opened once.
+ *
+ *   hb_actuator_t* cores = hb_actuator_affinity(pid);
+ *   hb_actuator_set(cores, 4);                 // run on 4 CPUs
+ *   ...
+ *   hb_actuator_close(cores);
+ *
+ * Implementations:
+ *   affinity   number of CPUs all threads of a process may run on
+ *   cpufreq    frequency of one CPU (kHz), through cpufreq sysfs
+ *   cgroup     CPU bandwidth of a cgroup v2 group (CPUs), through cpu.max
+ *   powercap   power limit of a powercap zone such as RAPL (W)
+ *   simfreq    frequency of a simulated core (MHz), in the simulator only
+ */
+#ifndef _HEARTBEAT_ACTUATOR_H_
+#define _HEARTBEAT_ACTUATOR_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define HB_ACTUATOR_DISCRETE   0
+#define HB_ACTUATOR_CONTINUOUS 1
+
+typedef struct {
+  const char* name;
+  const char* unit;
+  int kind;               /* HB_ACTUATOR_DISCRETE or HB_ACTUATOR_CONTINUOUS */
+  double min;
+  double max;
+  /* the discrete settings in increasing order, NULL if continuous */
+  const double* values;
+  int64_t nvalues;
+  /* time from a change until it takes full effect (ns) */
+  int64_t latency_ns;
+  /* time hb_actuator_set() takes to make a change (ns), measured */
+  int64_t cost_ns;
+} hb_actuator_info_t;
+
+typedef struct hb_actuator hb_actuator_t;
+
+/**
+ * The number of CPUs, out of those pid may currently use, that all of its
+ * threads are allowed on (the lowest numbered ones first).
+ *
+ * @param pid int
+ * @return the actuator, or NULL
+ */
+hb_actuator_t* hb_actuator_affinity(int pid);
+
+/**
+ * The frequency of cpu in kHz. Writes scaling_setspeed under the userspace
+ * governor and scaling_max_freq otherwise. The settings are those of
+ * scaling_available_frequencies, or the range of the CPU if it does not
+ * list them.
+ *
+ * @param cpu int
+ * @return the actuator, or NULL
+ */
+hb_actuator_t* hb_actuator_cpufreq(int cpu);
+
+/**
+ * The CPU bandwidth of the cgroup v2 directory dir, in CPUs (quota divided
+ * by period, keeping the period in cpu.max). The maximum lifts the limit.
+ *
+ * @param dir const char* path of the cgroup
+ * @return the actuator, or NULL
+ */
+hb_actuator_t* hb_actuator_cgroup_cpu(const char* dir);
+
+/**
+ * The long-term (constraint 0) power limit of the powercap zone dir, such
+ * as /sys/class/powercap/intel-rapl:0, in W.
+ *
+ * @param dir const char* path of the zone
+ * @return the actuator, or NULL
+ */
+hb_actuator_t* hb_actuator_powercap(const char* dir);
+
+/**
+ * The frequency of simulated core proc in MHz. NULL outside the simulator.
+ *
+ * @param proc int
+ * @return the actuator, or NULL
+ */
+hb_actuator_t* hb_actuator_simfreq(int proc);
+
+/**
+ * Applies the setting nearest to value. Returns 0 if the knob has that
+ * setting, -1 with errno set if it could not be written.
+ *
+ * @param a pointer to hb_actuator_t
+ * @param value double
+ * @return 0 or -1
+ */
+int hb_actuator_set(hb_actuator_t* a, double value);
+
+/**
+ * Reads the current setting back from the system, which may differ from the
+ * last one applied if something else changed it.
+ *
+ * @param a pointer to hb_actuator_t
+ * @return the setting (double), or -1 if it cannot be read
+ */
+double hb_actuator_get(hb_actuator_t* a);
+
+/**
+ * Makes the next hb_actuator_set() write even if its setting is the last
+ * one applied, e.g. after reading back a different setting.
+ *
+ * @param a pointer to hb_actuator_t
+ */
+void hb_actuator_invalidate(hb_actuator_t* a);
+
+/**
+ * @param a pointer to hb_actuator_t
+ * @return the description of the knob
+ */
+const hb_actuator_info_t* hb_actuator_info(hb_actuator_t* a);
+
+/**
+ * Closes the actuator. The knob keeps its last setting.
+ *
+ * @param a pointer to hb_actuator_t
+ */
+void hb_actuator_close(hb_actuator_t* a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+/**
+ * Work tracking for asynchronous code, where a unit of work may start on one
+ * thread and finish on another (coroutines resumed by a different thread,
+ * tasks stolen by another executor worker).
+ *
+ * A hb::work_token is created when a unit of work starts and travels with it,
+ * e.g. as a local in the coroutine frame or captured by the executor task.
+ * Completing the token counts the work on a per-thread shard of the
+ * hb::work_tracker owned by whichever thread finishes it, using only a
+ * relaxed atomic add on a cache line private to that shard. A single
+ * publisher (a timer, a control thread) periodically calls publish(), which
+ * folds the shards into one heartbeat_n() for everything completed since the
+ * previous publish.
+ *
+ * Requires C++17; the awaitable returned by track() needs C++20 coroutines.
+ */
+#ifndef _HEARTBEAT_ASYNC_HPP_
+#define _HEARTBEAT_ASYNC_HPP_
+
+#include "heartbeat.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+namespace hb {
+
+class work_tracker;
+
+/**
+ * An in-flight unit of work. Move-only; completes on destruction unless it
+ * was completed or abandoned explicitly.
+ */
+class work_token {
+ public:
+  work_token() = default;
+  work_token(work_token&& other) noexcept
+    : tracker_(std::exchange(other.tracker_, nullptr)), begin_(other.begin_) {}
+  work_token& operator=(work_token&& other) noexcept {
+    if (this != &other) {
+      complete();
+      tracker_ = std::exchange(other.tracker_, nullptr);
+      begin_ = other.begin_;
+    }
+    return *this;
+  }
+  work_token(const work_token&) = delete;
+  work_token& operator=(const work_token&) = delete;
+  ~work_token() { complete(); }
+
+  /**
+   * Records completion on the calling thread's shard.
+   *
+   * @return the work latency in nanoseconds, or -1 if already finished
+   */
+  inline int64_t complete();
+
+  /** Drops the work without counting it, e.g. on cancellation */
+  void abandon() { tracker_ = nullptr; }
+
+  bool active() const { return tracker_ != nullptr; }
+
+ private:
+  friend class work_tracker;
+  work_token(work_tracker* tracker, int64_t begin) : tracker_(tracker), begin_(begin) {}
+
+  work_tracker* tracker_ = nullptr;
+  int64_t begin_ = 0;
+};
+
+/**
+ * Lock-free, per-thread sharded completion counts feeding one heartbeat.
+ */
+class work_tracker {
+ public:
+  static constexpr std::size_t default_shards = 64;
+
+  /**
+   * @param hb the heartbeat to publish to; not owned
+   * @param shards number of shards; threads beyond this share shards
+   */
+  explicit work_tracker(heartbeat_t* hb, std::size_t shards = default_shards)
+    : hb_(hb), nshards_(shards == 0 ? 1 : shards), shards_(new shard[nshards_]) {}
+
+  template<typename... Metrics>
+  explicit work_tracker(Heartbeat<Metrics...>& hb, std::size_t shards = default_shards)
+    : work_tracker(hb.native_handle(), shards) {}
+
+  work_tracker(const work_tracker&) = delete;
+  work_tracker& operator=(const work_tracker&) = delete;
+
+  /** Starts tracking a unit of work */
+  work_token begin() { return work_token(this, detail::now_ns()); }
+
+  /**
+   * Wraps a callable so the work it represents is counted when it returns
+   * normally, on whichever executor thread runs it. Work whose callable
+   * throws, or that is destroyed without having run (executor shutdown, a
+   * cancelled task), is abandoned. The token is shared by copies of the
+   * wrapper, so it is copyable whenever f is (e.g. for std::function) and
+   * the work is counted at most once.
+   */
+  template<typename F>
+  auto wrap(F&& f) {
+    return [p = std::make_shared<pending>(begin()), fn = std::forward<F>(f)](auto&&... args) mutable
+        -> decltype(auto) {
+      try {
+        if constexpr (std::is_void_v<decltype(fn(std::forward<decltype(args)>(args)...))>) {
+          fn(std::forward<decltype(args)>(args)...);
+          p->tok.complete();
+        } else {
+          decltype(auto) r = fn(std::forward<decltype(args)>(args)...);
+          p->tok.complete();
+          return r;
+        }
+      } catch (...) {
+        p->tok.abandon();
+        throw;
+      }
+    };
+  }
+
+#if defined(__cpp_impl_coroutine)
+  /**
+   * `auto tok = co_await tracker.track();` starts a unit of work whose token
+   * lives in the coroutine frame and follows it across threads.
+   */
+  auto track() {
+    struct awaiter {
+      work_tracker* tracker;
+      bool await_ready() const noexcept { return true; }
+      void await_suspend(std::coroutine_handle<>) const noexcept {}
+      work_token await_resume() const { return tracker->begin(); }
+    };
+    return awaiter{this};
+  }
+#endif
+
+  /** Counts n completions on the calling thread's shard without a token */
+  void complete(uint64_t n = 1, int64_t latency_ns = 0) {
+    shard& s = local_shard();
+    s.completed.fetch_add(n, std::memory_order_relaxed);
+    s.latency_ns.fetch_add((uint64_t) latency_ns, std::memory_order_relaxed);
+  }
+
+  /** Total completions counted so far (not necessarily published) */
+  uint64_t completed() const {
+    uint64_t total = 0;
+    for (std::size_t i = 0; i < nshards_; i++) {
+      total += shards_[i].completed.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  /**
+   * Publishes everything completed since the last call as one heartbeat.
+   * Only one thread may publish at a time.
+   *
+   * @return the number of units published (no heartbeat is issued for 0)
+   */
+  int64_t publish(int tag = 0) {
+    uint64_t total = 0;
+    uint64_t latency = 0;
+    for (std::size_t i = 0; i < nshards_; i++) {
+      total += shards_[i].completed.load(std::memory_order_relaxed);
+      latency += shards_[i].latency_ns.load(std::memory_order_relaxed);
+    }
+    int64_t delta = (int64_t) (total - published_);
+    if (delta > 0) {
+      last_mean_latency_ns_ = (double) (latency - published_latency_) / (double) delta;
+      published_ = total;
+      published_latency_ = latency;
+      heartbeat_n(hb_, tag, delta);
+    }
+    return delta;
+  }
+
+  /** Mean latency of the work covered by the last non-empty publish() */
+  double mean_latency_ns() const { return last_mean_latency_ns_; }
+
+ private:
+  /* Token of a wrap()ped callable, abandoned if it never ran */
+  struct pending {
+    explicit pending(work_token t) : tok(std::move(t)) {}
+    ~pending() { tok.abandon(); }
+    work_token tok;
+  };
+
+  struct alignas(64) shard {
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> latency_ns{0};
+  };
+
+  shard& local_shard() {
+    static std::atomic<std::size_t> next_thread{0};
+    thread_local std::size_t thread_id = next_thread.fetch_add(1, std::memory_order_relaxed);
+    return shards_[thread_id % nshards_];
+  }
+
+  heartbeat_t* hb_;
+  std::size_t nshards_;
+  std::unique_ptr<shard[]> shards_;
+  uint64_t published_ = 0;
+  uint64_t published_latency_ = 0;
+  double last_mean_latency_ns_ = 0.0;
+};
+
+inline int64_t work_token::complete() {
+  if (tracker_ == nullptr) {
+    return -1;
+  }
+  int64_t latency = detail::now_ns() - begin_;
+  tracker_->complete(1, latency);
+  tracker_ = nullptr;
+  return latency;
+}
+
+} // namespace hb
+
+#endif
@@ -0,0 +1,50 @@
+/**
+ * Commands posted by monitors to a heartbeat-enabled application.
+ *
+ * Commands travel through a small lock-free queue in the shared heartbeat
+ * state: any number of monitors post with hrm_post_command(), the application
+ * drains them while registering heartbeats (or with
+ * heartbeat_poll_commands()). Built-in commands are applied by the library;
+ * every command is then passed to the application's handler, if one is set
+ * with heartbeat_set_command_handler().
+ */
+#ifndef _HEARTBEAT_COMMAND_H_
+#define _HEARTBEAT_COMMAND_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Queue capacity, a power of two */
+#define HB_COMMAND_SLOTS 16
+
+/* Built-in commands */
+#define HB_CMD_NONE        0
+/* value[0], value[1]: new minimum and maximum target heart rate */
+#define HB_CMD_SET_TARGETS 1
+/* First type available for application-defined commands */
+#define HB_CMD_USER        256
+
+typedef struct {
+  uint64_t seq;   /* queue bookkeeping, set by the library */
+  int32_t type;
+  int32_t flags;
+  int64_t arg;
+  double value[2];
+} _HB_command_t;
+
+typedef _HB_command_t hb_command_t;
+
+/**
+ * Called by the application thread that drained cmd, without any heartbeat
+ * lock held.
+ */
+typedef void (*hb_command_handler_t)(const hb_command_t* cmd, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * Group heartbeats: one heartbeat for a job shared by cooperating processes,
+ * such as the workers of a prefork server or the stages of a pipeline.
+ *
+ * A group is a named shared memory segment. Every process that joins it gets
+ * its own member slot with a ring of its recent beats, so beating touches
+ * only memory of the calling process and takes no lock: the beat claims a
+ * ring entry with an atomic fetch-add and adds its work to the member's
+ * totals. Threads of one process may share its membership.
+ *
+ * Group rates are computed by whoever reads them, from the members' totals
+ * (global rate) and their rings merged by time (window and instant rates over
+ * the last window beats of the whole group). Work of members that left, or
+ * died and had their slot reclaimed by a later joiner, stays in the global
+ * totals.
+ *
+ *   hb_group_t* g = hb_group_join("frontend", 64, 32);   // in each worker
+ *   ...
+ *   hb_group_beat(g, 0);
+ *   ...
+ *   hb_group_leave(g);
+ *
+ *   hb_group_t* m = hb_group_attach("frontend");          // in a monitor
+ *   hb_group_stats_t s;
+ *   hb_group_read(m, &s);
+ *
+ * Processes join after fork(); a child that inherits its parent's membership
+ * beats as its parent. The segment goes away when the last member leaves. If
+ * HEARTBEAT_ENABLED_DIR is set, the group is registered there as
+ * group-<name>.
+ */
+#ifndef _HEARTBEAT_GROUP_H_
+#define _HEARTBEAT_GROUP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define HB_GROUP_NAME_LEN 64
+#define HB_GROUP_CACHE_LINE 64
+/* Set in joined once the last member has left */
+#define HB_GROUP_CLOSED (1ULL << 63)
+
+/**
+ * One beat in a member's ring. seq is 2 * (index of the beat in the ring)
+ * + 2 once written and odd while being written.
+ */
+typedef struct {
+  uint64_t seq;
+  int64_t timestamp;
+  int64_t work;
+  int32_t tag;
+  int32_t pid;
+} hb_group_entry_t;
+
+/**
+ * One process of the group. pid is 0 for a free slot and -1 while a slot is
+ * being claimed.
+ */
+typedef struct {
+  int32_t pid;
+  uint32_t reserved;
+  /* beats claimed from the ring so far */
+  uint64_t head;
+  int64_t beats;
+  int64_t total_work;
+  int64_t last_timestamp;
+} __attribute__((aligned(HB_GROUP_CACHE_LINE))) hb_group_member_t;
+
+/**
+ * Start of the segment, followed by capacity members and their rings of
+ * window entries each.
+ */
+typedef struct {
+  uint64_t magic;
+  char name[HB_GROUP_NAME_LEN];
+  uint32_t capacity;
+  uint32_t window;
+  /* number of joined processes, or HB_GROUP_CLOSED */
+  uint64_t joined;
+  int64_t first_timestamp;
+  /* totals of members that are gone, moved here when their slot is freed */
+  int64_t retired_beats;
+  int64_t retired_work;
+  /* slots being freed are counted in started until counted in finished */
+  uint64_t frees_started;
+  uint64_t frees_finished;
+} __attribute__((aligned(HB_GROUP_CACHE_LINE))) hb_group_header_t;
+
+typedef struct {
+  hb_group_header_t* header;
+  hb_group_member_t* members;
+  hb_group_entry_t* entries;
+  /* this process' slot, NULL for monitors */
+  hb_group_member_t* member;
+  hb_group_entry_t* ring;
+  /* beats gathered by hb_group_read() */
+  hb_group_entry_t* scratch;
+  int shmid;
+  char filename[256];
+} hb_group_t;
+
+/* Group-wide statistics; rates are in work per second */
+typedef struct {
+  uint32_t members;          /* processes in the group */
+  int64_t beats;
+  int64_t total_work;
+  int64_t first_timestamp;
+  int64_t last_timestamp;
+  int tag;                   /* of the last beat */
+  double global_rate;
+  double window_rate;
+  double instant_rate;
+} hb_group_stats_t;
+
+/**
+ * Joins the group called name, creating it if it does not exist. capacity
+ * (processes) and window (beats) only apply when the group is created.
+ *
+ * @param name const char*, at most HB_GROUP_NAME_LEN - 1 characters and no '/'
+ * @param capacity uint32_t
+ * @param window uint32_t
+ * @return pointer to hb_group_t, or NULL if the group is full or on failure
+ */
+hb_group_t* hb_group_join(const char* name, uint32_t capacity, uint32_t window);
+
+/**
+ * Leaves the group, keeping this process' work in its totals, and removes
+ * the group if this was the last member.
+ *
+ * @param g pointer to hb_group_t
+ */
+void hb_group_leave(hb_group_t* g);
+
+/**
+ * Registers a heartbeat of this process accounting for n units of work.
+ *
+ * @param g pointer to hb_group_t
+ * @param tag integer
+ * @param n int64_t
+ * @return the timestamp of the beat
+ */
+int64_t hb_group_beat_n(hb_group_t* g, int tag, int64_t n);
+
+static inline int64_t hb_group_beat(hb_group_t* g, int tag) {
+  return hb_group_beat_n(g, tag, 1);
+}
+
+/**
+ * Attaches (read-only) to the group called name.
+ *
+ * @param name const char*
+ * @return pointer to hb_group_t, or NULL if there is no such group
+ */
+hb_group_t* hb_group_attach(const char* name);
+
+/**
+ * Detaches from a group attached with hb_group_attach().
+ *
+ * @param g pointer to hb_group_t
+ */
+void hb_group_detach(hb_group_t* g);
+
+/**
+ * Computes the group's statistics. Works on joined and attached groups.
+ *
+ * @param g pointer to hb_group_t
+ * @param out pointer to hb_group_stats_t
+ * @return 0, or -1 if no consistent totals could be read because a slot was
+ *   being freed (out then holds the last attempt)
+ */
+int hb_group_read(hb_group_t* g, hb_group_stats_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
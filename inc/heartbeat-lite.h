@@ -0,0 +1,168 @@
+/**
+ * Lightweight heartbeats for tracking many small activities, such as one per
+ * client connection or per tenant.
+ *
+ * All instances of a process live in slots of one shared memory arena that
+ * is created once. Creating and destroying an instance pops and pushes a
+ * lock-free free list, and a beat only reads the clock and updates the slot,
+ * so neither makes system calls, allocates, or prints. Each instance keeps a
+ * fixed window of HB_LITE_WINDOW beats and no log.
+ *
+ * An instance must not be beaten by two threads at once (a connection is
+ * normally served by one thread at a time); different instances may be used
+ * concurrently. Monitors attach to the arena of a process and enumerate its
+ * live instances, each copied consistently:
+ *
+ *   hb_lite_arena_t* arena = hb_lite_attach(pid);
+ *   uint32_t cursor = 0;
+ *   hb_lite_t hb;
+ *   while (hb_lite_next(arena, &cursor, &hb) == 0) {
+ *     printf("%llu %f\n", (unsigned long long) hb.id, hb.window_rate);
+ *   }
+ *   hb_lite_detach(arena);
+ *
+ * The arena is registered as HEARTBEAT_ENABLED_DIR/lite-<pid>.
+ */
+#ifndef _HEARTBEAT_LITE_H_
+#define _HEARTBEAT_LITE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Beats in the sliding window of each instance */
+#define HB_LITE_WINDOW 7
+
+#define HB_LITE_CACHE_LINE 64
+
+/**
+ * One instance. Written only by the thread beating it; seq is odd while it
+ * is being updated.
+ */
+typedef struct {
+  uint32_t seq;
+  uint32_t live;
+  uint64_t id;
+  int32_t tag;
+  uint32_t next_free;
+  int64_t counter;
+  int64_t total_work;
+  int64_t first_timestamp;
+  int64_t last_timestamp;
+  double global_rate;
+  double window_rate;
+  double instant_rate;
+  /* timestamps and total_work at the last HB_LITE_WINDOW beats */
+  int64_t window_timestamp[HB_LITE_WINDOW];
+  int64_t window_work[HB_LITE_WINDOW];
+} __attribute__((aligned(HB_LITE_CACHE_LINE))) hb_lite_t;
+
+/**
+ * Start of the arena, followed by capacity slots.
+ */
+typedef struct {
+  uint64_t magic;
+  int32_t pid;
+  uint32_t capacity;
+  /* free list head: ABA tag in the upper 32 bits, slot index below */
+  uint64_t free_head;
+  /* slots handed out so far; slots past it have never been used */
+  uint32_t high_water;
+  uint32_t live;
+} __attribute__((aligned(HB_LITE_CACHE_LINE))) hb_lite_header_t;
+
+typedef struct {
+  hb_lite_header_t* header;
+  hb_lite_t* slots;
+  int shmid;
+  int owner;
+  char filename[256];
+} hb_lite_arena_t;
+
+/**
+ * Creates the arena of this process with room for capacity instances.
+ *
+ * @param capacity uint32_t
+ * @return pointer to hb_lite_arena_t, or NULL on failure
+ */
+hb_lite_arena_t* hb_lite_arena_init(uint32_t capacity);
+
+/**
+ * Destroys the arena and every instance in it.
+ *
+ * @param arena pointer to hb_lite_arena_t
+ */
+void hb_lite_arena_finish(hb_lite_arena_t* arena);
+
+/**
+ * Takes an instance from the arena.
+ *
+ * @param arena pointer to hb_lite_arena_t
+ * @param id uint64_t identifying the instance to monitors, e.g. a connection
+ * @return pointer to hb_lite_t, or NULL if the arena is full
+ */
+hb_lite_t* hb_lite_create(hb_lite_arena_t* arena, uint64_t id);
+
+/**
+ * Returns an instance to the arena.
+ *
+ * @param arena pointer to hb_lite_arena_t
+ * @param hb pointer to hb_lite_t
+ */
+void hb_lite_destroy(hb_lite_arena_t* arena, hb_lite_t* hb);
+
+/**
+ * Registers a heartbeat accounting for n units of work.
+ *
+ * @param hb pointer to hb_lite_t
+ * @param tag integer
+ * @param n int64_t
+ * @return the timestamp of the beat
+ */
+int64_t hb_lite_beat_n(hb_lite_t* hb, int tag, int64_t n);
+
+static inline int64_t hb_lite_beat(hb_lite_t* hb, int tag) {
+  return hb_lite_beat_n(hb, tag, 1);
+}
+
+/**
+ * Attaches (read-only) to the arena of process pid.
+ *
+ * @param pid integer
+ * @return pointer to hb_lite_arena_t, or NULL if the process has no arena
+ */
+hb_lite_arena_t* hb_lite_attach(int pid);
+
+/**
+ * Detaches from an arena attached with hb_lite_attach().
+ *
+ * @param arena pointer to hb_lite_arena_t
+ */
+void hb_lite_detach(hb_lite_arena_t* arena);
+
+/**
+ * Number of live instances in the arena.
+ *
+ * @param arena pointer to hb_lite_arena_t
+ */
+uint32_t hb_lite_count(hb_lite_arena_t* arena);
+
+/**
+ * Copies the next live instance at or after *cursor, then advances the
+ * cursor past it. Start with *cursor = 0. Instances that stay in the middle
+ * of an update, e.g. because their process is stopped, are skipped.
+ *
+ * @param arena pointer to hb_lite_arena_t
+ * @param cursor pointer to uint32_t
+ * @param out pointer to hb_lite_t
+ * @return 0 if an instance was copied, -1 at the end
+ */
+int hb_lite_next(hb_lite_arena_t* arena, uint32_t* cursor, hb_lite_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * Pareto tables: the best trade-offs between heart rate, power, CPU use and
+ * accuracy a workload showed across a set of configurations, as written by
+ * hb-autotune.
+ *
+ * A table is a text file. Lines starting with '#' are comments; the first
+ * other line names the columns and every line after it is one configuration:
+ *
+ *   rate power cpus accuracy cores cpufreq quality
+ *   120.5 0 1.98 0.9 2 1600000 3
+ *
+ * rate is in heartbeats/s, power in W (0 if not measured), cpus the average
+ * number of CPUs busy and accuracy the mean instant accuracy (0 if not
+ * measured). The remaining columns are the knob settings. Loaded points are
+ * in increasing rate, so a controller can pick a configuration for a target
+ * rate without searching the whole table:
+ *
+ *   hb_pareto_t table;
+ *   hb_pareto_load(&table, "pareto.txt");
+ *   const hb_pareto_point_t* p = hb_pareto_lookup(&table, min_rate, 0);
+ */
+#ifndef _HEARTBEAT_PARETO_H_
+#define _HEARTBEAT_PARETO_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define HB_PARETO_MAX_KNOBS 16
+#define HB_PARETO_NAME_LEN 32
+
+typedef struct {
+  double rate;
+  double power;
+  double cpus;
+  double accuracy;
+  double settings[HB_PARETO_MAX_KNOBS];
+} hb_pareto_point_t;
+
+typedef struct {
+  int64_t nknobs;
+  char knobs[HB_PARETO_MAX_KNOBS][HB_PARETO_NAME_LEN];
+  int64_t npoints;
+  hb_pareto_point_t* points;
+  /* index of the cheapest point at or above each point, set by load */
+  int64_t* cheapest;
+} hb_pareto_t;
+
+/**
+ * Reads a table.
+ *
+ * @param table pointer to hb_pareto_t
+ * @param path const char*
+ * @return 0, or -1 if the file cannot be read or is not a table
+ */
+int hb_pareto_load(hb_pareto_t* table, const char* path);
+
+/**
+ * Writes the points of a table, in the order they are in.
+ *
+ * @param table pointer to hb_pareto_t
+ * @param path const char*
+ * @return 0 or -1
+ */
+int hb_pareto_save(const hb_pareto_t* table, const char* path);
+
+/**
+ * The cheapest loaded point (lowest power, or lowest CPU use if the table
+ * has no power) with at least min_rate and min_accuracy, preferring the
+ * slower of equally cheap points. If no point meets both, the fastest one
+ * meeting min_accuracy, or the fastest of all.
+ *
+ * @param table pointer to hb_pareto_t
+ * @param min_rate double
+ * @param min_accuracy double, 0 to ignore accuracy
+ * @return the point, or NULL if the table is empty
+ */
+const hb_pareto_point_t* hb_pareto_lookup(const hb_pareto_t* table,
+                                          double min_rate,
+                                          double min_accuracy);
+
+/**
+ * Frees the points of a loaded table.
+ *
+ * @param table pointer to hb_pareto_t
+ */
+void hb_pareto_finish(hb_pareto_t* table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * Types for computing statistics directly over heartbeat history.
+ *
+ * @see hb_reduce_history()
+ * @see hrm_reduce_history()
+ */
+#ifndef _HEARTBEAT_REDUCE_H_
+#define _HEARTBEAT_REDUCE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Record fields that can be reduced. Accuracy fields require an application
+ * using the accuracy or accuracy-power implementation, power fields the
+ * accuracy-power implementation, and counter fields an application that
+ * called heartbeat_enable_counters().
+ */
+typedef enum {
+  HB_FIELD_GLOBAL_RATE = 0,
+  HB_FIELD_WINDOW_RATE,
+  HB_FIELD_INSTANT_RATE,
+  HB_FIELD_GLOBAL_ACCURACY,
+  HB_FIELD_WINDOW_ACCURACY,
+  HB_FIELD_INSTANT_ACCURACY,
+  HB_FIELD_GLOBAL_POWER,
+  HB_FIELD_WINDOW_POWER,
+  HB_FIELD_INSTANT_POWER,
+  HB_FIELD_IPC,
+  HB_FIELD_MISSES,
+  HB_FIELD_MHZ,
+  HB_FIELD_COUNT
+} hb_field_t;
+
+/* Bit for a field in the fields mask */
+#define HB_FIELD_BIT(f) (1u << (f))
+
+#define HB_FIELDS_RATE \
+  (HB_FIELD_BIT(HB_FIELD_GLOBAL_RATE) | HB_FIELD_BIT(HB_FIELD_WINDOW_RATE) | \
+   HB_FIELD_BIT(HB_FIELD_INSTANT_RATE))
+#define HB_FIELDS_ACCURACY \
+  (HB_FIELD_BIT(HB_FIELD_GLOBAL_ACCURACY) | HB_FIELD_BIT(HB_FIELD_WINDOW_ACCURACY) | \
+   HB_FIELD_BIT(HB_FIELD_INSTANT_ACCURACY))
+#define HB_FIELDS_POWER \
+  (HB_FIELD_BIT(HB_FIELD_GLOBAL_POWER) | HB_FIELD_BIT(HB_FIELD_WINDOW_POWER) | \
+   HB_FIELD_BIT(HB_FIELD_INSTANT_POWER))
+#define HB_FIELDS_COUNTERS \
+  (HB_FIELD_BIT(HB_FIELD_IPC) | HB_FIELD_BIT(HB_FIELD_MISSES) | \
+   HB_FIELD_BIT(HB_FIELD_MHZ))
+
+/* Statistics of one field; stddev is the population standard deviation */
+typedef struct {
+  double min;
+  double max;
+  double mean;
+  double stddev;
+} hb_field_stats_t;
+
+/**
+ * Result of a reduction. Only the entries of stats selected by fields are
+ * written.
+ */
+typedef struct {
+  int64_t count;
+  uint32_t fields;
+  hb_field_stats_t stats[HB_FIELD_COUNT];
+} hb_reduction_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+/**
+ * Operating system resource usage between heartbeats.
+ *
+ * When enabled with heartbeat_set_rusage_sampling(), the library samples the
+ * resource usage of the beating thread every few heartbeats and publishes
+ * the difference from the previous sample in the shared state, where
+ * hb_get_rusage() and hrm_get_rusage() read it.
+ */
+#ifndef _HEARTBEAT_RUSAGE_H_
+#define _HEARTBEAT_RUSAGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef struct {
+  int64_t beats;          /* heartbeats in the interval, 0 if never sampled */
+  int64_t duration;       /* length of the interval (ns) */
+  int64_t utime;          /* user CPU time (ns) */
+  int64_t stime;          /* system CPU time (ns) */
+  int64_t nvcsw;          /* voluntary context switches */
+  int64_t nivcsw;         /* involuntary context switches */
+  int64_t majflt;         /* major page faults */
+  int64_t minflt;         /* minor page faults */
+  int64_t migrations;     /* moves to another CPU, -1 if unknown */
+  int64_t run_delay;      /* time runnable but waiting for a CPU (ns), -1 if unknown */
+} _HB_rusage_t;
+
+typedef _HB_rusage_t hb_rusage_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,6 +14,31 @@ extern "C" {
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
+#include "heartbeat-command.h"
+#include "heartbeat-rusage.h"
+
+/* Bits for _HB_global_state_t.features, describing the record layout */
+#define HB_FEATURE_ACCURACY 0x1
+#define HB_FEATURE_POWER    0x2
+#define HB_FEATURE_COUNTERS 0x4
+
+/* CPU time clocks for _HB_global_state_t.cpu_clock */
+#define HB_CPU_CLOCK_NONE    0
+#define HB_CPU_CLOCK_PROCESS 1
+#define HB_CPU_CLOCK_THREAD  2
+
+/* Pacing modes for _HB_global_state_t.pace_mode */
+#define HB_PACE_NONE    0
+#define HB_PACE_INSTANT 1
+#define HB_PACE_WINDOW  2
+
+/* Offset of ipc, misses and mhz in records of any layout */
+#define HB_RECORD_COUNTERS_OFFSET(features) \
+  (48 + (((features) & HB_FEATURE_ACCURACY) ? 24 : 0) + \
+   (((features) & HB_FEATURE_POWER) ? 24 : 0))
+
+/* Features of the records defined by this header */
+#define HB_RECORD_FEATURES (0)
 
 typedef struct {
   int64_t beat;
@@ -23,6 +48,12 @@ typedef struct {
   double global_rate;
   double window_rate;
   double instant_rate;
+
+  /* hardware counters over the interval ending at this beat; 0 unless the
+   * state has HB_FEATURE_COUNTERS */
+  double ipc;
+  double misses;
+  double mhz;
 } _heartbeat_record_t;
 
 typedef struct {
@@ -37,6 +68,51 @@ typedef struct {
 
   double min_heartrate;
   double max_heartrate;
+
+  int64_t record_size;
+  int64_t features;
+
+  int64_t effective_window;
+
+  int64_t forecast_timestamp;
+  double rate_level;
+  double rate_trend;
+  double power_level;
+  double power_trend;
+
+  uint64_t command_head;
+  uint64_t command_tail;
+  _HB_command_t commands[HB_COMMAND_SLOTS];
+
+  uint64_t log_generation;
+  int64_t log_start;
+
+  /* odd while rusage is being updated */
+  uint64_t rusage_seq;
+  _HB_rusage_t rusage;
+
+  /* heart rates per CPU-second rather than per second (HB_CPU_CLOCK_*) */
+  int64_t cpu_clock;
+  double global_cpu_rate;
+  double window_cpu_rate;
+  double instant_cpu_rate;
+
+  /* odd while a heartbeat updates the state and log; see hrm_snapshot_many() */
+  uint64_t beat_seq;
+
+  /* progress towards heartbeat_set_total_work(); the completion estimates
+   * are in the clock of the record timestamps, 0 while unknown */
+  int64_t work_goal;
+  int64_t work_done;
+  int64_t eta;
+  int64_t eta_low;
+  int64_t eta_high;
+
+  /* heartbeats held back to stay under max_heartrate (HB_PACE_*), and the
+   * time they were held for (ns) */
+  int64_t pace_mode;
+  int64_t pace_time;
+  int64_t paced_beats;
 } _HB_global_state_t;
 
 typedef struct {
@@ -56,6 +132,53 @@ typedef struct {
   int64_t* window;
   int64_t current_index;
   double last_average_time;
+
+  int64_t* work_window;
+  int64_t window_work;
+  int64_t total_work;
+
+  int adaptive;
+  double adaptive_z;
+  double adaptive_rel_error;
+  int64_t adaptive_min_window;
+  double interval_sum;
+  double interval_sumsq;
+  int64_t effective_time;
+  int64_t effective_work;
+
+  double forecast_alpha;
+  double forecast_beta;
+
+  hb_command_handler_t command_handler;
+  void* command_arg;
+  int64_t command_interval;
+
+  int64_t flush_index;
+
+  struct _HB_counters* counters;
+
+  int64_t rusage_interval;
+  int64_t rusage_next;
+  pthread_t rusage_owner;
+  int rusage_schedstat_fd;
+  int rusage_sched_fd;
+  _HB_rusage_t rusage_last;
+
+  int64_t* cpu_window;
+  int64_t window_cpu;
+  int64_t window_cpu_work;
+  int64_t cpu_filled;
+  int64_t cpu_last;
+  int64_t cpu_start;
+  int64_t cpu_work_start;
+
+  int64_t eta_time;
+  int64_t eta_work;
+  double eta_sum;
+  double eta_sumsq;
+
+  /* how long before a paced heartbeat is due to stop sleeping and spin */
+  int64_t pace_spin;
 } _heartbeat_t;
 
 typedef _heartbeat_record_t heartbeat_record_t;
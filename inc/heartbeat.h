@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include "heartbeat-types.h"
+#include "heartbeat-reduce.h"
 #include <stdint.h>
 
 /**
@@ -39,6 +40,178 @@ heartbeat_t* heartbeat_init(int64_t window_size,
 int64_t heartbeat(heartbeat_t* hb,
                   int tag);
 
+/**
+ * Registers a heartbeat that accounts for n units of work, e.g. a batch of
+ * items completed since the previous heartbeat. Rates are then reported in
+ * units of work per second; heartbeat() is equivalent to n = 1.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param tag integer
+ * @param n int64_t
+ */
+int64_t heartbeat_n(heartbeat_t* hb,
+                    int tag,
+                    int64_t n);
+
+/**
+ * Lets the window used for the window rate grow or shrink with the observed
+ * jitter, so that the window rate has relative error rel_error at the given
+ * confidence, e.g. 0.02 and 0.95 for +/-2% at 95%. The window_size passed to
+ * init is the largest window used. Accuracy and power windows are unchanged.
+ * A rel_error <= 0 restores the fixed window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param rel_error double
+ * @param confidence double in (0, 1)
+ * @param min_window int64_t smallest window to use
+ * @return 0 on success, -1 on invalid arguments
+ */
+int heartbeat_set_adaptive_window(heartbeat_t* hb,
+                                  double rel_error,
+                                  double confidence,
+                                  int64_t min_window);
+
+/**
+ * Changes the number of heartbeats in the sliding window without losing the
+ * window's contents; the newest entries are kept when shrinking. Accuracy and
+ * power windows are resized with it.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param window_size int64_t
+ * @return 0 on success, -1 on failure (the old window is kept)
+ */
+int heartbeat_set_window_size(heartbeat_t* hb, int64_t window_size);
+
+/**
+ * Moves the log to a new shared memory segment of buffer_depth records,
+ * keeping the newest records. Attached monitors see the switch through a
+ * generation counter in the shared state and re-attach (hrm_refresh()).
+ *
+ * @param hb pointer to heartbeat_t
+ * @param buffer_depth int64_t
+ * @return 0 on success, -1 on failure (the old depth is kept)
+ */
+int heartbeat_set_buffer_depth(heartbeat_t* hb, int64_t buffer_depth);
+
+/**
+ * Sets the smoothing of the rate (and power) forecasts. Higher alpha follows
+ * the instant rate more closely, higher beta lets the trend change faster.
+ * Defaults are alpha = 0.2, beta = 0.05.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param alpha double in (0, 1]
+ * @param beta double in [0, 1]
+ * @return 0 on success, -1 on invalid arguments
+ */
+int heartbeat_set_forecast_smoothing(heartbeat_t* hb,
+                                     double alpha,
+                                     double beta);
+
+/**
+ * Sets the function called for each command a monitor posts (see
+ * heartbeat-command.h) and how often heartbeats check for commands: every
+ * poll_interval beats, or never if poll_interval <= 0, in which case the
+ * application calls heartbeat_poll_commands(). Built-in commands are applied
+ * whether or not a handler is set. By default commands are checked on every
+ * beat and there is no handler.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param handler hb_command_handler_t, may be NULL
+ * @param arg pointer passed to handler
+ * @param poll_interval int64_t
+ */
+void heartbeat_set_command_handler(heartbeat_t* hb,
+                                   hb_command_handler_t handler,
+                                   void* arg,
+                                   int64_t poll_interval);
+
+/**
+ * Applies and dispatches pending commands now, for applications that beat
+ * rarely or poll on their own schedule.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the number of commands processed
+ */
+int heartbeat_poll_commands(heartbeat_t* hb);
+
+/**
+ * Starts recording hardware performance counters of the calling thread in
+ * each heartbeat record: instructions per cycle, last-level cache misses per
+ * unit of work and effective MHz over the interval since the previous beat
+ * (the ipc, misses and mhz fields, with HB_FEATURE_COUNTERS set in the shared
+ * state). Counters are read in user space with rdpmc where the kernel allows
+ * it. Beats registered by other threads record zeros.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return 0 on success, -1 if counters are unavailable (e.g. no PMU or
+ *         perf_event_paranoid too high)
+ */
+int heartbeat_enable_counters(heartbeat_t* hb);
+
+/**
+ * Stops recording hardware performance counters.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+void heartbeat_disable_counters(heartbeat_t* hb);
+
+/**
+ * Samples the operating system resource usage of the calling thread (CPU
+ * time, context switches, page faults, CPU migrations and run queue delay)
+ * every interval heartbeats and publishes the change since the previous
+ * sample; see hb_get_rusage(). Samples are only taken in heartbeats
+ * registered by the calling thread. An interval of 0 stops sampling.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param interval int64_t heartbeats between samples, e.g. the window size
+ * @return 0
+ */
+int heartbeat_set_rusage_sampling(heartbeat_t* hb, int64_t interval);
+
+/**
+ * Also computes heart rates per second of CPU time (work per CPU-second)
+ * from the given clock, which tells efficiency apart from throughput when
+ * the application is descheduled or throttled. HB_CPU_CLOCK_PROCESS counts
+ * all threads of the process; HB_CPU_CLOCK_THREAD counts the thread that
+ * registers each heartbeat and suits a single beating thread. Reading the
+ * clock costs a clock_gettime() call per heartbeat, so this is off by
+ * default (HB_CPU_CLOCK_NONE). Enabling restarts the CPU-time rates.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param clock int HB_CPU_CLOCK_NONE, HB_CPU_CLOCK_PROCESS or HB_CPU_CLOCK_THREAD
+ * @return 0, or -1 for an unknown clock
+ */
+int heartbeat_set_cpu_clock(heartbeat_t* hb, int clock);
+
+/**
+ * Sets the total work of the application, in the units passed to
+ * heartbeat_n(), so that every heartbeat publishes the progress and an
+ * estimated completion time with bounds (see hb_get_eta()). Work already
+ * done counts towards the total. 0 stops the estimates.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param total_work int64_t
+ * @return 0, or -1 if total_work is negative
+ */
+int heartbeat_set_total_work(heartbeat_t* hb, int64_t total_work);
+
+/**
+ * Holds heartbeats back so that the heart rate stays at or under
+ * max_heartrate: with HB_PACE_INSTANT each heartbeat of n units of work is
+ * delayed until n / max_heartrate after the previous one, with HB_PACE_WINDOW
+ * until the window rate including it is max_heartrate. The heartbeat sleeps
+ * until shortly before it is due and spins the rest, learning how late its
+ * sleeps wake up; it holds the heartbeat lock meanwhile. The time held is
+ * counted separately (see hb_get_pacing_time()) and, as it is spent between
+ * beats, is part of the intervals. Not supported in libhb-shared, whose time
+ * is simulated. HB_PACE_NONE (the default) stops pacing.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param mode int HB_PACE_NONE, HB_PACE_INSTANT or HB_PACE_WINDOW
+ * @return 0, or -1 for an unknown or unsupported mode
+ */
+int heartbeat_set_pacing(heartbeat_t* hb, int mode);
+
 /**
  * Cleanup function for process that
  * wants to register heartbeats
@@ -56,6 +229,15 @@ void heartbeat_finish(heartbeat_t * hb);
  */
 int64_t hb_get_window_size(heartbeat_t volatile * hb);
 
+/**
+ * Returns the number of heartbeats the current window rate is computed over,
+ * which differs from the window size in adaptive mode
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the effective window size (int64_t)
+ */
+int64_t hb_get_effective_window_size(heartbeat_t volatile * hb);
+
 /**
  * Returns the buffer depth of the log
  * rate
@@ -76,7 +258,7 @@ void hb_get_current(heartbeat_t volatile * hb,
 
 /**
  * Returns all heartbeat information for the last n heartbeats
- *
+ *
  * @param hb pointer to heartbeat_t
  * @param record pointer to heartbeat_record_t
  * @param n int64_t
@@ -85,6 +267,22 @@ int64_t hb_get_history(heartbeat_t volatile * hb,
                        heartbeat_record_t volatile * record,
                        int64_t n);
 
+/**
+ * Computes min, max, mean and standard deviation of the selected fields over
+ * the last n heartbeats without copying them out of the log.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param n int64_t
+ * @param fields mask of HB_FIELD_BIT(hb_field_t) values
+ * @param out pointer to hb_reduction_t
+ * @return the number of records reduced, or -1 if fields selects accuracy or
+ * power fields this implementation does not record
+ */
+int64_t hb_reduce_history(heartbeat_t volatile * hb,
+                          int64_t n,
+                          uint32_t fields,
+                          hb_reduction_t* out);
+
 /**
  * Returns the minimum desired heart rate
  *
@@ -126,6 +324,83 @@ double hb_get_windowed_rate(heartbeat_t volatile * hb);
  */
 double hb_get_instant_rate(heartbeat_t volatile * hb);
 
+/**
+ * Returns the heart rate expected horizon_ns after the last heartbeat,
+ * extrapolated from a Holt (level plus trend) forecast of the instant rate
+ * that is updated on every heartbeat. Unlike the window rate it does not lag
+ * behind changes by half a window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param horizon_ns int64_t
+ * @return the forecast heart rate (double), 0 before two heartbeats
+ */
+double hb_get_forecast_rate(heartbeat_t volatile * hb, int64_t horizon_ns);
+
+/**
+ * Copies the resource usage over the last sampling interval (see
+ * heartbeat_set_rusage_sampling()).
+ *
+ * @param hb pointer to heartbeat_t
+ * @param rusage pointer to hb_rusage_t
+ * @return 0, or -1 if no interval has been sampled yet or a sample could
+ *   not be read because it stayed in progress
+ */
+int hb_get_rusage(heartbeat_t volatile * hb, hb_rusage_t* rusage);
+
+/**
+ * Returns the fraction of the total work (see heartbeat_set_total_work())
+ * done so far.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the progress (double), 0 without a total
+ */
+double hb_get_progress(heartbeat_t volatile * hb);
+
+/**
+ * Returns the estimated completion time, in the clock of the record
+ * timestamps, and optionally bounds around it. The estimate runs the next
+ * window's worth of work at the window rate and the rest at the global rate;
+ * the bounds widen with the spread of the intervals and with disagreement
+ * between the two rates. Once the work is done all three are the timestamp
+ * of the heartbeat that finished it.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param low pointer to int64_t for the early bound, or NULL
+ * @param high pointer to int64_t for the late bound, or NULL
+ * @return the completion time (int64_t), 0 while unknown
+ */
+int64_t hb_get_eta(heartbeat_t volatile * hb, int64_t* low, int64_t* high);
+
+/**
+ * Returns the heart rate per CPU-second since heartbeat_set_cpu_clock().
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the rate (double), 0 if CPU-time rates are off
+ */
+double hb_get_global_cpu_rate(heartbeat_t volatile * hb);
+
+/**
+ * Returns the heart rate per CPU-second over the current window.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+double hb_get_windowed_cpu_rate(heartbeat_t volatile * hb);
+
+/**
+ * Returns the heart rate per CPU-second of the last heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+double hb_get_instant_cpu_rate(heartbeat_t volatile * hb);
+
+/**
+ * Returns the time heartbeats were held back by pacing (see
+ * heartbeat_set_pacing()), in nanoseconds.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+int64_t hb_get_pacing_time(heartbeat_t volatile * hb);
+
 /**
  * Returns the heartbeat number for this record.
  *
@@ -0,0 +1,351 @@
+/**
+ * Header-only C++17 interface to the Heartbeats API.
+ *
+ * hb::Heartbeat<Metrics...> owns a heartbeat_t and finishes it when it goes
+ * out of scope. The Metrics parameters name the values being tracked and must
+ * be supported by the heartbeat implementation selected with the same macros
+ * used to build the libraries:
+ *
+ *   hb::Heartbeat<hb::rate>                         libhb-shared.so
+ *   hb::Heartbeat<hb::rate, hb::accuracy>           libhb-acc-shared.so
+ *     (compile with -DHEARTBEAT_MODE_ACC)
+ *   hb::Heartbeat<hb::rate, hb::accuracy, hb::power> libhb-acc-pow-shared.so
+ *     (compile with -DHEARTBEAT_MODE_ACC_POW)
+ *
+ * Asking for a metric the selected implementation does not provide is a
+ * compile error, and using accuracy or power against the wrong library is a
+ * link error. Accessors and history views read the shared records directly
+ * through the -types headers, so they are inlined into the caller.
+ */
+#ifndef _HEARTBEAT_HPP_
+#define _HEARTBEAT_HPP_
+
+#if defined(HEARTBEAT_MODE_ACC_POW)
+#include "heartbeat-accuracy-power.h"
+#elif defined(HEARTBEAT_MODE_ACC)
+#include "heartbeat-accuracy.h"
+#else
+#include "heartbeat.h"
+#endif
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace hb {
+
+/** Metric tags */
+struct rate {};
+struct accuracy {};
+struct power {};
+
+namespace detail {
+
+template<typename T, typename... Ts>
+struct contains : std::disjunction<std::is_same<T, Ts>...> {};
+
+#if defined(HEARTBEAT_MODE_ACC_POW)
+constexpr bool has_accuracy = true;
+constexpr bool has_power = true;
+#elif defined(HEARTBEAT_MODE_ACC)
+constexpr bool has_accuracy = true;
+constexpr bool has_power = false;
+#else
+constexpr bool has_accuracy = false;
+constexpr bool has_power = false;
+#endif
+
+inline int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace detail
+
+/**
+ * Target bounds and sizes passed to the underlying init function. Accuracy
+ * and power fields are ignored unless the metric is tracked.
+ */
+struct config {
+  int64_t window_size = 20;
+  int64_t buffer_depth = 100;
+  const char* log_name = nullptr;
+  double min_rate = 0.0;
+  double max_rate = 0.0;
+  double min_accuracy = 0.0;
+  double max_accuracy = 0.0;
+  double min_power = 0.0;
+  double max_power = 0.0;
+#if defined(HEARTBEAT_MODE_ACC_POW)
+  /* ownership passes to the heartbeat, as with heartbeat_acc_pow_init */
+  uint64_t num_energy_impls = 0;
+  hb_energy_impl* energy_impls = nullptr;
+#endif
+};
+
+/**
+ * A read-only, wrap-aware view over the most recent records in the shared
+ * log. Iteration runs oldest to newest without copying; records may be
+ * overwritten by the application while the view is in use.
+ */
+class history_view {
+ public:
+  class iterator {
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = heartbeat_record_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const heartbeat_record_t*;
+    using reference = const heartbeat_record_t&;
+
+    iterator() = default;
+    iterator(const heartbeat_record_t* log, int64_t depth, int64_t pos)
+      : log_(log), depth_(depth), pos_(pos) {}
+
+    reference operator*() const { return log_[pos_ % depth_]; }
+    pointer operator->() const { return &log_[pos_ % depth_]; }
+    reference operator[](difference_type n) const { return *(*this + n); }
+
+    iterator& operator++() { ++pos_; return *this; }
+    iterator operator++(int) { iterator t = *this; ++pos_; return t; }
+    iterator& operator--() { --pos_; return *this; }
+    iterator operator--(int) { iterator t = *this; --pos_; return t; }
+    iterator& operator+=(difference_type n) { pos_ += n; return *this; }
+    iterator& operator-=(difference_type n) { pos_ -= n; return *this; }
+    friend iterator operator+(iterator it, difference_type n) { return it += n; }
+    friend iterator operator+(difference_type n, iterator it) { return it += n; }
+    friend iterator operator-(iterator it, difference_type n) { return it -= n; }
+    friend difference_type operator-(const iterator& a, const iterator& b) {
+      return (difference_type) (a.pos_ - b.pos_);
+    }
+    friend bool operator==(const iterator& a, const iterator& b) { return a.pos_ == b.pos_; }
+    friend bool operator!=(const iterator& a, const iterator& b) { return a.pos_ != b.pos_; }
+    friend bool operator<(const iterator& a, const iterator& b) { return a.pos_ < b.pos_; }
+    friend bool operator>(const iterator& a, const iterator& b) { return a.pos_ > b.pos_; }
+    friend bool operator<=(const iterator& a, const iterator& b) { return a.pos_ <= b.pos_; }
+    friend bool operator>=(const iterator& a, const iterator& b) { return a.pos_ >= b.pos_; }
+
+   private:
+    const heartbeat_record_t* log_ = nullptr;
+    int64_t depth_ = 1;
+    int64_t pos_ = 0;
+  };
+
+  history_view(const heartbeat_record_t* log, int64_t depth,
+               int64_t start, int64_t count)
+    : log_(log), depth_(depth), start_(start), count_(count) {}
+
+  iterator begin() const { return iterator(log_, depth_, start_); }
+  iterator end() const { return iterator(log_, depth_, start_ + count_); }
+  std::size_t size() const { return (std::size_t) count_; }
+  bool empty() const { return count_ == 0; }
+  const heartbeat_record_t& operator[](std::size_t i) const { return begin()[(std::ptrdiff_t) i]; }
+  const heartbeat_record_t& front() const { return *begin(); }
+  const heartbeat_record_t& back() const { return *(end() - 1); }
+
+ private:
+  const heartbeat_record_t* log_;
+  int64_t depth_;
+  int64_t start_;
+  int64_t count_;
+};
+
+/**
+ * Measures the latency between construction and end() (or destruction) and
+ * issues a heartbeat when the span ends.
+ */
+template<typename HB>
+class span {
+ public:
+  span(HB& hb, int tag) : hb_(&hb), tag_(tag), begin_(detail::now_ns()) {}
+  span(span&& other) noexcept
+    : hb_(std::exchange(other.hb_, nullptr)), tag_(other.tag_), begin_(other.begin_) {}
+  span(const span&) = delete;
+  span& operator=(const span&) = delete;
+  span& operator=(span&&) = delete;
+  ~span() { end(); }
+
+  /**
+   * Ends the span and issues its heartbeat; later calls do nothing.
+   *
+   * @return the span latency in nanoseconds, or -1 if already ended
+   */
+  int64_t end() {
+    if (hb_ == nullptr) {
+      return -1;
+    }
+    int64_t latency = detail::now_ns() - begin_;
+    hb_->beat(tag_);
+    hb_ = nullptr;
+    return latency;
+  }
+
+  /** Nanoseconds since the span began */
+  int64_t elapsed() const { return detail::now_ns() - begin_; }
+
+ private:
+  HB* hb_;
+  int tag_;
+  int64_t begin_;
+};
+
+template<typename... Metrics>
+class Heartbeat {
+  static_assert(detail::contains<rate, Metrics...>::value,
+                "hb::Heartbeat must track hb::rate");
+  static_assert(!detail::contains<accuracy, Metrics...>::value || detail::has_accuracy,
+                "hb::accuracy requires HEARTBEAT_MODE_ACC or HEARTBEAT_MODE_ACC_POW");
+  static_assert(!detail::contains<power, Metrics...>::value || detail::has_power,
+                "hb::power requires HEARTBEAT_MODE_ACC_POW");
+
+ public:
+  template<typename M>
+  static constexpr bool tracks = detail::contains<M, Metrics...>::value;
+
+  explicit Heartbeat(const config& cfg = config()) {
+#if defined(HEARTBEAT_MODE_ACC_POW)
+    hb_ = heartbeat_acc_pow_init(cfg.window_size, cfg.buffer_depth, cfg.log_name,
+                                 cfg.min_rate, cfg.max_rate,
+                                 cfg.min_accuracy, cfg.max_accuracy,
+                                 cfg.num_energy_impls, cfg.energy_impls,
+                                 cfg.min_power, cfg.max_power);
+#else
+    hb_ = heartbeat_init(cfg.window_size, cfg.buffer_depth, cfg.log_name,
+                         cfg.min_rate, cfg.max_rate);
+#endif
+    if (hb_ == nullptr) {
+      throw std::runtime_error("heartbeat initialization failed");
+    }
+#if defined(HEARTBEAT_MODE_ACC)
+    hb_->state->min_accuracy = cfg.min_accuracy;
+    hb_->state->max_accuracy = cfg.max_accuracy;
+#endif
+  }
+
+  Heartbeat(int64_t window_size, int64_t buffer_depth, const char* log_name,
+            double min_rate, double max_rate)
+    : Heartbeat(make_config(window_size, buffer_depth, log_name, min_rate, max_rate)) {}
+
+  Heartbeat(Heartbeat&& other) noexcept : hb_(std::exchange(other.hb_, nullptr)) {}
+  Heartbeat& operator=(Heartbeat&& other) noexcept {
+    if (this != &other) {
+      reset();
+      hb_ = std::exchange(other.hb_, nullptr);
+    }
+    return *this;
+  }
+  Heartbeat(const Heartbeat&) = delete;
+  Heartbeat& operator=(const Heartbeat&) = delete;
+  ~Heartbeat() { reset(); }
+
+  /** Registers a heartbeat */
+  int64_t beat(int tag = 0) {
+    return heartbeat(hb_, tag);
+  }
+
+  /** Registers a heartbeat with an accuracy value */
+  int64_t beat(int tag, double acc) {
+    static_assert(tracks<accuracy>, "beat(tag, accuracy) requires hb::accuracy");
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+    return heartbeat_acc(hb_, tag, acc);
+#else
+    (void) acc;
+    return heartbeat(hb_, tag);
+#endif
+  }
+
+  /** Starts a span that beats with the given tag when it ends */
+  span<Heartbeat> scope(int tag = 0) { return span<Heartbeat>(*this, tag); }
+
+  int64_t window_size() const { return hb_->state->window_size; }
+  int64_t buffer_depth() const { return hb_->state->buffer_depth; }
+  int64_t count() const { return hb_->state->counter; }
+  double min_rate() const { return hb_->state->min_heartrate; }
+  double max_rate() const { return hb_->state->max_heartrate; }
+
+  /** Returns a copy of the most recent record */
+  heartbeat_record_t current() const { return hb_->log[hb_->state->read_index]; }
+  double global_rate() const { return current_record().global_rate; }
+  double window_rate() const { return current_record().window_rate; }
+  double instant_rate() const { return current_record().instant_rate; }
+
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+  double min_accuracy() const { return hb_->state->min_accuracy; }
+  double max_accuracy() const { return hb_->state->max_accuracy; }
+  double global_accuracy() const { return current_record().global_accuracy; }
+  double window_accuracy() const { return current_record().window_accuracy; }
+  double instant_accuracy() const { return current_record().instant_accuracy; }
+#endif
+
+#if defined(HEARTBEAT_MODE_ACC_POW)
+  double min_power() const { return hb_->state->min_power; }
+  double max_power() const { return hb_->state->max_power; }
+  double global_power() const { return current_record().global_power; }
+  double window_power() const { return current_record().window_power; }
+  double instant_power() const { return current_record().instant_power; }
+#endif
+
+  /**
+   * Returns a view over the last n records (fewer if not yet available),
+   * oldest first.
+   */
+  history_view history(int64_t n) const {
+    int64_t depth = hb_->state->buffer_depth;
+    int64_t filled = hb_->state->counter - hb_->state->log_start;
+    int64_t avail = filled < depth ? filled : depth;
+    if (n > avail) {
+      n = avail;
+    }
+    if (n < 0) {
+      n = 0;
+    }
+    int64_t start = (hb_->state->buffer_index - n + depth) % depth;
+    return history_view(hb_->log, depth, start, n);
+  }
+
+  /** Returns a view over every record still held in the log */
+  history_view history() const { return history(hb_->state->buffer_depth); }
+
+  /** Copies the last n records out of the shared log, oldest first */
+  std::vector<heartbeat_record_t> copy_history(int64_t n) const {
+    history_view v = history(n);
+    return std::vector<heartbeat_record_t>(v.begin(), v.end());
+  }
+
+  heartbeat_t* native_handle() const { return hb_; }
+
+  /** Finishes the heartbeat early; the object is empty afterward */
+  void reset() {
+    if (hb_ != nullptr) {
+      heartbeat_finish(hb_);
+      hb_ = nullptr;
+    }
+  }
+
+ private:
+  static config make_config(int64_t window_size, int64_t buffer_depth,
+                            const char* log_name, double min_rate, double max_rate) {
+    config cfg;
+    cfg.window_size = window_size;
+    cfg.buffer_depth = buffer_depth;
+    cfg.log_name = log_name;
+    cfg.min_rate = min_rate;
+    cfg.max_rate = max_rate;
+    return cfg;
+  }
+
+  const heartbeat_record_t& current_record() const {
+    return hb_->log[hb_->state->read_index];
+  }
+
+  heartbeat_t* hb_ = nullptr;
+};
+
+} // namespace hb
+
+#endif
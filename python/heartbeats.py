@@ -0,0 +1,262 @@
+"""
+Zero-copy access to heartbeat records from Python.
+
+Attaches to a running heartbeat-enabled application through libhrm-shared.so
+and exposes its record ring as a NumPy structured array backed directly by
+the shared memory segment, so analysis does not need to parse log files:
+
+    import heartbeats
+    mon = heartbeats.Monitor(pid)
+    recs = mon.records            # live view of the whole ring, no copy
+    hist = mon.snapshot()         # consistent copy, oldest record first
+    print(hist['window_rate'].mean())
+
+The record layout (rate, accuracy, power) is detected from the shared state.
+Views returned by records and segments() are only valid until close(), or
+until the application resizes its log (see refresh()).
+
+The library is loaded from HEARTBEAT_HRM_LIB if set, then from ../lib next
+to this file, then from the system library path.
+"""
+
+import ctypes
+import ctypes.util
+import os
+
+import numpy as np
+
+HB_FEATURE_ACCURACY = 0x1
+HB_FEATURE_POWER = 0x2
+HB_FEATURE_COUNTERS = 0x4
+
+
+class _GlobalState(ctypes.Structure):
+    """Common prefix of _HB_global_state_t (see heartbeat-types.h)."""
+    _fields_ = [
+        ("pid", ctypes.c_int),
+        ("window_size", ctypes.c_int64),
+        ("counter", ctypes.c_int64),
+        ("buffer_depth", ctypes.c_int64),
+        ("buffer_index", ctypes.c_int64),
+        ("read_index", ctypes.c_int64),
+        ("valid", ctypes.c_char),
+        ("min_heartrate", ctypes.c_double),
+        ("max_heartrate", ctypes.c_double),
+        ("record_size", ctypes.c_int64),
+        ("features", ctypes.c_int64),
+        ("effective_window", ctypes.c_int64),
+        ("forecast_timestamp", ctypes.c_int64),
+        ("rate_level", ctypes.c_double),
+        ("rate_trend", ctypes.c_double),
+        ("power_level", ctypes.c_double),
+        ("power_trend", ctypes.c_double),
+        ("command_head", ctypes.c_uint64),
+        ("command_tail", ctypes.c_uint64),
+        ("commands", ctypes.c_byte * (16 * 40)),
+        ("log_generation", ctypes.c_uint64),
+        ("log_start", ctypes.c_int64),
+    ]
+
+
+class _HeartRateMonitor(ctypes.Structure):
+    """heart_rate_monitor_t (see heart_rate_monitor.h)."""
+    _fields_ = [
+        ("state", ctypes.POINTER(_GlobalState)),
+        ("log", ctypes.c_void_p),
+        ("file", ctypes.c_void_p),
+        ("filename", ctypes.c_char * 256),
+        ("generation", ctypes.c_uint64),
+        ("log_depth", ctypes.c_int64),
+    ]
+
+
+def _load_library():
+    candidates = []
+    if os.environ.get("HEARTBEAT_HRM_LIB"):
+        candidates.append(os.environ["HEARTBEAT_HRM_LIB"])
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates.append(os.path.join(here, os.pardir, "lib", "libhrm-shared.so"))
+    found = ctypes.util.find_library("hrm-shared")
+    if found:
+        candidates.append(found)
+    candidates.append("libhrm-shared.so")
+    mismatch = None
+    for path in candidates:
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        lib.heart_rate_monitor_init.argtypes = [ctypes.POINTER(_HeartRateMonitor), ctypes.c_int]
+        lib.heart_rate_monitor_init.restype = ctypes.c_int
+        lib.heart_rate_monitor_finish.argtypes = [ctypes.POINTER(_HeartRateMonitor)]
+        lib.heart_rate_monitor_finish.restype = None
+        lib.hrm_refresh.argtypes = [ctypes.POINTER(_HeartRateMonitor)]
+        lib.hrm_refresh.restype = ctypes.c_int
+        # a library whose heart_rate_monitor_t differs would be written past
+        # the end of _HeartRateMonitor
+        if not hasattr(lib, "hrm_monitor_size"):
+            mismatch = "%s is too old for this module" % path
+            continue
+        lib.hrm_monitor_size.argtypes = []
+        lib.hrm_monitor_size.restype = ctypes.c_size_t
+        if lib.hrm_monitor_size() != ctypes.sizeof(_HeartRateMonitor):
+            mismatch = "%s has a %d-byte heart_rate_monitor_t, _HeartRateMonitor is %d" % (
+                path, lib.hrm_monitor_size(), ctypes.sizeof(_HeartRateMonitor))
+            continue
+        return lib
+    if mismatch:
+        raise OSError(mismatch)
+    raise OSError("cannot load libhrm-shared.so; set HEARTBEAT_HRM_LIB")
+
+
+_lib = None
+
+
+def record_dtype(features=0, record_size=None):
+    """NumPy dtype matching the records of an application with the given
+    HB_FEATURE_* bits."""
+    names = ["beat", "tag", "timestamp", "global_rate", "window_rate", "instant_rate"]
+    formats = ["<i8", "<i4", "<i8", "<f8", "<f8", "<f8"]
+    offsets = [0, 8, 16, 24, 32, 40]
+    off = 48
+    if features & HB_FEATURE_ACCURACY:
+        names += ["global_accuracy", "window_accuracy", "instant_accuracy"]
+        formats += ["<f8"] * 3
+        offsets += [off, off + 8, off + 16]
+        off += 24
+    if features & HB_FEATURE_POWER:
+        names += ["global_power", "window_power", "instant_power"]
+        formats += ["<f8"] * 3
+        offsets += [off, off + 8, off + 16]
+        off += 24
+    if features & HB_FEATURE_COUNTERS:
+        names += ["ipc", "misses", "mhz"]
+        formats += ["<f8"] * 3
+        offsets += [off, off + 8, off + 16]
+        off += 24
+    return np.dtype({"names": names, "formats": formats, "offsets": offsets,
+                     "itemsize": record_size if record_size else off})
+
+
+def list_apps(enabled_dir=None):
+    """Return the pids registered in HEARTBEAT_ENABLED_DIR."""
+    enabled_dir = enabled_dir or os.environ.get("HEARTBEAT_ENABLED_DIR")
+    if not enabled_dir:
+        raise RuntimeError("HEARTBEAT_ENABLED_DIR is not set")
+    return sorted(int(f) for f in os.listdir(enabled_dir) if f.isdigit())
+
+
+class Monitor(object):
+    """Attaches to the heartbeat of process pid."""
+
+    def __init__(self, pid):
+        global _lib
+        if _lib is None:
+            _lib = _load_library()
+        self.pid = pid
+        self._hrm = _HeartRateMonitor()
+        if _lib.heart_rate_monitor_init(ctypes.byref(self._hrm), pid) != 0:
+            _lib.heart_rate_monitor_finish(ctypes.byref(self._hrm))
+            raise OSError("cannot attach to heartbeat of pid %d" % pid)
+        self.state = self._hrm.state.contents
+        self.dtype = record_dtype(self.state.features, self.state.record_size)
+        self._map()
+
+    def _map(self):
+        # the attached segment, which the application may already be
+        # replacing with one of another depth
+        depth = self._hrm.log_depth
+        buf = (ctypes.c_char * (depth * self.state.record_size)).from_address(self._hrm.log)
+        self._records = np.frombuffer(buf, dtype=self.dtype, count=depth)
+        self._records.flags.writeable = False
+
+    def refresh(self):
+        """Follow the log if the application moved it to a new segment
+        (heartbeat_set_buffer_depth). Returns True if it moved, in which case
+        earlier views no longer track the application."""
+        if self.state.log_generation == self._hrm.generation:
+            return False
+        if _lib.hrm_refresh(ctypes.byref(self._hrm)) < 0:
+            raise OSError("cannot re-attach to heartbeat of pid %d" % self.pid)
+        self._map()
+        return True
+
+    def close(self):
+        """Detach from the application. Invalidates all views."""
+        if self._hrm.state:
+            self._records = None
+            self.state = None
+            _lib.heart_rate_monitor_finish(ctypes.byref(self._hrm))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    @property
+    def records(self):
+        """The whole ring as a live, read-only view in storage order."""
+        self.refresh()
+        return self._records
+
+    @property
+    def count(self):
+        """Number of heartbeats registered so far."""
+        return self.state.counter
+
+    def current(self):
+        """Copy of the most recent record, or None before the first beat."""
+        self.refresh()
+        if self.state.valid in (b"", b"\0"):
+            return None
+        index = self.state.read_index
+        if index >= len(self._records):
+            return None  # the log is being resized
+        return self._records[index].copy()
+
+    def segments(self, n=None):
+        """Live views covering the last n records (default: all available),
+        oldest first, as one or two arrays split where the ring wraps."""
+        self.refresh()
+        depth = len(self._records)
+        end = self.state.buffer_index
+        if end > depth:
+            # the application is moving to a larger log; nothing here is current
+            return [self._records[:0]]
+        avail = min(self.state.counter - self.state.log_start, depth)
+        n = avail if n is None else max(0, min(n, avail))
+        start = end - n
+        if start >= 0:
+            return [self._records[start:end]]
+        return [self._records[depth + start:], self._records[:end]]
+
+    def ordered(self, n=None):
+        """Copy of the last n records, oldest first. May be torn if the
+        application is beating; see snapshot()."""
+        segs = self.segments(n)
+        return segs[0].copy() if len(segs) == 1 else np.concatenate(segs)
+
+    def snapshot(self, n=None, retries=100):
+        """Consistent copy of the last n records, oldest first.
+
+        Records are overwritten in place by the application, so the copy is
+        validated by checking that beat numbers are consecutive and that
+        nothing it covers was overwritten while copying; otherwise it is
+        retried.
+        """
+        for _ in range(retries):
+            before = self.state.counter
+            out = self.ordered(n)
+            after = self.state.counter
+            depth = len(self._records)
+            if len(out) == 0:
+                if self.state.buffer_index > depth:
+                    continue  # the log is being resized
+                return out
+            overwritten = after - depth  # records with beat < this may be gone
+            if out["beat"][0] >= overwritten and \
+                    (len(out) < 2 or np.all(np.diff(out["beat"]) == 1)) and \
+                    out["beat"][-1] >= before - 1:
+                return out
+        raise RuntimeError("could not take a consistent snapshot")
@@ -10,6 +10,7 @@
 #include <string.h>
 #include "heart_rate_monitor.h"
 #include "heartbeat-types.h"
+#include "heartbeat-actuator.h"
 #include <assert.h>
 #include <wait.h>
 #include <unistd.h>
@@ -124,7 +125,15 @@ int main(int argc, char** argv) {
   int64_t window_size =  hrm_get_window_size(&heart);
   int wait_for = (int) window_size;
   int current_beat = 0;
-  int nprocs = 1;
+  int nprocs;
+  hb_actuator_t* cores = hb_actuator_affinity(apps[0]);
+  if (cores == NULL) {
+    fprintf(stderr, "ERROR: cannot change the affinity of %d\n", apps[0]);
+    return 1;
+  }
+  const hb_actuator_info_t* cores_info = hb_actuator_info(cores);
+  // the application starts unconstrained, i.e. on every core
+  nprocs = (int) cores_info->max;
   printf("Current beat is %d, wait_for = %d\n", current_beat, wait_for);
 
   // return 1;
@@ -132,7 +141,6 @@ int main(int argc, char** argv) {
   while(current_beat < MAX-1) {
     int rc = -1;
     heartbeat_record_t record;
-    char command[256];
 
 
       while (rc != 0 || record.window_rate == 0.0000 ){
@@ -145,17 +153,15 @@ int main(int argc, char** argv) {
 
       printf("Current beat is %d, wait_for = %d, %f\n", current_beat, wait_for, record.window_rate);
 
-      if(record.window_rate < hrm_get_min_rate(&heart)) {
+      if(record.window_rate < hrm_get_min_rate(&heart) && nprocs < cores_info->max) {
 	nprocs++;
-	sprintf(command, "taskset -pc 0-%d %d >& /dev/null",nprocs-1,apps[0]);
-	printf("Executing %s\n", command);
-	system(command);
+	printf("Running on %d cores\n", nprocs);
+	hb_actuator_set(cores, nprocs);
 	wait_for = current_beat + window_size;
       }
-      else if(record.window_rate > hrm_get_max_rate(&heart)) {
+      else if(record.window_rate > hrm_get_max_rate(&heart) && nprocs > cores_info->min) {
 	nprocs--;
-	sprintf(command, "taskset -pc 0-%d %d >& /dev/null",nprocs-1,apps[0]);
-	system(command);
+	hb_actuator_set(cores, nprocs);
 	wait_for = current_beat + window_size;
       }
       else {
@@ -174,6 +180,7 @@ int main(int argc, char** argv) {
     printf("%d, %f\n", records[i].tag, records[i].rate);
   }
   heart_rate_monitor_finish(&heart);
+  hb_actuator_close(cores);
 #endif
 
   return 0;
@@ -0,0 +1,565 @@
+/**
+ * Heartbeats for applications that cannot be modified, by LD_PRELOAD.
+ *
+ * libhb-auto.so creates a heartbeat (libhb-acc-shared.so) when the process
+ * starts and registers beats when configured events happen:
+ *
+ *   HB_AUTO_CALLS  comma-separated libc calls, each name[@fd][/N]: beat once
+ *                  every N successful calls (default 1), only on file
+ *                  descriptor fd if given. Supported calls: read, write, readv,
+ *                  writev, send, sendto, sendmsg, recv, recvfrom, recvmsg,
+ *                  accept, accept4.
+ *   HB_AUTO_FUNCS  comma-separated function names, each name[/N]: beat once
+ *                  every N calls to a function that is called across shared
+ *                  object boundaries (through the PLT/GOT). x86-64 only.
+ *
+ * For example, one beat per 10 messages sent on fd 5:
+ *
+ *   HEARTBEAT_ENABLED_DIR=/tmp/hb HB_AUTO_CALLS=sendmsg@5/10 \
+ *     LD_PRELOAD=libhb-auto.so ./server
+ *
+ * Other settings: HB_AUTO_WINDOW (default 20), HB_AUTO_BUFFER_DEPTH
+ * (default 100), HB_AUTO_LOG (log file, default none), HB_AUTO_MIN_RATE and
+ * HB_AUTO_MAX_RATE (targets, default 0), and HB_AUTO_CHUNK (default 1): each
+ * thread counts beats on its own and only takes the heartbeat lock to publish
+ * them with heartbeat_n() once it has HB_AUTO_CHUNK of them, so up to
+ * HB_AUTO_CHUNK - 1 beats per thread may still be pending at any time.
+ *
+ * The tag of a beat is the index of its event, calls first, then functions.
+ * Calls made inside libc (e.g. by stdio) and calls a shared object makes to
+ * its own functions do not go through the PLT and are not seen. Function
+ * hooks are installed at startup in the objects loaded at that time; vector
+ * arguments wider than 128 bits are not preserved by the trampolines.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "heartbeat.h"
+
+#define HB_AUTO_MAX_EVENTS 32
+#define HB_AUTO_MAX_FUNCS 8
+#define HB_AUTO_TLS __attribute__((tls_model("initial-exec")))
+#define HB_AUTO_HIDDEN __attribute__((visibility("hidden")))
+
+typedef struct {
+  char name[64];
+  int fd;
+  int64_t every;
+} hb_auto_event_t;
+
+enum {
+  HB_AUTO_CALL_READ,
+  HB_AUTO_CALL_WRITE,
+  HB_AUTO_CALL_READV,
+  HB_AUTO_CALL_WRITEV,
+  HB_AUTO_CALL_SEND,
+  HB_AUTO_CALL_SENDTO,
+  HB_AUTO_CALL_SENDMSG,
+  HB_AUTO_CALL_RECV,
+  HB_AUTO_CALL_RECVFROM,
+  HB_AUTO_CALL_RECVMSG,
+  HB_AUTO_CALL_ACCEPT,
+  HB_AUTO_CALL_ACCEPT4,
+  HB_AUTO_NCALLS
+};
+
+static const char* hb_auto_call_names[HB_AUTO_NCALLS] = {
+  "read", "write", "readv", "writev", "send", "sendto", "sendmsg",
+  "recv", "recvfrom", "recvmsg", "accept", "accept4"
+};
+
+static heartbeat_t* hb_auto_hb = NULL;
+static hb_auto_event_t hb_auto_events[HB_AUTO_MAX_EVENTS];
+static int hb_auto_nevents = 0;
+static int64_t hb_auto_chunk = 1;
+/* event of each libc call, or -1 if the call is not watched */
+static int hb_auto_call_event[HB_AUTO_NCALLS];
+/* event of each function trampoline */
+static int hb_auto_func_event[HB_AUTO_MAX_FUNCS];
+static int hb_auto_nfuncs = 0;
+
+/* per-thread shards: event counts and beats not yet published */
+static __thread int64_t hb_auto_counts[HB_AUTO_MAX_EVENTS] HB_AUTO_TLS;
+static __thread int64_t hb_auto_pending HB_AUTO_TLS;
+/* set while this thread is inside the heartbeat library */
+static __thread int hb_auto_busy HB_AUTO_TLS;
+
+static void hb_auto_hit(int event) {
+  int saved_errno;
+  if (hb_auto_hb == NULL || hb_auto_busy) {
+    return;
+  }
+  if (++hb_auto_counts[event] < hb_auto_events[event].every) {
+    return;
+  }
+  hb_auto_counts[event] = 0;
+  if (++hb_auto_pending < hb_auto_chunk) {
+    return;
+  }
+  saved_errno = errno;
+  hb_auto_busy = 1;
+  heartbeat_n(hb_auto_hb, event, hb_auto_pending);
+  hb_auto_pending = 0;
+  hb_auto_busy = 0;
+  errno = saved_errno;
+}
+
+static inline void hb_auto_call_hit(int call, int fd) {
+  int event = hb_auto_call_event[call];
+  if (event >= 0 &&
+      (hb_auto_events[event].fd < 0 || hb_auto_events[event].fd == fd)) {
+    hb_auto_hit(event);
+  }
+}
+
+/* ---- function trampolines ---- */
+
+#if defined(__x86_64__)
+
+void* hb_auto_func_real[HB_AUTO_MAX_FUNCS] HB_AUTO_HIDDEN;
+extern char hb_auto_tramps[] HB_AUTO_HIDDEN;
+void hb_auto_func_hit(int slot) HB_AUTO_HIDDEN;
+
+void hb_auto_func_hit(int slot) {
+  hb_auto_hit(hb_auto_func_event[slot]);
+}
+
+/*
+ * 16-byte stubs load their slot into r11 and share a body that saves the
+ * argument registers (rax carries the vector count of variadic calls),
+ * counts the call and tail-jumps to the real function.
+ */
+__asm__(
+  ".text\n"
+  ".hidden hb_auto_tramps\n"
+  ".p2align 4\n"
+  "hb_auto_tramps:\n"
+  ".irp i,0,1,2,3,4,5,6,7\n"
+  "  .p2align 4\n"
+  "  movl $\\i, %r11d\n"
+  "  jmp hb_auto_tramp_body\n"
+  ".endr\n"
+  "hb_auto_tramp_body:\n"
+  "  pushq %rdi\n"
+  "  pushq %rsi\n"
+  "  pushq %rdx\n"
+  "  pushq %rcx\n"
+  "  pushq %r8\n"
+  "  pushq %r9\n"
+  "  pushq %rax\n"
+  "  pushq %r11\n"
+  "  subq $136, %rsp\n"
+  "  movdqu %xmm0, 0(%rsp)\n"
+  "  movdqu %xmm1, 16(%rsp)\n"
+  "  movdqu %xmm2, 32(%rsp)\n"
+  "  movdqu %xmm3, 48(%rsp)\n"
+  "  movdqu %xmm4, 64(%rsp)\n"
+  "  movdqu %xmm5, 80(%rsp)\n"
+  "  movdqu %xmm6, 96(%rsp)\n"
+  "  movdqu %xmm7, 112(%rsp)\n"
+  "  movl %r11d, %edi\n"
+  "  call hb_auto_func_hit\n"
+  "  movdqu 0(%rsp), %xmm0\n"
+  "  movdqu 16(%rsp), %xmm1\n"
+  "  movdqu 32(%rsp), %xmm2\n"
+  "  movdqu 48(%rsp), %xmm3\n"
+  "  movdqu 64(%rsp), %xmm4\n"
+  "  movdqu 80(%rsp), %xmm5\n"
+  "  movdqu 96(%rsp), %xmm6\n"
+  "  movdqu 112(%rsp), %xmm7\n"
+  "  addq $136, %rsp\n"
+  "  popq %r11\n"
+  "  popq %rax\n"
+  "  popq %r9\n"
+  "  popq %r8\n"
+  "  popq %rcx\n"
+  "  popq %rdx\n"
+  "  popq %rsi\n"
+  "  popq %rdi\n"
+  "  leaq hb_auto_func_real(%rip), %r10\n"
+  "  jmp *(%r10,%r11,8)\n"
+);
+
+/* Address of something in this object, to skip it when patching */
+static int hb_auto_self_marker;
+
+static int hb_auto_patch_object(struct dl_phdr_info* info, size_t size, void* data) {
+  const ElfW(Phdr)* dyn_phdr = NULL;
+  const ElfW(Phdr)* relro = NULL;
+  const ElfW(Dyn)* dyn;
+  const ElfW(Sym)* symtab = NULL;
+  const char* strtab = NULL;
+  const ElfW(Rela)* rels[2] = {NULL, NULL};
+  size_t relsz[2] = {0, 0};
+  ElfW(Addr) base = info->dlpi_addr;
+  ElfW(Addr) self = (ElfW(Addr)) &hb_auto_self_marker;
+  ElfW(Addr) lo, hi, addr, page;
+  size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+  size_t i, r;
+  unsigned long type;
+  const ElfW(Sym)* sym;
+  int f, h;
+  (void) size;
+  (void) data;
+
+  for (h = 0; h < info->dlpi_phnum; h++) {
+    if (info->dlpi_phdr[h].p_type == PT_DYNAMIC) {
+      dyn_phdr = &info->dlpi_phdr[h];
+    } else if (info->dlpi_phdr[h].p_type == PT_GNU_RELRO) {
+      relro = &info->dlpi_phdr[h];
+    } else if (info->dlpi_phdr[h].p_type == PT_LOAD) {
+      lo = base + info->dlpi_phdr[h].p_vaddr;
+      hi = lo + info->dlpi_phdr[h].p_memsz;
+      if (self >= lo && self < hi) {
+        return 0;
+      }
+    }
+  }
+  if (dyn_phdr == NULL || strstr(info->dlpi_name, "linux-vdso") != NULL) {
+    return 0;
+  }
+
+  // the loader has already relocated these pointers in most objects
+#define HB_AUTO_DYN_PTR(p) ((p) < base ? (p) + base : (p))
+  for (dyn = (const ElfW(Dyn)*) (base + dyn_phdr->p_vaddr); dyn->d_tag != DT_NULL; dyn++) {
+    switch (dyn->d_tag) {
+    case DT_SYMTAB:
+      symtab = (const ElfW(Sym)*) HB_AUTO_DYN_PTR(dyn->d_un.d_ptr);
+      break;
+    case DT_STRTAB:
+      strtab = (const char*) HB_AUTO_DYN_PTR(dyn->d_un.d_ptr);
+      break;
+    case DT_JMPREL:
+      rels[0] = (const ElfW(Rela)*) HB_AUTO_DYN_PTR(dyn->d_un.d_ptr);
+      break;
+    case DT_PLTRELSZ:
+      relsz[0] = dyn->d_un.d_val;
+      break;
+    case DT_RELA:
+      rels[1] = (const ElfW(Rela)*) HB_AUTO_DYN_PTR(dyn->d_un.d_ptr);
+      break;
+    case DT_RELASZ:
+      relsz[1] = dyn->d_un.d_val;
+      break;
+    }
+  }
+#undef HB_AUTO_DYN_PTR
+  if (symtab == NULL || strtab == NULL) {
+    return 0;
+  }
+
+  for (r = 0; r < 2; r++) {
+    for (i = 0; rels[r] != NULL && i < relsz[r] / sizeof(ElfW(Rela)); i++) {
+      type = ELF64_R_TYPE(rels[r][i].r_info);
+      if (type != R_X86_64_JUMP_SLOT && type != R_X86_64_GLOB_DAT) {
+        continue;
+      }
+      sym = &symtab[ELF64_R_SYM(rels[r][i].r_info)];
+      if (type == R_X86_64_GLOB_DAT && ELF64_ST_TYPE(sym->st_info) != STT_FUNC) {
+        continue;
+      }
+      for (f = 0; f < hb_auto_nfuncs; f++) {
+        if (strcmp(strtab + sym->st_name, hb_auto_events[hb_auto_func_event[f]].name) == 0) {
+          break;
+        }
+      }
+      if (f == hb_auto_nfuncs) {
+        continue;
+      }
+      addr = base + rels[r][i].r_offset;
+      page = addr & ~(ElfW(Addr)) (pagesize - 1);
+      if (mprotect((void*) page, pagesize, PROT_READ | PROT_WRITE)) {
+        perror("hb-auto: cannot unprotect GOT");
+        continue;
+      }
+      *(void**) addr = hb_auto_tramps + 16 * f;
+      if (relro != NULL && addr >= base + relro->p_vaddr &&
+          addr < base + relro->p_vaddr + relro->p_memsz) {
+        mprotect((void*) page, pagesize, PROT_READ);
+      }
+    }
+  }
+  return 0;
+}
+
+static void hb_auto_install_funcs(void) {
+  int f;
+  for (f = 0; f < hb_auto_nfuncs; f++) {
+    hb_auto_func_real[f] = dlsym(RTLD_DEFAULT, hb_auto_events[hb_auto_func_event[f]].name);
+    if (hb_auto_func_real[f] == NULL) {
+      fprintf(stderr, "hb-auto: function %s not found\n",
+              hb_auto_events[hb_auto_func_event[f]].name);
+      // leave the GOT entries alone by not matching the name
+      hb_auto_events[hb_auto_func_event[f]].name[0] = '\0';
+    }
+  }
+  dl_iterate_phdr(hb_auto_patch_object, NULL);
+}
+
+#else
+
+static void hb_auto_install_funcs(void) {
+  fprintf(stderr, "hb-auto: HB_AUTO_FUNCS is only supported on x86-64\n");
+}
+
+#endif
+
+/* ---- configuration ---- */
+
+/*
+ * Parses a list of name[@fd][/N] into events. Returns the number added.
+ */
+static int hb_auto_parse(const char* list, int allow_fd) {
+  char buf[1024];
+  char* save = NULL;
+  char* tok;
+  char* p;
+  hb_auto_event_t* ev;
+  int added = 0;
+
+  snprintf(buf, sizeof(buf), "%s", list);
+  for (tok = strtok_r(buf, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save)) {
+    if (hb_auto_nevents == HB_AUTO_MAX_EVENTS) {
+      fprintf(stderr, "hb-auto: too many events, ignoring %s\n", tok);
+      continue;
+    }
+    ev = &hb_auto_events[hb_auto_nevents];
+    ev->fd = -1;
+    ev->every = 1;
+    if ((p = strchr(tok, '/')) != NULL) {
+      *p = '\0';
+      ev->every = strtoll(p + 1, NULL, 10);
+      if (ev->every < 1) {
+        ev->every = 1;
+      }
+    }
+    if ((p = strchr(tok, '@')) != NULL) {
+      *p = '\0';
+      if (!allow_fd) {
+        fprintf(stderr, "hb-auto: ignoring fd filter on function %s\n", tok);
+      } else {
+        ev->fd = atoi(p + 1);
+      }
+    }
+    snprintf(ev->name, sizeof(ev->name), "%s", tok);
+    hb_auto_nevents++;
+    added++;
+  }
+  return added;
+}
+
+static double hb_auto_getenv_double(const char* name, double def) {
+  const char* val = getenv(name);
+  return val != NULL ? strtod(val, NULL) : def;
+}
+
+static void hb_auto_atfork_child(void) {
+  // the heartbeat belongs to the parent
+  hb_auto_hb = NULL;
+}
+
+static void __attribute__((constructor)) hb_auto_init(void) {
+  const char* calls = getenv("HB_AUTO_CALLS");
+  const char* funcs = getenv("HB_AUTO_FUNCS");
+  int i, c, first;
+
+  for (c = 0; c < HB_AUTO_NCALLS; c++) {
+    hb_auto_call_event[c] = -1;
+  }
+  if (calls != NULL) {
+    first = hb_auto_nevents;
+    hb_auto_parse(calls, 1);
+    for (i = first; i < hb_auto_nevents; i++) {
+      for (c = 0; c < HB_AUTO_NCALLS && strcmp(hb_auto_events[i].name, hb_auto_call_names[c]); c++);
+      if (c == HB_AUTO_NCALLS) {
+        fprintf(stderr, "hb-auto: unsupported call %s\n", hb_auto_events[i].name);
+      } else {
+        hb_auto_call_event[c] = i;
+      }
+    }
+  }
+  if (funcs != NULL) {
+    first = hb_auto_nevents;
+    hb_auto_parse(funcs, 0);
+    for (i = first; i < hb_auto_nevents && hb_auto_nfuncs < HB_AUTO_MAX_FUNCS; i++) {
+      hb_auto_func_event[hb_auto_nfuncs++] = i;
+    }
+    if (i < hb_auto_nevents) {
+      fprintf(stderr, "hb-auto: at most %d functions\n", HB_AUTO_MAX_FUNCS);
+    }
+  }
+  if (hb_auto_nevents == 0) {
+    return;
+  }
+
+  hb_auto_chunk = (int64_t) hb_auto_getenv_double("HB_AUTO_CHUNK", 1);
+  if (hb_auto_chunk < 1) {
+    hb_auto_chunk = 1;
+  }
+  hb_auto_busy = 1;
+  hb_auto_hb = heartbeat_init((int64_t) hb_auto_getenv_double("HB_AUTO_WINDOW", 20),
+                              (int64_t) hb_auto_getenv_double("HB_AUTO_BUFFER_DEPTH", 100),
+                              getenv("HB_AUTO_LOG"),
+                              hb_auto_getenv_double("HB_AUTO_MIN_RATE", 0),
+                              hb_auto_getenv_double("HB_AUTO_MAX_RATE", 0));
+  hb_auto_busy = 0;
+  if (hb_auto_hb == NULL) {
+    fprintf(stderr, "hb-auto: cannot create heartbeat (is HEARTBEAT_ENABLED_DIR set?)\n");
+    return;
+  }
+  pthread_atfork(NULL, NULL, hb_auto_atfork_child);
+  if (hb_auto_nfuncs > 0) {
+    hb_auto_install_funcs();
+  }
+}
+
+static void __attribute__((destructor)) hb_auto_fini(void) {
+  heartbeat_t* hb = hb_auto_hb;
+  if (hb != NULL) {
+    hb_auto_busy = 1;
+    if (hb_auto_pending > 0) {
+      heartbeat_n(hb, 0, hb_auto_pending);
+    }
+    hb_auto_hb = NULL;
+    heartbeat_finish(hb);
+  }
+}
+
+/* ---- libc interposers ---- */
+
+#define HB_AUTO_REAL(call) \
+  static __typeof__(call)* real_##call = NULL; \
+  if (real_##call == NULL) { \
+    real_##call = (__typeof__(call)*) dlsym(RTLD_NEXT, #call); \
+  }
+
+ssize_t read(int fd, void* buf, size_t count) {
+  ssize_t ret;
+  HB_AUTO_REAL(read);
+  ret = real_read(fd, buf, count);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_READ, fd);
+  }
+  return ret;
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  ssize_t ret;
+  HB_AUTO_REAL(write);
+  ret = real_write(fd, buf, count);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_WRITE, fd);
+  }
+  return ret;
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+  ssize_t ret;
+  HB_AUTO_REAL(readv);
+  ret = real_readv(fd, iov, iovcnt);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_READV, fd);
+  }
+  return ret;
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+  ssize_t ret;
+  HB_AUTO_REAL(writev);
+  ret = real_writev(fd, iov, iovcnt);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_WRITEV, fd);
+  }
+  return ret;
+}
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+  ssize_t ret;
+  HB_AUTO_REAL(send);
+  ret = real_send(fd, buf, len, flags);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_SEND, fd);
+  }
+  return ret;
+}
+
+ssize_t sendto(int fd, const void* buf, size_t len, int flags,
+               __CONST_SOCKADDR_ARG addr, socklen_t addrlen) {
+  ssize_t ret;
+  HB_AUTO_REAL(sendto);
+  ret = real_sendto(fd, buf, len, flags, addr, addrlen);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_SENDTO, fd);
+  }
+  return ret;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr* msg, int flags) {
+  ssize_t ret;
+  HB_AUTO_REAL(sendmsg);
+  ret = real_sendmsg(fd, msg, flags);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_SENDMSG, fd);
+  }
+  return ret;
+}
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+  ssize_t ret;
+  HB_AUTO_REAL(recv);
+  ret = real_recv(fd, buf, len, flags);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_RECV, fd);
+  }
+  return ret;
+}
+
+ssize_t recvfrom(int fd, void* buf, size_t len, int flags,
+                 __SOCKADDR_ARG addr, socklen_t* addrlen) {
+  ssize_t ret;
+  HB_AUTO_REAL(recvfrom);
+  ret = real_recvfrom(fd, buf, len, flags, addr, addrlen);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_RECVFROM, fd);
+  }
+  return ret;
+}
+
+ssize_t recvmsg(int fd, struct msghdr* msg, int flags) {
+  ssize_t ret;
+  HB_AUTO_REAL(recvmsg);
+  ret = real_recvmsg(fd, msg, flags);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_RECVMSG, fd);
+  }
+  return ret;
+}
+
+int accept(int fd, __SOCKADDR_ARG addr, socklen_t* addrlen) {
+  int ret;
+  HB_AUTO_REAL(accept);
+  ret = real_accept(fd, addr, addrlen);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_ACCEPT, fd);
+  }
+  return ret;
+}
+
+int accept4(int fd, __SOCKADDR_ARG addr, socklen_t* addrlen, int flags) {
+  int ret;
+  HB_AUTO_REAL(accept4);
+  ret = real_accept4(fd, addr, addrlen, flags);
+  if (ret >= 0) {
+    hb_auto_call_hit(HB_AUTO_CALL_ACCEPT4, fd);
+  }
+  return ret;
+}
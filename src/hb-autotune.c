@@ -0,0 +1,629 @@
+/**
+ * Find the Pareto-optimal configurations of a heartbeat-enabled workload
+ * across a grid of core counts, CPU frequencies and application knobs, and
+ * write them as a table runtime controllers can load (heartbeat-pareto.h).
+ *
+ * Each configuration is applied through the actuators (heartbeat-actuator.h)
+ * and application knobs, then measured over a number of heartbeats: heart
+ * rate from the records' timestamps, CPUs busy from the process CPU time,
+ * and power and accuracy as the mean instant values of the records when the
+ * application reports them. Knob k of the application is set by posting
+ * HB_CMD_USER with arg k and the setting in value[0], which the application
+ * applies from its command handler.
+ *
+ * The grid is searched by successive halving: every round measures the
+ * remaining configurations over eta times as many heartbeats as the round
+ * before and keeps the best 1/eta of them by Pareto rank, pruning points
+ * another point beats by more than the tolerance somewhere while being no
+ * worse than within it everywhere. The table holds the configurations of the
+ * last round no other one dominates.
+ *
+ * The workload is either started from the given command or, with -p, an
+ * application already running. Actuators are left unconstrained on exit
+ * and a started workload is terminated.
+ *
+ * Usage:
+ *   hb-autotune [-c cores] [-f freqs] [-k name=values]... [-b beats]
+ *               [-w warmup] [-e eta] [-r rounds] [-t tolerance]
+ *               [-T timeout_s] [-o table] (-p pid | command [args...])
+ *
+ * Lists of settings are comma separated; "all" takes every setting of a
+ * discrete actuator.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include "heart_rate_monitor.h"
+#include "heartbeat-types.h"
+#include "heartbeat-actuator.h"
+#include "heartbeat-pareto.h"
+
+#define HB_AT_DEFAULT_BEATS 20
+#define HB_AT_DEFAULT_WARMUP 2
+#define HB_AT_DEFAULT_ETA 3
+#define HB_AT_DEFAULT_ROUNDS 3
+#define HB_AT_DEFAULT_TOLERANCE 0.05
+#define HB_AT_DEFAULT_TIMEOUT_S 60
+#define HB_AT_MAX_VALUES 256
+#define HB_AT_MAX_CONFIGS 65536
+/* longest wait for an actuator to take effect (ns) */
+#define HB_AT_MAX_SETTLE_NS 1000000000LL
+#define HB_AT_POLL_NS 1000000L
+/* attempts to post a command while the application's queue is full */
+#define HB_AT_POST_RETRIES 1000
+
+#define HB_AT_CORES 0
+#define HB_AT_FREQ 1
+#define HB_AT_APP 2
+
+typedef struct {
+  char name[HB_PARETO_NAME_LEN];
+  int kind;
+  /* HB_CMD_USER arg of an application knob */
+  int64_t arg;
+  int64_t nvalues;
+  double values[HB_AT_MAX_VALUES];
+  /* setting last posted to the application */
+  double last;
+} hb_at_knob;
+
+typedef struct {
+  int64_t index;
+  int ok;
+  double rate;
+  double power;
+  double cpus;
+  double accuracy;
+} hb_at_config;
+
+static hb_at_knob knobs[HB_PARETO_MAX_KNOBS];
+static int64_t nknobs = 0;
+static hb_actuator_t* cores = NULL;
+static hb_actuator_t* freqs[CPU_SETSIZE];
+static int64_t nfreqs = 0;
+static heart_rate_monitor_t hrm;
+static heart_rate_monitor_t* hrms[1] = { &hrm };
+static int pid = 0;
+static pid_t child = 0;
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig) {
+  running = 0;
+}
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+static void sleep_ns(int64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  nanosleep(&ts, NULL);
+}
+
+static int alive(void) {
+  if (child > 0) {
+    return waitpid(child, NULL, WNOHANG) == 0;
+  }
+  return kill(pid, 0) == 0;
+}
+
+/**
+ * Returns the CPU time all threads of the process have used (s), or -1.
+ */
+static double process_cpu(void) {
+  struct timespec ts;
+  clockid_t clock;
+
+  if (clock_getcpuclockid(pid, &clock) || clock_gettime(clock, &ts)) {
+    return -1;
+  }
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Waits until the application has registered beat at least beat. Returns 0,
+ * or -1 if it exited, stopped beating for timeout ns or we were interrupted.
+ */
+static int wait_beat(int64_t beat, int64_t timeout, hrm_snapshot_t* snap) {
+  int64_t deadline = now_ns() + timeout;
+  int64_t last = -1;
+
+  while (running) {
+    if (hrm_snapshot_many(hrms, 1, snap) && snap->beat >= beat) {
+      return 0;
+    }
+    if (snap->valid && snap->beat != last) {
+      last = snap->beat;
+      deadline = now_ns() + timeout;
+    }
+    if (now_ns() > deadline || !alive()) {
+      return -1;
+    }
+    sleep_ns(HB_AT_POLL_NS);
+  }
+  return -1;
+}
+
+static double setting(const hb_at_config* c, int64_t k) {
+  int64_t index = c->index;
+  int64_t i;
+  for (i = nknobs - 1; i > k; i--) {
+    index /= knobs[i].nvalues;
+  }
+  return knobs[k].values[index % knobs[k].nvalues];
+}
+
+/**
+ * Applies the settings of c. Returns the time they take to take effect (ns).
+ */
+static int64_t apply(const hb_at_config* c) {
+  const hb_actuator_info_t* info;
+  hb_command_t cmd;
+  int64_t settle = 0;
+  int64_t k;
+  int64_t i;
+  int n;
+  double v;
+
+  for (k = 0; k < nknobs; k++) {
+    v = setting(c, k);
+    switch (knobs[k].kind) {
+      case HB_AT_CORES:
+        if (hb_actuator_set(cores, v)) {
+          fprintf(stderr, "Failed to run %d on %g cores: %s\n", pid, v, strerror(errno));
+        }
+        info = hb_actuator_info(cores);
+        settle = info->latency_ns > settle ? info->latency_ns : settle;
+        break;
+      case HB_AT_FREQ:
+        for (i = 0; i < nfreqs; i++) {
+          if (hb_actuator_set(freqs[i], v)) {
+            fprintf(stderr, "Failed to set the frequency to %g: %s\n", v, strerror(errno));
+          }
+          info = hb_actuator_info(freqs[i]);
+          settle = info->latency_ns > settle ? info->latency_ns : settle;
+        }
+        break;
+      default:
+        if (v == knobs[k].last) {
+          break;
+        }
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.type = HB_CMD_USER;
+        cmd.arg = knobs[k].arg;
+        cmd.value[0] = v;
+        for (n = 0; hrm_post_command(&hrm, &cmd) && n < HB_AT_POST_RETRIES; n++) {
+          sleep_ns(HB_AT_POLL_NS);
+        }
+        knobs[k].last = n < HB_AT_POST_RETRIES ? v : NAN;
+        break;
+    }
+  }
+  return settle < HB_AT_MAX_SETTLE_NS ? settle : HB_AT_MAX_SETTLE_NS;
+}
+
+/**
+ * Applies c and measures it over beats heartbeats after warmup ones.
+ * Returns 0, or -1 if the application did not beat.
+ */
+static int measure(hb_at_config* c, int64_t beats, int64_t warmup, int64_t timeout) {
+  hrm_snapshot_t first;
+  hrm_snapshot_t last;
+  hb_reduction_t red;
+  uint32_t fields = 0;
+  int64_t start;
+  int64_t n;
+  double cpu;
+
+  c->ok = 0;
+  sleep_ns(apply(c));
+  if (wait_beat(0, timeout, &first) || wait_beat(first.beat + warmup, timeout, &first)) {
+    return -1;
+  }
+  start = now_ns();
+  cpu = process_cpu();
+  if (wait_beat(first.beat + beats, timeout, &last) || last.timestamp <= first.timestamp) {
+    return -1;
+  }
+  n = last.beat - first.beat;
+  c->rate = (double) n * 1000000000.0 / (double) (last.timestamp - first.timestamp);
+  c->cpus = cpu >= 0 ? (process_cpu() - cpu) * 1000000000.0 / (double) (now_ns() - start) : 0;
+
+  if (last.features & HB_FEATURE_POWER) {
+    fields |= HB_FIELD_BIT(HB_FIELD_INSTANT_POWER);
+  }
+  if (last.features & HB_FEATURE_ACCURACY) {
+    fields |= HB_FIELD_BIT(HB_FIELD_INSTANT_ACCURACY);
+  }
+  c->power = 0;
+  c->accuracy = 0;
+  if (fields && hrm_reduce_history(&hrm, n < hrm.log_depth ? n : hrm.log_depth, fields, &red) > 0) {
+    if (fields & HB_FIELD_BIT(HB_FIELD_INSTANT_POWER)) {
+      c->power = red.stats[HB_FIELD_INSTANT_POWER].mean;
+    }
+    if (fields & HB_FIELD_BIT(HB_FIELD_INSTANT_ACCURACY)) {
+      c->accuracy = red.stats[HB_FIELD_INSTANT_ACCURACY].mean;
+    }
+  }
+  c->ok = 1;
+  return 0;
+}
+
+/**
+ * 1 if a is no worse than b in any objective and better in one, each by
+ * more than tol relative to b.
+ */
+static int dominates(const hb_at_config* a, const hb_at_config* b, double tol) {
+  int better = 0;
+
+  if (a->rate < b->rate * (1 - tol) || a->accuracy < b->accuracy * (1 - tol) ||
+      a->power > b->power * (1 + tol) || a->cpus > b->cpus * (1 + tol)) {
+    return 0;
+  }
+  better = a->rate > b->rate * (1 + tol) || a->accuracy > b->accuracy * (1 + tol) ||
+    a->power < b->power * (1 - tol) || a->cpus < b->cpus * (1 - tol);
+  return better;
+}
+
+/**
+ * Reorders configs so that its first fronts come first and returns how many
+ * of them make up the leading fronts with at least keep configurations.
+ */
+static int64_t select_fronts(hb_at_config* configs, int64_t n, int64_t keep, double tol) {
+  hb_at_config tmp;
+  int64_t kept = 0;
+  int64_t front;
+  int64_t i;
+  int64_t j;
+
+  while (kept < keep && kept < n) {
+    front = kept;
+    for (i = kept; i < n; i++) {
+      for (j = kept; j < n && (j == i || !dominates(&configs[j], &configs[i], tol)); j++);
+      if (j == n) {
+        tmp = configs[front];
+        configs[front++] = configs[i];
+        configs[i] = tmp;
+      }
+    }
+    // dominance within a tolerance is not transitive, so every remaining
+    // configuration can be dominated by another; keep them all then
+    if (front == kept) {
+      front = n;
+    }
+    kept = front;
+  }
+  return kept;
+}
+
+static int parse_values(hb_at_knob* knob, const char* list, hb_actuator_t* a) {
+  const hb_actuator_info_t* info;
+  char* copy;
+  char* tok;
+  char* save;
+  int64_t i;
+
+  if (strcmp(list, "all") == 0) {
+    info = a != NULL ? hb_actuator_info(a) : NULL;
+    if (info == NULL || info->kind != HB_ACTUATOR_DISCRETE) {
+      fprintf(stderr, "%s has no discrete settings to take all of\n", knob->name);
+      return -1;
+    }
+    for (i = 0; i < info->nvalues && i < HB_AT_MAX_VALUES; i++) {
+      knob->values[i] = info->values[i];
+    }
+    knob->nvalues = i;
+    return 0;
+  }
+  copy = strdup(list);
+  knob->nvalues = 0;
+  for (tok = strtok_r(copy, ",", &save); tok != NULL && knob->nvalues < HB_AT_MAX_VALUES;
+       tok = strtok_r(NULL, ",", &save)) {
+    knob->values[knob->nvalues++] = atof(tok);
+  }
+  free(copy);
+  return knob->nvalues > 0 ? 0 : -1;
+}
+
+static hb_at_knob* add_knob(const char* name, int kind) {
+  hb_at_knob* knob;
+  if (nknobs == HB_PARETO_MAX_KNOBS) {
+    fprintf(stderr, "At most %d knobs can be tuned\n", HB_PARETO_MAX_KNOBS);
+    return NULL;
+  }
+  knob = &knobs[nknobs++];
+  memset(knob, 0, sizeof(*knob));
+  snprintf(knob->name, sizeof(knob->name), "%s", name);
+  knob->kind = kind;
+  knob->last = NAN;
+  return knob;
+}
+
+/**
+ * Opens a frequency actuator for every CPU pid may use: cpufreq, or the
+ * simulated frequency inside the simulator.
+ */
+static int open_freqs(void) {
+  cpu_set_t set;
+  int cpu;
+
+  if (sched_getaffinity(pid, sizeof(set), &set)) {
+    return -1;
+  }
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      if ((freqs[nfreqs] = hb_actuator_cpufreq(cpu)) == NULL &&
+          (freqs[nfreqs] = hb_actuator_simfreq(cpu)) == NULL) {
+        return -1;
+      }
+      nfreqs++;
+    }
+  }
+  return nfreqs > 0 ? 0 : -1;
+}
+
+/**
+ * Starts argv and attaches to its heartbeats once it has registered them.
+ */
+static int launch(char** argv, int64_t timeout) {
+  int64_t deadline = now_ns() + timeout;
+
+  child = fork();
+  if (child < 0) {
+    return -1;
+  }
+  if (child == 0) {
+    execvp(argv[0], argv);
+    fprintf(stderr, "Failed to start %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  pid = (int) child;
+  // heart_rate_monitor_init() reports every failed attempt
+  while (shmget((pid << 1) | 1, 0, 0) < 0) {
+    if (!running || now_ns() > deadline || !alive()) {
+      return -1;
+    }
+    sleep_ns(10 * HB_AT_POLL_NS);
+  }
+  return heart_rate_monitor_init(&hrm, pid);
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s [-c cores] [-f freqs] [-k name=values]... [-b beats] [-w warmup]\n"
+          "      [-e eta] [-r rounds] [-t tolerance] [-T timeout_s] [-o table]\n"
+          "      (-p pid | command [args...])\n", prog);
+  fprintf(stderr, "  values are comma separated; -c all and -f all take every setting\n");
+}
+
+static void print_config(FILE* f, const hb_at_config* c) {
+  int64_t k;
+  fprintf(f, "%.6g %.6g %.6g %.6g", c->rate, c->power, c->cpus, c->accuracy);
+  for (k = 0; k < nknobs; k++) {
+    fprintf(f, " %s=%g", knobs[k].name, setting(c, k));
+  }
+  fprintf(f, "\n");
+}
+
+int main(int argc, char** argv) {
+  const char* core_list = NULL;
+  const char* freq_list = NULL;
+  const char* out = "/dev/stdout";
+  char* app_knobs[HB_PARETO_MAX_KNOBS];
+  int64_t napp = 0;
+  int64_t beats = HB_AT_DEFAULT_BEATS;
+  int64_t warmup = HB_AT_DEFAULT_WARMUP;
+  int64_t eta = HB_AT_DEFAULT_ETA;
+  int64_t rounds = HB_AT_DEFAULT_ROUNDS;
+  double tol = HB_AT_DEFAULT_TOLERANCE;
+  int64_t timeout = (int64_t) HB_AT_DEFAULT_TIMEOUT_S * 1000000000;
+  int64_t nconfigs = 1;
+  int64_t n;
+  int64_t round;
+  int64_t i;
+  int64_t k;
+  hb_at_config* configs;
+  hb_at_knob* knob;
+  hb_pareto_t table;
+  struct sigaction sa;
+  char* eq;
+  int rc = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "+c:f:k:b:w:e:r:t:T:o:p:h")) != -1) {
+    switch (opt) {
+      case 'c':
+        core_list = optarg;
+        break;
+      case 'f':
+        freq_list = optarg;
+        break;
+      case 'k':
+        if (napp == HB_PARETO_MAX_KNOBS || strchr(optarg, '=') == NULL) {
+          usage(argv[0]);
+          return 1;
+        }
+        app_knobs[napp++] = optarg;
+        break;
+      case 'b':
+        beats = atol(optarg);
+        break;
+      case 'w':
+        warmup = atol(optarg);
+        break;
+      case 'e':
+        eta = atol(optarg);
+        break;
+      case 'r':
+        rounds = atol(optarg);
+        break;
+      case 't':
+        tol = atof(optarg);
+        break;
+      case 'T':
+        timeout = (int64_t) (atof(optarg) * 1000000000.0);
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      case 'p':
+        pid = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if ((pid > 0) == (optind < argc) || beats < 1 || warmup < 0 || eta < 2 || rounds < 1 ||
+      tol < 0 || timeout <= 0 || (core_list == NULL && freq_list == NULL && napp == 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (pid > 0 ? heart_rate_monitor_init(&hrm, pid) : launch(&argv[optind], timeout)) {
+    fprintf(stderr, "Failed to attach to the heartbeats of the workload\n");
+    rc = 1;
+    goto out;
+  }
+
+  if (core_list != NULL) {
+    if ((cores = hb_actuator_affinity(pid)) == NULL) {
+      fprintf(stderr, "Failed to control the affinity of %d\n", pid);
+      rc = 1;
+      goto out;
+    }
+    knob = add_knob("cores", HB_AT_CORES);
+    if (parse_values(knob, core_list, cores)) {
+      rc = 1;
+      goto out;
+    }
+  }
+  if (freq_list != NULL) {
+    if (open_freqs()) {
+      fprintf(stderr, "Failed to control the frequency of the CPUs of %d\n", pid);
+      rc = 1;
+      goto out;
+    }
+    knob = add_knob(hb_actuator_info(freqs[0])->name, HB_AT_FREQ);
+    if (parse_values(knob, freq_list, freqs[0])) {
+      rc = 1;
+      goto out;
+    }
+  }
+  for (i = 0; i < napp; i++) {
+    eq = strchr(app_knobs[i], '=');
+    *eq = '\0';
+    if ((knob = add_knob(app_knobs[i], HB_AT_APP)) == NULL ||
+        parse_values(knob, eq + 1, NULL)) {
+      rc = 1;
+      goto out;
+    }
+    knob->arg = i;
+  }
+  for (k = 0; k < nknobs; k++) {
+    nconfigs *= knobs[k].nvalues;
+    if (nconfigs > HB_AT_MAX_CONFIGS) {
+      fprintf(stderr, "More than %d configurations\n", HB_AT_MAX_CONFIGS);
+      rc = 1;
+      goto out;
+    }
+  }
+  configs = (hb_at_config*) calloc(nconfigs, sizeof(hb_at_config));
+  if (configs == NULL) {
+    rc = 1;
+    goto out;
+  }
+  for (i = 0; i < nconfigs; i++) {
+    configs[i].index = i;
+  }
+
+  // successive halving: measure longer, keep the leading fronts
+  n = nconfigs;
+  for (round = 0; round < rounds && running; round++) {
+    fprintf(stderr, "Round %" PRId64 ": %" PRId64 " configurations over %" PRId64 " heartbeats\n",
+            round, n, beats);
+    for (i = 0; i < n && running; i++) {
+      if (measure(&configs[i], beats, warmup, timeout) == 0) {
+        print_config(stderr, &configs[i]);
+      } else if (alive()) {
+        fprintf(stderr, "No heartbeats under configuration %" PRId64 "\n", configs[i].index);
+      } else {
+        fprintf(stderr, "The workload exited; keeping the measurements so far\n");
+        running = 0;
+      }
+    }
+    // unmeasured configurations are kept with their last measurement
+    for (k = 0; k < n; ) {
+      if (configs[k].ok) {
+        k++;
+      } else {
+        configs[k] = configs[--n];
+      }
+    }
+    if (round + 1 < rounds) {
+      n = select_fronts(configs, n, (n + eta - 1) / eta, tol);
+      beats *= eta;
+    }
+  }
+
+  n = select_fronts(configs, n, 1, 0);
+  memset(&table, 0, sizeof(table));
+  table.nknobs = nknobs;
+  for (k = 0; k < nknobs; k++) {
+    snprintf(table.knobs[k], HB_PARETO_NAME_LEN, "%s", knobs[k].name);
+  }
+  table.npoints = n;
+  table.points = (hb_pareto_point_t*) calloc(n > 0 ? n : 1, sizeof(hb_pareto_point_t));
+  for (i = 0; table.points != NULL && i < n; i++) {
+    table.points[i].rate = configs[i].rate;
+    table.points[i].power = configs[i].power;
+    table.points[i].cpus = configs[i].cpus;
+    table.points[i].accuracy = configs[i].accuracy;
+    for (k = 0; k < nknobs; k++) {
+      table.points[i].settings[k] = setting(&configs[i], k);
+    }
+  }
+  if (table.points == NULL || hb_pareto_save(&table, out)) {
+    fprintf(stderr, "Failed to write %s\n", out);
+    rc = 1;
+  }
+  hb_pareto_finish(&table);
+  free(configs);
+
+out:
+  // leave the system unconstrained
+  if (cores != NULL) {
+    hb_actuator_set(cores, hb_actuator_info(cores)->max);
+    hb_actuator_close(cores);
+  }
+  for (i = 0; i < nfreqs; i++) {
+    hb_actuator_set(freqs[i], hb_actuator_info(freqs[i])->max);
+    hb_actuator_close(freqs[i]);
+  }
+  heart_rate_monitor_finish(&hrm);
+  if (child > 0 && alive()) {
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+  }
+  return rc;
+}
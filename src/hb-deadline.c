@@ -0,0 +1,390 @@
+/**
+ * Reserve CPU time for a heartbeat-enabled application with SCHED_DEADLINE
+ * so that it keeps its heart rate between its min and max targets.
+ *
+ * Every poll the controller measures the CPU time each thread of the
+ * application spends per heartbeat (from /proc/<pid>/task/<tid>/schedstat)
+ * and reserves, per period, that much for the beats the target rate asks of
+ * the period:
+ *
+ *   runtime = cpu_per_beat * target_rate * period * gain
+ *
+ * where the target rate is the middle of the targets, the period is one
+ * beat at that rate (bounded to 1 ms - 1 s) and the deadline equals the
+ * period. The gain starts at 1 + margin. Whenever a window of heartbeats
+ * run under reservations since the last correction has the window rate
+ * outside the targets, the gain is scaled by target / rate (at most
+ * doubled or halved), so the reservation follows drift in the
+ * application's work without over-reserving.
+ *
+ * The kernel refuses reservations that do not pass its admission test
+ * (EBUSY). A thread that was never admitted keeps its old policy and is
+ * retried later; a thread whose larger reservation is refused keeps the one
+ * it has. On exit the threads get their old policy back. Threads of a
+ * SCHED_DEADLINE reservation can only run on CPUs of its root domain and
+ * need CAP_SYS_NICE to be set; forks of them revert to their old policy.
+ *
+ * Usage:
+ *   hb-deadline [-i poll_ms] [-m margin] [-P period_us] pid
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "heart_rate_monitor.h"
+#include "heartbeat-types.h"
+
+#define HB_DL_DEFAULT_POLL_MS 100
+#define HB_DL_DEFAULT_MARGIN 0.1
+#define HB_DL_MIN_PERIOD_NS 1000000LL
+#define HB_DL_MAX_PERIOD_NS 1000000000LL
+/* the kernel does not accept runtimes below 2^DL_SCALE ns */
+#define HB_DL_MIN_RUNTIME_NS 1024LL
+#define HB_DL_MIN_GAIN 0.25
+#define HB_DL_MAX_GAIN 8.0
+/* largest factor the gain changes by in one correction */
+#define HB_DL_MAX_STEP 2.0
+/* weight of the newest CPU time per beat in the running estimate */
+#define HB_DL_SMOOTHING 0.25
+/* relative runtime change below which a reservation is left alone */
+#define HB_DL_HYSTERESIS 0.05
+/* polls between admission attempts for a refused thread */
+#define HB_DL_RETRY_POLLS 50
+#define HB_DL_MAX_THREADS 256
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+/* struct sched_attr as of Linux 3.14 (SCHED_ATTR_SIZE_VER0) */
+typedef struct {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+} hb_dl_attr;
+
+typedef struct {
+  pid_t tid;
+  int seen;
+  int saved_ok;
+  hb_dl_attr saved;         /* policy before the reservation */
+  int64_t cpu;              /* CPU time at the last poll (ns) */
+  double cpu_per_beat;      /* CPU time per heartbeat (ns), 0 until measured */
+  uint64_t runtime;         /* reserved runtime (ns), 0 if not reserved */
+  uint64_t period;
+  int64_t retry_poll;       /* poll at which a refused thread is retried */
+} hb_dl_thread;
+
+static hb_dl_thread threads[HB_DL_MAX_THREADS];
+static int nthreads = 0;
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig) {
+  running = 0;
+}
+
+static int dl_setattr(pid_t tid, const hb_dl_attr* attr) {
+  return (int) syscall(SYS_sched_setattr, tid, attr, 0);
+}
+
+static int dl_getattr(pid_t tid, hb_dl_attr* attr) {
+  return (int) syscall(SYS_sched_getattr, tid, attr, sizeof(*attr), 0);
+}
+
+/**
+ * Returns the CPU time thread tid of pid has run (ns), or -1.
+ */
+static int64_t thread_cpu(int pid, pid_t tid) {
+  char path[64];
+  char buf[128];
+  ssize_t len;
+  int fd;
+
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", pid, (int) tid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return -1;
+  }
+  buf[len] = '\0';
+  return strtoll(buf, NULL, 10);
+}
+
+static void restore_thread(hb_dl_thread* t) {
+  if (t->runtime > 0 && t->saved_ok) {
+    t->saved.size = sizeof(t->saved);
+    if (dl_setattr(t->tid, &t->saved) && errno != ESRCH) {
+      fprintf(stderr, "Failed to restore the policy of thread %d: %s\n",
+              (int) t->tid, strerror(errno));
+    }
+  }
+  t->runtime = 0;
+}
+
+/**
+ * Updates the thread table from /proc/<pid>/task and measures each thread's
+ * CPU time per heartbeat over the last poll.
+ */
+static void scan_threads(int pid, int64_t beats) {
+  char path[64];
+  DIR* d;
+  struct dirent* ent;
+  hb_dl_thread* t;
+  pid_t tid;
+  int64_t cpu;
+  int i;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  d = opendir(path);
+  if (d == NULL) {
+    return;
+  }
+  for (i = 0; i < nthreads; i++) {
+    threads[i].seen = 0;
+  }
+  while ((ent = readdir(d)) != NULL) {
+    tid = (pid_t) atoi(ent->d_name);
+    if (tid <= 0 || (cpu = thread_cpu(pid, tid)) < 0) {
+      continue;
+    }
+    for (i = 0; i < nthreads && threads[i].tid != tid; i++);
+    if (i == nthreads) {
+      if (nthreads == HB_DL_MAX_THREADS) {
+        continue;
+      }
+      t = &threads[nthreads++];
+      memset(t, 0, sizeof(*t));
+      t->tid = tid;
+      t->saved_ok = dl_getattr(tid, &t->saved) == 0;
+      t->cpu = cpu;
+    } else {
+      t = &threads[i];
+      if (beats > 0) {
+        double x = (double) (cpu - t->cpu) / (double) beats;
+        t->cpu_per_beat = t->cpu_per_beat > 0 ?
+          t->cpu_per_beat + HB_DL_SMOOTHING * (x - t->cpu_per_beat) : x;
+        t->cpu = cpu;
+      }
+    }
+    t->seen = 1;
+  }
+  closedir(d);
+  for (i = nthreads - 1; i >= 0; i--) {
+    if (!threads[i].seen) {
+      threads[i] = threads[--nthreads];
+    }
+  }
+}
+
+/**
+ * Reserves runtime ns of every period ns for thread t. Returns 0, or -1 if
+ * the kernel refused.
+ */
+static int reserve_thread(hb_dl_thread* t, uint64_t runtime, uint64_t period) {
+  hb_dl_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.sched_policy = SCHED_DEADLINE;
+  attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+  attr.sched_runtime = runtime;
+  attr.sched_deadline = period;
+  attr.sched_period = period;
+  if (dl_setattr(t->tid, &attr)) {
+    return -1;
+  }
+  t->runtime = runtime;
+  t->period = period;
+  return 0;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s [-i poll_ms] [-m margin] [-P period_us] pid\n", prog);
+}
+
+int main(int argc, char** argv) {
+  heart_rate_monitor_t hrm;
+  heart_rate_monitor_t* hrms[1];
+  hrm_snapshot_t snap;
+  struct sigaction sa;
+  struct timespec poll;
+  int64_t poll_ms = HB_DL_DEFAULT_POLL_MS;
+  double margin = HB_DL_DEFAULT_MARGIN;
+  int64_t period_arg = 0;
+  int64_t period;
+  int64_t last_beat = -1;
+  int64_t change_beat = -1;
+  int64_t npoll = 0;
+  double target;
+  double gain;
+  double runtime;
+  hb_dl_thread* t;
+  int pid;
+  int opt;
+  int reserved;
+  int i;
+
+  while ((opt = getopt(argc, argv, "i:m:P:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        poll_ms = atol(optarg);
+        break;
+      case 'm':
+        margin = atof(optarg);
+        break;
+      case 'P':
+        period_arg = atol(optarg) * 1000;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1 || poll_ms <= 0 || margin < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  pid = atoi(argv[optind]);
+
+  if (heart_rate_monitor_init(&hrm, pid)) {
+    fprintf(stderr, "Failed to attach to the heartbeats of %d\n", pid);
+    heart_rate_monitor_finish(&hrm);
+    return 1;
+  }
+  hrms[0] = &hrm;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  gain = 1.0 + margin;
+  poll.tv_sec = poll_ms / 1000;
+  poll.tv_nsec = (poll_ms % 1000) * 1000000;
+  while (running && kill(pid, 0) == 0) {
+    nanosleep(&poll, NULL);
+    npoll++;
+    hrm_snapshot_many(hrms, 1, &snap);
+    if (!snap.valid) {
+      continue;
+    }
+    scan_threads(pid, last_beat < 0 ? 0 : snap.beat - last_beat);
+    if (snap.beat == last_beat) {
+      continue;
+    }
+    last_beat = snap.beat;
+
+    if (snap.min_rate > 0 && snap.max_rate > 0) {
+      target = (snap.min_rate + snap.max_rate) / 2;
+    } else {
+      target = snap.min_rate > 0 ? snap.min_rate : snap.max_rate;
+    }
+    if (target <= 0) {
+      fprintf(stderr, "Application %d has no heart rate targets\n", pid);
+      break;
+    }
+    period = period_arg > 0 ? period_arg : (int64_t) (1000000000.0 / target);
+    if (period < HB_DL_MIN_PERIOD_NS) {
+      period = HB_DL_MIN_PERIOD_NS;
+    } else if (period > HB_DL_MAX_PERIOD_NS) {
+      period = HB_DL_MAX_PERIOD_NS;
+    }
+
+    // correct the gain once a window has been run under the last one
+    if (change_beat >= 0 && snap.beat - change_beat >= snap.effective_window &&
+        snap.window_rate > 0 &&
+        (snap.window_rate < snap.min_rate ||
+         (snap.max_rate > 0 && snap.window_rate > snap.max_rate))) {
+      double step = target / snap.window_rate;
+      if (step > HB_DL_MAX_STEP) {
+        step = HB_DL_MAX_STEP;
+      } else if (step < 1 / HB_DL_MAX_STEP) {
+        step = 1 / HB_DL_MAX_STEP;
+      }
+      gain *= step;
+      if (gain < HB_DL_MIN_GAIN) {
+        gain = HB_DL_MIN_GAIN;
+      } else if (gain > HB_DL_MAX_GAIN) {
+        gain = HB_DL_MAX_GAIN;
+      }
+      change_beat = snap.beat;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+      t = &threads[i];
+      runtime = t->cpu_per_beat * target * (double) period / 1000000000.0 * gain;
+      if (runtime < HB_DL_MIN_RUNTIME_NS) {
+        // no measurable work per beat: leave the thread alone
+        restore_thread(t);
+        continue;
+      }
+      if (runtime > (double) period) {
+        runtime = (double) period;
+      }
+      if (t->runtime > 0 && t->period == (uint64_t) period &&
+          runtime > (double) t->runtime * (1 - HB_DL_HYSTERESIS) &&
+          runtime < (double) t->runtime * (1 + HB_DL_HYSTERESIS)) {
+        continue;
+      }
+      if (t->runtime == 0 && npoll < t->retry_poll) {
+        continue;
+      }
+      if (reserve_thread(t, (uint64_t) runtime, (uint64_t) period)) {
+        if (errno == EPERM) {
+          fprintf(stderr, "Not permitted to set SCHED_DEADLINE (needs CAP_SYS_NICE)\n");
+          running = 0;
+          break;
+        }
+        // not admitted: keep what the thread has and try again later
+        fprintf(stderr, "thread %d: %.0f us / %" PRId64 " us not admitted (%s)%s\n",
+                (int) t->tid, runtime / 1000, period / 1000, strerror(errno),
+                t->runtime > 0 ? ", keeping the current reservation" : "");
+        t->retry_poll = npoll + HB_DL_RETRY_POLLS;
+        continue;
+      }
+      printf("thread %d: runtime %" PRIu64 " us / period %" PRId64 " us "
+             "(rate %.2f, target %.2f, gain %.2f)\n",
+             (int) t->tid, t->runtime / 1000, period / 1000,
+             snap.window_rate, target, gain);
+      fflush(stdout);
+    }
+    reserved = 0;
+    for (i = 0; i < nthreads; i++) {
+      reserved |= threads[i].runtime > 0;
+    }
+    // the window rate only tells about the gain once threads run under it
+    if (!reserved) {
+      change_beat = -1;
+    } else if (change_beat < 0) {
+      change_beat = snap.beat;
+    }
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    restore_thread(&threads[i]);
+  }
+  heart_rate_monitor_finish(&hrm);
+  return 0;
+}
@@ -1,25 +1,34 @@
 /**
  * Read energy from X86 MSRs (Model-Specific Registers).
  *
- * By default, the MSR on cpu0 is read. To configure other MSRs, set the
- * HEARTBEAT_ENERGY_MSRS environment variable with a comma-delimited list of
- * CPU IDs, e.g.:
+ * Intel and AMD (family 17h and later) RAPL registers are supported; the
+ * vendor is read from /proc/cpuinfo. By default, the package MSR on cpu0 is
+ * read. To configure other MSRs, set the HEARTBEAT_ENERGY_MSRS environment
+ * variable with a comma-delimited list of CPU IDs, e.g.:
  *   export HEARTBEAT_ENERGY_MSRS=0,4,8,12
  *
+ * The energy status registers are 32 bits wide and wrap (within minutes on a
+ * busy package); readings are accumulated across wraps, so they must be taken
+ * at least once per wrap period.
+ *
+ * @see hb-energy-msr.h for the other environment variables.
  * @author Hank Hoffmann
  * @author Connor Imes
  */
 
+#define _GNU_SOURCE
 #include "hb-energy.h"
 #include "hb-energy-msr.h"
 #include <inttypes.h>
 #include <math.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 
 #define MSR_RAPL_POWER_UNIT		0x606
 
@@ -51,6 +60,11 @@
 #define MSR_DRAM_PERF_STATUS		0x61B
 #define MSR_DRAM_POWER_INFO		0x61C
 
+/* AMD RAPL registers */
+#define MSR_AMD_RAPL_POWER_UNIT		0xC0010299
+#define MSR_AMD_CORE_ENERGY_STATUS	0xC001029A
+#define MSR_AMD_PKG_ENERGY_STATUS	0xC001029B
+
 /* RAPL UNIT BITMASK */
 #define POWER_UNIT_OFFSET	0
 #define POWER_UNIT_MASK		0x0F
@@ -61,10 +75,17 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
+#define MSR_ENERGY_STATUS_MASK	0xFFFFFFFFULL
+
 /* Shared variables */
 int msr_count = 0;
 int* msr_fds = NULL;
 double* msr_energy_units = NULL;
+/* energy register read on each fd, its last raw value, and joules so far */
+static long long* msr_regs = NULL;
+static uint64_t* msr_last = NULL;
+static double* msr_totals = NULL;
+static char msr_source[64] = "X86 MSR";
 
 #ifdef HB_ENERGY_IMPL
 int hb_energy_init(void) {
@@ -90,9 +111,11 @@ hb_energy_impl* hb_energy_impl_alloc(void) {
 
 static inline int open_msr(int core) {
   char msr_filename[BUFSIZ];
+  const char* path = getenv(HB_ENERGY_MSR_PATH_ENV_VAR);
   int fd;
 
-  sprintf(msr_filename, "/dev/cpu/%d/msr", core);
+  snprintf(msr_filename, sizeof(msr_filename),
+           path != NULL ? path : HB_ENERGY_MSR_DEFAULT_PATH, core);
   fd = open(msr_filename, O_RDONLY);
   if ( fd < 0 ) {
     if ( errno == ENXIO ) {
@@ -108,7 +131,7 @@ static inline int open_msr(int core) {
   return fd;
 }
 
-static inline long long read_msr(int fd, int which) {
+static inline long long read_msr(int fd, long long which) {
   uint64_t data = 0;
   uint64_t data_size = pread(fd, &data, sizeof data, which);
 
@@ -122,78 +145,225 @@ static inline long long read_msr(int fd, int which) {
   return (long long)data;
 }
 
+/**
+ * Vendor from HEARTBEAT_ENERGY_MSR_VENDOR, or else from /proc/cpuinfo.
+ * Returns 1 for AMD (and Hygon), 0 for Intel and anything else.
+ */
+static int msr_vendor_is_amd(void) {
+  char line[256];
+  char* vendor = getenv(HB_ENERGY_MSR_VENDOR_ENV_VAR);
+  FILE* f;
+  int amd = 0;
+
+  if (vendor != NULL) {
+    return strcasecmp(vendor, "amd") == 0;
+  }
+  f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "vendor_id", 9) == 0) {
+      amd = strstr(line, "AuthenticAMD") != NULL || strstr(line, "HygonGenuine") != NULL;
+      break;
+    }
+  }
+  fclose(f);
+  return amd;
+}
+
+/**
+ * First CPU of the physical core cpu belongs to, from its SMT siblings, or
+ * cpu itself if the topology cannot be read.
+ */
+static int msr_core_of(int cpu) {
+  char path[128];
+  FILE* f;
+  int first;
+
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  f = fopen(path, "r");
+  if (f == NULL) {
+    return cpu;
+  }
+  if (fscanf(f, "%d", &first) != 1 || first < 0 || first >= CPU_SETSIZE) {
+    first = cpu;
+  }
+  fclose(f);
+  return first;
+}
+
+/**
+ * Fills core_ids with one CPU of each physical core this process may run on;
+ * SMT siblings share a core energy register. Returns the count.
+ */
+static int msr_affinity_cores(int* core_ids, int max) {
+  cpu_set_t set;
+  cpu_set_t cores;
+  int i;
+  int core;
+  int n = 0;
+
+  if (sched_getaffinity(0, sizeof(set), &set)) {
+    perror("hb_energy_init: sched_getaffinity");
+    return 0;
+  }
+  CPU_ZERO(&cores);
+  for (i = 0; i < CPU_SETSIZE && n < max; i++) {
+    if (CPU_ISSET(i, &set)) {
+      core = msr_core_of(i);
+      if (!CPU_ISSET(core, &cores)) {
+        CPU_SET(core, &cores);
+        core_ids[n++] = i;
+      }
+    }
+  }
+  return n;
+}
+
 int hb_energy_init_msr(void) {
   int ncores = 0;
   int i;
+  int amd;
+  int core_domain;
   long long power_unit_data_ll;
+  long long reg;
+  long long unit_reg;
   double power_unit_data;
   // get a delimited list of cores with MSRs to read from
   char* env_cores = getenv(HB_ENERGY_MSR_ENV_VAR);
+  char* env_domain = getenv(HB_ENERGY_MSR_DOMAIN_ENV_VAR);
   char* env_cores_tmp; // need a writable string for strtok function
-  if (env_cores == NULL) {
-    // default to using core 0
-    env_cores = "0";
+  char* tok;
+  int* core_ids;
+
+  amd = msr_vendor_is_amd();
+  core_domain = env_domain != NULL && strcasecmp(env_domain, "core") == 0;
+  if (env_domain != NULL && !core_domain && strcasecmp(env_domain, "package") != 0) {
+    fprintf(stderr, "hb_energy_init: unknown %s value %s\n",
+            HB_ENERGY_MSR_DOMAIN_ENV_VAR, env_domain);
+    return -1;
   }
+  if (amd) {
+    unit_reg = MSR_AMD_RAPL_POWER_UNIT;
+    reg = core_domain ? MSR_AMD_CORE_ENERGY_STATUS : MSR_AMD_PKG_ENERGY_STATUS;
+  } else {
+    // Intel has no per-core counter; PP0 covers all cores of a package
+    unit_reg = MSR_RAPL_POWER_UNIT;
+    reg = core_domain ? MSR_PP0_ENERGY_STATUS : MSR_PKG_ENERGY_STATUS;
+  }
+  snprintf(msr_source, sizeof(msr_source), "X86 MSR (%s %s)",
+           amd ? "AMD" : "Intel", core_domain ? "core" : "package");
 
-  // first determine the number of MSRs to be accessed
-  env_cores_tmp = strdup(env_cores);
-  char* tok = strtok(env_cores_tmp, HB_ENERGY_MSRS_DELIMS);
-  while (tok != NULL) {
-    ncores++;
-    tok = strtok(NULL, HB_ENERGY_MSRS_DELIMS);
+  if (env_cores == NULL && core_domain && amd) {
+    // attribute the energy of the cores this process runs on
+    core_ids = (int*) malloc(CPU_SETSIZE * sizeof(int));
+    if (core_ids == NULL) {
+      perror("hb_energy_init: malloc");
+      return -1;
+    }
+    ncores = msr_affinity_cores(core_ids, CPU_SETSIZE);
+  } else {
+    if (env_cores == NULL) {
+      // default to using core 0
+      env_cores = "0";
+    }
+
+    // first determine the number of MSRs to be accessed
+    env_cores_tmp = strdup(env_cores);
+    tok = strtok(env_cores_tmp, HB_ENERGY_MSRS_DELIMS);
+    while (tok != NULL) {
+      ncores++;
+      tok = strtok(NULL, HB_ENERGY_MSRS_DELIMS);
+    }
+    free(env_cores_tmp);
+
+    // Now determine which cores' MSRs will be accessed
+    core_ids = (int*) malloc((ncores > 0 ? ncores : 1) * sizeof(int));
+    if (core_ids == NULL) {
+      perror("hb_energy_init: malloc");
+      return -1;
+    }
+    env_cores_tmp = strdup(env_cores);
+    tok = strtok(env_cores_tmp, HB_ENERGY_MSRS_DELIMS);
+    for (i = 0; tok != NULL; tok = strtok(NULL, HB_ENERGY_MSRS_DELIMS), i++) {
+      core_ids[i] = atoi(tok);
+      // printf("hb_energy_init: using MSR for core %d\n", core_ids[i]);
+    }
+    free(env_cores_tmp);
   }
-  free(env_cores_tmp);
   if (ncores == 0) {
     fprintf(stderr, "hb_energy_init: Failed to parse core numbers from "
             "%s environment variable.\n", HB_ENERGY_MSR_ENV_VAR);
+    free(core_ids);
     return -1;
   }
 
-  // Now determine which cores' MSRs will be accessed
-  int core_ids[ncores];
-  env_cores_tmp = strdup(env_cores);
-  tok = strtok(env_cores_tmp, HB_ENERGY_MSRS_DELIMS);
-  for (i = 0; tok != NULL; tok = strtok(NULL, HB_ENERGY_MSRS_DELIMS), i++) {
-    core_ids[i] = atoi(tok);
-    // printf("hb_energy_init: using MSR for core %d\n", core_ids[i]);
-  }
-  free(env_cores_tmp);
-
   // allocate shared variables
   msr_fds = (int*) malloc(ncores * sizeof(int));
   msr_energy_units = (double*) malloc(ncores * sizeof(double));
+  msr_regs = (long long*) malloc(ncores * sizeof(long long));
+  msr_last = (uint64_t*) malloc(ncores * sizeof(uint64_t));
+  msr_totals = (double*) calloc(ncores, sizeof(double));
+  if (msr_fds == NULL || msr_energy_units == NULL || msr_regs == NULL ||
+      msr_last == NULL || msr_totals == NULL) {
+    perror("hb_energy_init: malloc");
+    free(core_ids);
+    hb_energy_finish_msr();
+    return -1;
+  }
+  for (i = 0; i < ncores; i++) {
+    msr_fds[i] = -1;
+  }
+  msr_count = ncores;
 
   // open the MSR files
   for (i = 0; i < ncores; i++) {
     msr_fds[i] = open_msr(core_ids[i]);
     if (msr_fds[i] < 0) {
+      free(core_ids);
       hb_energy_finish_msr();
       return -1;
     }
-    power_unit_data_ll = read_msr(msr_fds[i], MSR_RAPL_POWER_UNIT);
+    power_unit_data_ll = read_msr(msr_fds[i], unit_reg);
     if (power_unit_data_ll < 0) {
+      free(core_ids);
       hb_energy_finish_msr();
       return -1;
     }
-    power_unit_data = (double) ((power_unit_data_ll >> 8) & 0x1f);
+    power_unit_data = (double) ((power_unit_data_ll & ENERGY_UNIT_MASK) >> ENERGY_UNIT_OFFSET);
     msr_energy_units[i] = pow(0.5, power_unit_data);
+    msr_regs[i] = reg;
+    power_unit_data_ll = read_msr(msr_fds[i], reg);
+    if (power_unit_data_ll < 0) {
+      free(core_ids);
+      hb_energy_finish_msr();
+      return -1;
+    }
+    msr_last[i] = (uint64_t) power_unit_data_ll & MSR_ENERGY_STATUS_MASK;
   }
 
-  msr_count = ncores;
+  free(core_ids);
   return 0;
 }
 
 double hb_energy_read_total_msr(int64_t last_hb_time, int64_t curr_hb_time) {
   int i;
-  double msr_val;
+  long long msr_val;
+  uint64_t raw;
   double total = 0.0;
   for (i = 0; i < msr_count; i++) {
-    msr_val = (double) read_msr(msr_fds[i], MSR_PKG_ENERGY_STATUS);
-    if (msr_val < 0.0) {
+    msr_val = read_msr(msr_fds[i], msr_regs[i]);
+    if (msr_val < 0) {
       fprintf(stderr, "hb_energy_read_total: got bad energy value from MSR\n");
       return -1.0;
     }
-    total += msr_val * msr_energy_units[i];
+    // unsigned 32-bit difference is correct across one wrap
+    raw = (uint64_t) msr_val & MSR_ENERGY_STATUS_MASK;
+    msr_totals[i] += (double) ((raw - msr_last[i]) & MSR_ENERGY_STATUS_MASK) * msr_energy_units[i];
+    msr_last[i] = raw;
+    total += msr_totals[i];
   }
   return total;
 }
@@ -203,7 +373,7 @@ int hb_energy_finish_msr(void) {
   if (msr_fds != NULL) {
     int i;
     for (i = 0; i < msr_count; i++) {
-      if (msr_fds[i] > 0) {
+      if (msr_fds[i] >= 0) {
         ret += close(msr_fds[i]);
       }
     }
@@ -212,12 +382,18 @@ int hb_energy_finish_msr(void) {
   msr_fds = NULL;
   free(msr_energy_units);
   msr_energy_units = NULL;
+  free(msr_regs);
+  msr_regs = NULL;
+  free(msr_last);
+  msr_last = NULL;
+  free(msr_totals);
+  msr_totals = NULL;
   msr_count = 0;
   return ret;
 }
 
 char* hb_energy_get_source_msr(void) {
-  return "X86 MSR";
+  return msr_source;
 }
 
 hb_energy_impl* hb_energy_impl_alloc_msr(void) {
@@ -0,0 +1,780 @@
+/**
+ * Serve the heartbeats of all applications on this machine as OpenMetrics
+ * text, for scraping by Prometheus and compatible collectors.
+ *
+ * Applications are discovered in HEARTBEAT_ENABLED_DIR and attached with the
+ * heart rate monitor. Each scrape renders rates, targets, beat counts,
+ * accuracy and power (for applications that record them) and inter-beat
+ * interval quantiles straight from the shared segments into one reusable
+ * buffer. Per-application labels are formatted once at attach time and
+ * interval quantiles are only recomputed for applications that have beaten
+ * since the last scrape.
+ *
+ * Usage:
+ *   hb-metrics-server [-u socket_path | -p port] [-r rescan_ms]
+ *
+ * By default listens on 127.0.0.1:9464. With -u, serves HTTP over a unix
+ * domain socket, e.g.:
+ *   curl --unix-socket /tmp/heartbeats.sock http://localhost/metrics
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "heart_rate_monitor.h"
+#include "heartbeat-types.h"
+
+#define HB_METRICS_DEFAULT_PORT 9464
+#define HB_METRICS_DEFAULT_RESCAN_MS 1000
+#define HB_METRICS_MAX_INTERVALS 64
+#define HB_METRICS_LINE_MAX 256
+
+/*
+ * Accuracy and power values follow the rate values in the accuracy/power
+ * record layouts (see heartbeat-accuracy-power-types.h). Counter values
+ * follow those, so their offset depends on the application's features.
+ */
+#define HB_METRICS_ACCURACY_OFFSET (offsetof(heartbeat_record_t, instant_rate) + sizeof(double))
+#define HB_METRICS_POWER_OFFSET (HB_METRICS_ACCURACY_OFFSET + 3 * sizeof(double))
+
+typedef struct {
+  int pid;
+  int seen;
+  heart_rate_monitor_t hrm;
+  char labels[48];
+  size_t labels_len;
+  int64_t last_counter;
+  int64_t interval_count;
+  double interval_sum;
+  double quantiles[3];
+} hb_metrics_app;
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} hb_metrics_buf;
+
+typedef enum {
+  VAL_RECORD,
+  VAL_COUNTER,
+  VAL_RUSAGE,
+  VAL_RUSAGE_NS,
+  VAL_CPU_RATE,
+  VAL_PROGRESS,
+  VAL_ETA,
+  VAL_PACING,
+  VAL_PACING_NS,
+  VAL_MIN_RATE,
+  VAL_MAX_RATE,
+  VAL_WINDOW_SIZE,
+} hb_metrics_source;
+
+typedef struct {
+  const char* name;
+  const char* type;
+  const char* help;
+  int64_t features;
+  hb_metrics_source source;
+  size_t offset;
+} hb_metrics_family;
+
+static const hb_metrics_family families[] = {
+  { "heartbeat_global_rate", "gauge", "Heart rate over the life of the application",
+    0, VAL_RECORD, offsetof(heartbeat_record_t, global_rate) },
+  { "heartbeat_window_rate", "gauge", "Heart rate over the last window",
+    0, VAL_RECORD, offsetof(heartbeat_record_t, window_rate) },
+  { "heartbeat_instant_rate", "gauge", "Heart rate of the last heartbeat",
+    0, VAL_RECORD, offsetof(heartbeat_record_t, instant_rate) },
+  { "heartbeat_min_rate", "gauge", "Minimum target heart rate",
+    0, VAL_MIN_RATE, 0 },
+  { "heartbeat_max_rate", "gauge", "Maximum target heart rate",
+    0, VAL_MAX_RATE, 0 },
+  { "heartbeat_window_size", "gauge", "Heartbeats per window",
+    0, VAL_WINDOW_SIZE, 0 },
+  { "heartbeat_global_accuracy", "gauge", "Accuracy over the life of the application",
+    HB_FEATURE_ACCURACY, VAL_RECORD, HB_METRICS_ACCURACY_OFFSET },
+  { "heartbeat_window_accuracy", "gauge", "Accuracy over the last window",
+    HB_FEATURE_ACCURACY, VAL_RECORD, HB_METRICS_ACCURACY_OFFSET + sizeof(double) },
+  { "heartbeat_instant_accuracy", "gauge", "Accuracy of the last heartbeat",
+    HB_FEATURE_ACCURACY, VAL_RECORD, HB_METRICS_ACCURACY_OFFSET + 2 * sizeof(double) },
+  { "heartbeat_global_power_watts", "gauge", "Power over the life of the application",
+    HB_FEATURE_POWER, VAL_RECORD, HB_METRICS_POWER_OFFSET },
+  { "heartbeat_window_power_watts", "gauge", "Power over the last window",
+    HB_FEATURE_POWER, VAL_RECORD, HB_METRICS_POWER_OFFSET + sizeof(double) },
+  { "heartbeat_instant_power_watts", "gauge", "Power of the last heartbeat",
+    HB_FEATURE_POWER, VAL_RECORD, HB_METRICS_POWER_OFFSET + 2 * sizeof(double) },
+  { "heartbeat_instructions_per_cycle", "gauge", "Instructions per cycle since the previous heartbeat",
+    HB_FEATURE_COUNTERS, VAL_COUNTER, 0 },
+  { "heartbeat_llc_misses_per_beat", "gauge", "Last-level cache misses per heartbeat since the previous heartbeat",
+    HB_FEATURE_COUNTERS, VAL_COUNTER, sizeof(double) },
+  { "heartbeat_effective_mhz", "gauge", "Effective core frequency since the previous heartbeat",
+    HB_FEATURE_COUNTERS, VAL_COUNTER, 2 * sizeof(double) },
+  { "heartbeat_global_cpu_rate", "gauge", "Heart rate per CPU-second over the life of the application",
+    0, VAL_CPU_RATE, offsetof(_HB_global_state_t, global_cpu_rate) },
+  { "heartbeat_window_cpu_rate", "gauge", "Heart rate per CPU-second over the last window",
+    0, VAL_CPU_RATE, offsetof(_HB_global_state_t, window_cpu_rate) },
+  { "heartbeat_instant_cpu_rate", "gauge", "Heart rate per CPU-second of the last heartbeat",
+    0, VAL_CPU_RATE, offsetof(_HB_global_state_t, instant_cpu_rate) },
+  { "heartbeat_progress_ratio", "gauge", "Fraction of the total work done",
+    0, VAL_PROGRESS, 0 },
+  { "heartbeat_eta_timestamp_seconds", "gauge", "Estimated completion time",
+    0, VAL_ETA, offsetof(_HB_global_state_t, eta) },
+  { "heartbeat_eta_low_timestamp_seconds", "gauge", "Early bound of the estimated completion time",
+    0, VAL_ETA, offsetof(_HB_global_state_t, eta_low) },
+  { "heartbeat_eta_high_timestamp_seconds", "gauge", "Late bound of the estimated completion time",
+    0, VAL_ETA, offsetof(_HB_global_state_t, eta_high) },
+  { "heartbeat_pacing_seconds", "counter", "Time heartbeats were held back to stay under the maximum heart rate",
+    0, VAL_PACING_NS, offsetof(_HB_global_state_t, pace_time) },
+  { "heartbeat_paced_beats", "counter", "Heartbeats held back to stay under the maximum heart rate",
+    0, VAL_PACING, offsetof(_HB_global_state_t, paced_beats) },
+  { "heartbeat_rusage_beats", "gauge", "Heartbeats in the last resource usage interval",
+    0, VAL_RUSAGE, offsetof(hb_rusage_t, beats) },
+  { "heartbeat_rusage_user_seconds", "gauge", "User CPU time in the last resource usage interval",
+    0, VAL_RUSAGE_NS, offsetof(hb_rusage_t, utime) },
+  { "heartbeat_rusage_system_seconds", "gauge", "System CPU time in the last resource usage interval",
+    0, VAL_RUSAGE_NS, offsetof(hb_rusage_t, stime) },
+  { "heartbeat_rusage_voluntary_switches", "gauge", "Voluntary context switches in the last resource usage interval",
+    0, VAL_RUSAGE, offsetof(hb_rusage_t, nvcsw) },
+  { "heartbeat_rusage_involuntary_switches", "gauge", "Involuntary context switches in the last resource usage interval",
+    0, VAL_RUSAGE, offsetof(hb_rusage_t, nivcsw) },
+  { "heartbeat_rusage_major_faults", "gauge", "Major page faults in the last resource usage interval",
+    0, VAL_RUSAGE, offsetof(hb_rusage_t, majflt) },
+  { "heartbeat_rusage_minor_faults", "gauge", "Minor page faults in the last resource usage interval",
+    0, VAL_RUSAGE, offsetof(hb_rusage_t, minflt) },
+  { "heartbeat_rusage_migrations", "gauge", "CPU migrations in the last resource usage interval",
+    0, VAL_RUSAGE, offsetof(hb_rusage_t, migrations) },
+  { "heartbeat_rusage_run_delay_seconds", "gauge", "Time spent waiting for a CPU in the last resource usage interval",
+    0, VAL_RUSAGE_NS, offsetof(hb_rusage_t, run_delay) },
+};
+
+static const double quantiles[3] = { 0.5, 0.9, 0.99 };
+static const char* quantile_labels[3] = { "0.5", "0.9", "0.99" };
+
+static hb_metrics_app* apps = NULL;
+static int napps = 0;
+static int apps_cap = 0;
+static volatile sig_atomic_t running = 1;
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void handle_signal(int sig) {
+  running = 0;
+}
+
+/*
+ * Output buffer helpers. Callers reserve space for a whole line up front so
+ * the formatting functions can write without bounds checks.
+ */
+
+static int buf_reserve(hb_metrics_buf* buf, size_t extra) {
+  char* tmp;
+  size_t cap;
+  if (buf->len + extra <= buf->cap) {
+    return 0;
+  }
+  cap = buf->cap ? buf->cap : 65536;
+  while (cap < buf->len + extra) {
+    cap *= 2;
+  }
+  tmp = realloc(buf->data, cap);
+  if (tmp == NULL) {
+    perror("Failed to grow metrics buffer");
+    return -1;
+  }
+  buf->data = tmp;
+  buf->cap = cap;
+  return 0;
+}
+
+static inline void buf_put(hb_metrics_buf* buf, const char* s, size_t n) {
+  memcpy(buf->data + buf->len, s, n);
+  buf->len += n;
+}
+
+static inline void buf_puts(hb_metrics_buf* buf, const char* s) {
+  buf_put(buf, s, strlen(s));
+}
+
+static inline void buf_put_uint(hb_metrics_buf* buf, uint64_t v) {
+  char tmp[24];
+  int i = sizeof(tmp);
+  do {
+    tmp[--i] = (char) ('0' + v % 10);
+    v /= 10;
+  } while (v != 0);
+  buf_put(buf, tmp + i, sizeof(tmp) - i);
+}
+
+/**
+ * Format a double with up to 6 decimal places without going through printf,
+ * which dominates rendering time otherwise.
+ */
+static void buf_put_double(hb_metrics_buf* buf, double v) {
+  uint64_t scaled;
+  uint64_t frac;
+  char digits[6];
+  int n;
+  if (isnan(v)) {
+    buf_put(buf, "NaN", 3);
+    return;
+  }
+  if (isinf(v)) {
+    buf_puts(buf, v > 0 ? "+Inf" : "-Inf");
+    return;
+  }
+  if (fabs(v) >= 1e12) {
+    buf->len += snprintf(buf->data + buf->len, 32, "%.17g", v);
+    return;
+  }
+  if (v < 0) {
+    buf_put(buf, "-", 1);
+    v = -v;
+  }
+  scaled = (uint64_t) (v * 1000000.0 + 0.5);
+  buf_put_uint(buf, scaled / 1000000);
+  frac = scaled % 1000000;
+  if (frac != 0) {
+    for (n = 5; n >= 0; n--) {
+      digits[n] = (char) ('0' + frac % 10);
+      frac /= 10;
+    }
+    for (n = 6; digits[n - 1] == '0'; n--);
+    buf_put(buf, ".", 1);
+    buf_put(buf, digits, n);
+  }
+}
+
+/*
+ * Application table
+ */
+
+static void detach_app(int i) {
+  heart_rate_monitor_finish(&apps[i].hrm);
+  apps[i] = apps[--napps];
+}
+
+static int attach_app(int pid) {
+  hb_metrics_app* app;
+  if (napps == apps_cap) {
+    int cap = apps_cap ? apps_cap * 2 : 64;
+    hb_metrics_app* tmp = realloc(apps, cap * sizeof(hb_metrics_app));
+    if (tmp == NULL) {
+      perror("Failed to grow application table");
+      return -1;
+    }
+    apps = tmp;
+    apps_cap = cap;
+  }
+  app = &apps[napps];
+  memset(app, 0, sizeof(*app));
+  if (heart_rate_monitor_init(&app->hrm, pid)) {
+    heart_rate_monitor_finish(&app->hrm);
+    return -1;
+  }
+  app->pid = pid;
+  app->seen = 1;
+  app->last_counter = -1;
+  app->labels_len = (size_t) snprintf(app->labels, sizeof(app->labels), "{pid=\"%d\"}", pid);
+  napps++;
+  return 0;
+}
+
+static void rescan_apps(const char* dir) {
+  DIR* d;
+  struct dirent* ent;
+  int i;
+  int pid;
+
+  d = opendir(dir);
+  if (d == NULL) {
+    perror("Failed to open HEARTBEAT_ENABLED_DIR");
+    return;
+  }
+  for (i = 0; i < napps; i++) {
+    apps[i].seen = 0;
+  }
+  while ((ent = readdir(d)) != NULL) {
+    pid = atoi(ent->d_name);
+    if (pid <= 0) {
+      continue;
+    }
+    for (i = 0; i < napps && apps[i].pid != pid; i++);
+    if (i < napps) {
+      apps[i].seen = 1;
+    } else {
+      attach_app(pid);
+    }
+  }
+  closedir(d);
+  for (i = napps - 1; i >= 0; i--) {
+    if (!apps[i].seen) {
+      detach_app(i);
+    }
+  }
+}
+
+static inline const char* app_record(const hb_metrics_app* app, int64_t index) {
+  return (const char*) app->hrm.log + index * app->hrm.state->record_size;
+}
+
+/**
+ * Records that can be read from the attached log: the application may
+ * already be moving to a larger log than the one hrm_refresh() attached.
+ */
+static inline int64_t app_depth(const hb_metrics_app* app) {
+  int64_t depth = app->hrm.state->buffer_depth;
+  return depth < app->hrm.log_depth ? depth : app->hrm.log_depth;
+}
+
+/**
+ * Recompute inter-beat interval quantiles from the most recent records.
+ */
+static void update_intervals(hb_metrics_app* app) {
+  HB_global_state_t* state = app->hrm.state;
+  double intervals[HB_METRICS_MAX_INTERVALS];
+  double v;
+  int64_t depth = app_depth(app);
+  int64_t filled = state->counter - state->log_start;
+  int64_t avail = filled < depth ? filled : depth;
+  int64_t end = state->buffer_index;
+  int64_t idx;
+  int64_t prev_ts;
+  int64_t ts;
+  int n = 0;
+  int i;
+  int j;
+
+  if (avail > HB_METRICS_MAX_INTERVALS + 1) {
+    avail = HB_METRICS_MAX_INTERVALS + 1;
+  }
+  if (depth <= 0 || end < 0 || end >= depth) {
+    // the log is being resized; keep the previous quantiles
+    return;
+  }
+  idx = (end - avail + depth) % depth;
+  prev_ts = ((const heartbeat_record_t*) app_record(app, idx))->timestamp;
+  app->interval_sum = 0.0;
+  for (i = 1; i < avail; i++) {
+    idx = (idx + 1) % depth;
+    ts = ((const heartbeat_record_t*) app_record(app, idx))->timestamp;
+    v = (double) (ts - prev_ts) / 1000000000.0;
+    prev_ts = ts;
+    // insertion sort, there are few intervals
+    for (j = n; j > 0 && intervals[j - 1] > v; j--) {
+      intervals[j] = intervals[j - 1];
+    }
+    intervals[j] = v;
+    app->interval_sum += v;
+    n++;
+  }
+  app->interval_count = n;
+  for (i = 0; i < 3; i++) {
+    app->quantiles[i] = n > 0 ? intervals[(int) (quantiles[i] * (n - 1) + 0.5)] : NAN;
+  }
+}
+
+static int render_family(hb_metrics_buf* buf, const hb_metrics_family* f) {
+  int i;
+  double v;
+  int64_t u;
+  int64_t index;
+  hb_rusage_t rusage;
+  hb_metrics_app* app;
+
+  if (buf_reserve(buf, HB_METRICS_LINE_MAX * 2)) {
+    return -1;
+  }
+  buf_puts(buf, "# TYPE ");
+  buf_puts(buf, f->name);
+  buf_put(buf, " ", 1);
+  buf_puts(buf, f->type);
+  buf_puts(buf, "\n# HELP ");
+  buf_puts(buf, f->name);
+  buf_put(buf, " ", 1);
+  buf_puts(buf, f->help);
+  buf_put(buf, "\n", 1);
+
+  for (i = 0; i < napps; i++) {
+    app = &apps[i];
+    if ((app->hrm.state->features & f->features) != f->features ||
+        ((f->source == VAL_RECORD || f->source == VAL_COUNTER) && !app->hrm.state->valid)) {
+      continue;
+    }
+    index = app->hrm.state->read_index;
+    if ((f->source == VAL_RECORD || f->source == VAL_COUNTER) &&
+        (index < 0 || index >= app_depth(app))) {
+      // past the attached log while the application resizes it
+      continue;
+    }
+    switch (f->source) {
+      case VAL_MIN_RATE:
+        v = app->hrm.state->min_heartrate;
+        break;
+      case VAL_MAX_RATE:
+        v = app->hrm.state->max_heartrate;
+        break;
+      case VAL_WINDOW_SIZE:
+        v = (double) app->hrm.state->window_size;
+        break;
+      case VAL_RUSAGE:
+      case VAL_RUSAGE_NS:
+        if (hrm_get_rusage(&app->hrm, &rusage)) {
+          continue;
+        }
+        u = *(const int64_t*) ((const char*) &rusage + f->offset);
+        if (u < 0) {
+          // not available on this system
+          continue;
+        }
+        v = f->source == VAL_RUSAGE_NS ? (double) u / 1000000000.0 : (double) u;
+        break;
+      case VAL_CPU_RATE:
+        if (app->hrm.state->cpu_clock == HB_CPU_CLOCK_NONE) {
+          continue;
+        }
+        v = *(const double*) ((const char*) app->hrm.state + f->offset);
+        break;
+      case VAL_PROGRESS:
+        if (app->hrm.state->work_goal <= 0) {
+          continue;
+        }
+        v = hrm_get_progress(&app->hrm);
+        break;
+      case VAL_ETA:
+        u = *(const int64_t*) ((const char*) app->hrm.state + f->offset);
+        if (app->hrm.state->work_goal <= 0 || u <= 0) {
+          continue;
+        }
+        v = (double) u / 1000000000.0;
+        break;
+      case VAL_PACING:
+      case VAL_PACING_NS:
+        if (app->hrm.state->pace_mode == HB_PACE_NONE && app->hrm.state->paced_beats == 0) {
+          continue;
+        }
+        u = *(const int64_t*) ((const char*) app->hrm.state + f->offset);
+        v = f->source == VAL_PACING_NS ? (double) u / 1000000000.0 : (double) u;
+        break;
+      case VAL_COUNTER:
+        v = *(const double*) (app_record(app, index) +
+                              HB_RECORD_COUNTERS_OFFSET(app->hrm.state->features) + f->offset);
+        break;
+      case VAL_RECORD:
+      default:
+        v = *(const double*) (app_record(app, index) + f->offset);
+        break;
+    }
+    if (buf_reserve(buf, HB_METRICS_LINE_MAX)) {
+      return -1;
+    }
+    buf_puts(buf, f->name);
+    if (!strcmp(f->type, "counter")) {
+      // OpenMetrics names counter samples, not their family, with _total
+      buf_puts(buf, "_total");
+    }
+    buf_put(buf, app->labels, app->labels_len);
+    buf_put(buf, " ", 1);
+    buf_put_double(buf, v);
+    buf_put(buf, "\n", 1);
+  }
+  return 0;
+}
+
+/* Formats the scrape into buf; returns -1 if it could not be grown */
+static int render(hb_metrics_buf* buf) {
+  size_t i;
+  int a;
+  int q;
+  hb_metrics_app* app;
+
+  buf->len = 0;
+  // follow applications that moved their log to a new segment
+  for (a = 0; a < napps; a++) {
+    hrm_refresh(&apps[a].hrm);
+  }
+  for (i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+    if (render_family(buf, &families[i])) {
+      return -1;
+    }
+  }
+
+  if (buf_reserve(buf, HB_METRICS_LINE_MAX * 2)) {
+    return -1;
+  }
+  buf_puts(buf, "# TYPE heartbeat_beats counter\n"
+           "# HELP heartbeat_beats Heartbeats registered\n");
+  for (a = 0; a < napps; a++) {
+    app = &apps[a];
+    if (buf_reserve(buf, HB_METRICS_LINE_MAX)) {
+      return -1;
+    }
+    buf_puts(buf, "heartbeat_beats_total");
+    buf_put(buf, app->labels, app->labels_len);
+    buf_put(buf, " ", 1);
+    buf_put_uint(buf, (uint64_t) app->hrm.state->counter);
+    buf_put(buf, "\n", 1);
+  }
+
+  if (buf_reserve(buf, HB_METRICS_LINE_MAX * 2)) {
+    return -1;
+  }
+  buf_puts(buf, "# TYPE heartbeat_interval_seconds summary\n"
+           "# HELP heartbeat_interval_seconds Time between recent heartbeats\n");
+  for (a = 0; a < napps; a++) {
+    app = &apps[a];
+    if (!app->hrm.state->valid) {
+      continue;
+    }
+    if (app->hrm.state->counter != app->last_counter) {
+      update_intervals(app);
+      app->last_counter = app->hrm.state->counter;
+    }
+    if (buf_reserve(buf, HB_METRICS_LINE_MAX * 5)) {
+      return -1;
+    }
+    for (q = 0; q < 3; q++) {
+      buf_puts(buf, "heartbeat_interval_seconds{pid=\"");
+      buf_put_uint(buf, (uint64_t) app->pid);
+      buf_puts(buf, "\",quantile=\"");
+      buf_puts(buf, quantile_labels[q]);
+      buf_puts(buf, "\"} ");
+      buf_put_double(buf, app->quantiles[q]);
+      buf_put(buf, "\n", 1);
+    }
+    buf_puts(buf, "heartbeat_interval_seconds_sum");
+    buf_put(buf, app->labels, app->labels_len);
+    buf_put(buf, " ", 1);
+    buf_put_double(buf, app->interval_sum);
+    buf_puts(buf, "\nheartbeat_interval_seconds_count");
+    buf_put(buf, app->labels, app->labels_len);
+    buf_put(buf, " ", 1);
+    buf_put_uint(buf, (uint64_t) app->interval_count);
+    buf_put(buf, "\n", 1);
+  }
+
+  if (buf_reserve(buf, 8)) {
+    return -1;
+  }
+  buf_puts(buf, "# EOF\n");
+  return 0;
+}
+
+/*
+ * Networking
+ */
+
+static int write_all(int fd, const char* data, size_t len) {
+  ssize_t n;
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= (size_t) n;
+  }
+  return 0;
+}
+
+static void serve_client(int fd, hb_metrics_buf* buf) {
+  char req[4096];
+  char header[256];
+  size_t len = 0;
+  ssize_t n;
+  int hlen;
+  struct timeval tv = { 1, 0 };
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  while (len < sizeof(req) - 1) {
+    n = read(fd, req + len, sizeof(req) - 1 - len);
+    if (n <= 0) {
+      break;
+    }
+    len += (size_t) n;
+    req[len] = '\0';
+    if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+      break;
+    }
+  }
+  req[len] = '\0';
+  if (strncmp(req, "GET ", 4) != 0) {
+    const char* bad = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n";
+    write_all(fd, bad, strlen(bad));
+    return;
+  }
+
+  if (render(buf)) {
+    const char* busy = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+    write_all(fd, busy, strlen(busy));
+    return;
+  }
+  hlen = snprintf(header, sizeof(header),
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                  "Content-Length: %zu\r\n\r\n", buf->len);
+  if (write_all(fd, header, (size_t) hlen) == 0) {
+    write_all(fd, buf->data, buf->len);
+  }
+}
+
+static int open_listener(const char* socket_path, int port) {
+  int fd;
+  int one = 1;
+  if (socket_path != NULL) {
+    struct sockaddr_un addr;
+    struct stat st;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", socket_path);
+      return -1;
+    }
+    // replace a stale socket, but nothing else that is in the way
+    if (lstat(socket_path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Not a socket, refusing to replace: %s\n", socket_path);
+      return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+      perror("bind");
+      close(fd);
+      return -1;
+    }
+  } else {
+    struct sockaddr_in addr;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+      perror("bind");
+      close(fd);
+      return -1;
+    }
+  }
+  if (listen(fd, 16)) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s [-u socket_path | -p port] [-r rescan_ms]\n", prog);
+}
+
+int main(int argc, char** argv) {
+  const char* socket_path = NULL;
+  const char* enabled_dir;
+  int port = HB_METRICS_DEFAULT_PORT;
+  int64_t rescan_ms = HB_METRICS_DEFAULT_RESCAN_MS;
+  int64_t last_scan;
+  hb_metrics_buf buf = { NULL, 0, 0 };
+  struct sigaction sa;
+  int listen_fd;
+  int fd;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "u:p:r:h")) != -1) {
+    switch (opt) {
+      case 'u':
+        socket_path = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'r':
+        rescan_ms = atol(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  enabled_dir = getenv("HEARTBEAT_ENABLED_DIR");
+  if (enabled_dir == NULL) {
+    fprintf(stderr, "ERROR: need to define environment variable HEARTBEAT_ENABLED_DIR (see README)\n");
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd = open_listener(socket_path, port);
+  if (listen_fd < 0) {
+    return 1;
+  }
+  if (buf_reserve(&buf, 1)) {
+    close(listen_fd);
+    return 1;
+  }
+
+  rescan_apps(enabled_dir);
+  last_scan = now_ms();
+  while (running) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        perror("accept");
+      }
+      continue;
+    }
+    if (now_ms() - last_scan >= rescan_ms) {
+      rescan_apps(enabled_dir);
+      last_scan = now_ms();
+    }
+    serve_client(fd, &buf);
+    close(fd);
+  }
+
+  close(listen_fd);
+  if (socket_path != NULL) {
+    unlink(socket_path);
+  }
+  while (napps > 0) {
+    detach_app(napps - 1);
+  }
+  free(apps);
+  free(buf.data);
+  return 0;
+}
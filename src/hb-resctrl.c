@@ -0,0 +1,533 @@
+/**
+ * Give heartbeat-enabled applications last-level cache ways and memory
+ * bandwidth through the Linux resctrl interface (Intel RDT, AMD PQoS)
+ * whenever they fall short of their heart rate targets.
+ *
+ * Each application gets a resource group <root>/hb-<pid> holding all of its
+ * threads, with a contiguous range of cache ways (CAT) at the top of the
+ * capacity bitmask and a memory bandwidth throttle value (MBA). Once a
+ * window of heartbeats has run under the current allocation:
+ *
+ *   - below the min target, an application's own throttle is lifted first,
+ *     then it gets another cache way, and with -d the default group (where
+ *     everything else runs) is throttled a step;
+ *   - above the max target, the same steps are undone in reverse, ending
+ *     with throttling the application itself down to the minimum.
+ *
+ * With -d the default group is also confined to the ways no application
+ * holds, which is what keeps noisy neighbours out of them. With -m the
+ * LLC occupancy and memory bandwidth of each group are read back (CMT/MBM)
+ * and printed every poll.
+ *
+ * The resctrl root comes from -R, HEARTBEAT_RESCTRL_ROOT or /sys/fs/resctrl.
+ * It is only read and written as files, so a directory with info/L3/cbm_mask,
+ * info/L3/min_cbm_bits, info/MB/min_bandwidth, info/MB/bandwidth_gran and a
+ * schemata file stands in for it when trying out policies. Only the unified
+ * L3 and MB resources are used (not CDP). On exit the threads go back to the
+ * default group, which gets its full allocation back.
+ *
+ * Usage:
+ *   hb-resctrl [-R root] [-i poll_ms] [-d] [-m] pid...
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "heart_rate_monitor.h"
+#include "heartbeat-types.h"
+
+#define HB_RDT_DEFAULT_ROOT "/sys/fs/resctrl"
+#define HB_RDT_DEFAULT_POLL_MS 500
+#define HB_RDT_MAX_APPS 64
+#define HB_RDT_MAX_DOMAINS 64
+#define HB_RDT_LINE_MAX 4096
+
+typedef struct {
+  int pid;
+  heart_rate_monitor_t hrm;
+  char dir[PATH_MAX + 16];
+  int ways;                 /* cache ways held, 0 without CAT */
+  int64_t mb;               /* bandwidth throttle value */
+  int64_t change_beat;      /* beat of the last change, -1 before any */
+  int64_t mbm_bytes;        /* last total bandwidth reading, -1 if none */
+  int64_t mbm_time;
+} hb_rdt_app;
+
+static char root[PATH_MAX];
+static int cat = 0;
+static int nways = 0;
+static int min_ways = 1;
+static int mba = 0;
+static int64_t mb_max = 100;
+static int64_t mb_min = 10;
+static int64_t mb_gran = 10;
+static int l3_domains[HB_RDT_MAX_DOMAINS];
+static int nl3 = 0;
+static int mb_domains[HB_RDT_MAX_DOMAINS];
+static int nmb = 0;
+static int confine_default = 0;
+static int64_t default_mb;
+
+static hb_rdt_app apps[HB_RDT_MAX_APPS];
+static int napps = 0;
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig) {
+  running = 0;
+}
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Reads the first line of root/rel into buf. Returns 0, or -1.
+ */
+static int read_file(const char* dir, const char* rel, char* buf, size_t size) {
+  char path[2 * PATH_MAX];
+  ssize_t len;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, rel);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  len = read(fd, buf, size - 1);
+  close(fd);
+  if (len < 0) {
+    return -1;
+  }
+  buf[len] = '\0';
+  return 0;
+}
+
+static int write_file(const char* dir, const char* rel, const char* text) {
+  char path[2 * PATH_MAX];
+  size_t len = strlen(text);
+  int fd;
+  int rc = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, rel);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (write(fd, text, len) != (ssize_t) len) {
+    rc = -1;
+  }
+  close(fd);
+  return rc;
+}
+
+/**
+ * Collects the domain ids of the line for resource res ("L3", "MB") of a
+ * schemata file, and the value of the first domain in first if not NULL.
+ */
+static int parse_domains(const char* schemata, const char* res, int* ids, int64_t* first, int hex) {
+  size_t rlen = strlen(res);
+  const char* p = schemata;
+  char* end;
+  int n = 0;
+
+  while (p != NULL && *p != '\0') {
+    while (*p == ' ') {
+      p++;
+    }
+    if (strncmp(p, res, rlen) == 0 && p[rlen] == ':') {
+      p += rlen + 1;
+      while (n < HB_RDT_MAX_DOMAINS) {
+        ids[n] = (int) strtol(p, &end, 10);
+        if (end == p || *end != '=') {
+          break;
+        }
+        p = end + 1;
+        if (n == 0 && first != NULL) {
+          *first = strtoll(p, &end, hex ? 16 : 10);
+        } else {
+          strtoll(p, &end, hex ? 16 : 10);
+        }
+        n++;
+        p = end;
+        if (*p != ';') {
+          break;
+        }
+        p++;
+      }
+      return n;
+    }
+    p = strchr(p, '\n');
+    if (p != NULL) {
+      p++;
+    }
+  }
+  return 0;
+}
+
+static int probe_resctrl(void) {
+  char buf[HB_RDT_LINE_MAX];
+  char schemata[HB_RDT_LINE_MAX];
+  unsigned long long mask;
+  int64_t first;
+
+  if (read_file(root, "schemata", schemata, sizeof(schemata))) {
+    fprintf(stderr, "No resctrl schemata under %s (is resctrl mounted?)\n", root);
+    return -1;
+  }
+  if (read_file(root, "info/L3/cbm_mask", buf, sizeof(buf)) == 0 &&
+      (nl3 = parse_domains(schemata, "L3", l3_domains, NULL, 1)) > 0) {
+    mask = strtoull(buf, NULL, 16);
+    nways = __builtin_popcountll(mask);
+    if (read_file(root, "info/L3/min_cbm_bits", buf, sizeof(buf)) == 0) {
+      min_ways = atoi(buf) > 0 ? atoi(buf) : 1;
+    }
+    cat = nways > 0;
+  }
+  if ((nmb = parse_domains(schemata, "MB", mb_domains, &first, 0)) > 0) {
+    // the default group starts unthrottled: its value is the maximum
+    mb_max = first;
+    if (read_file(root, "info/MB/min_bandwidth", buf, sizeof(buf)) == 0) {
+      mb_min = atoll(buf);
+    }
+    if (read_file(root, "info/MB/bandwidth_gran", buf, sizeof(buf)) == 0 && atoll(buf) > 0) {
+      mb_gran = atoll(buf);
+    }
+    mba = mb_max > mb_min;
+  }
+  if (!cat && !mba) {
+    fprintf(stderr, "Neither L3 cache nor memory bandwidth allocation is available under %s\n", root);
+    return -1;
+  }
+  default_mb = mb_max;
+  return 0;
+}
+
+static int held_ways(void) {
+  int sum = 0;
+  int i;
+  for (i = 0; i < napps; i++) {
+    sum += apps[i].ways;
+  }
+  return sum;
+}
+
+static void format_schemata(char* buf, size_t size, unsigned long long mask, int64_t mb) {
+  size_t len = 0;
+  int d;
+
+  buf[0] = '\0';
+  if (cat) {
+    len += (size_t) snprintf(buf + len, size - len, "L3:");
+    for (d = 0; d < nl3; d++) {
+      len += (size_t) snprintf(buf + len, size - len, "%s%d=%llx", d ? ";" : "", l3_domains[d], mask);
+    }
+    len += (size_t) snprintf(buf + len, size - len, "\n");
+  }
+  if (mba) {
+    len += (size_t) snprintf(buf + len, size - len, "MB:");
+    for (d = 0; d < nmb; d++) {
+      len += (size_t) snprintf(buf + len, size - len, "%s%d=%" PRId64, d ? ";" : "", mb_domains[d], mb);
+    }
+    snprintf(buf + len, size - len, "\n");
+  }
+}
+
+/**
+ * Writes every group's schemata: applications hold disjoint ranges of ways
+ * from the top of the bitmask down, the default group the ways below them
+ * (all of them unless confined).
+ */
+static void apply_schemata(void) {
+  char buf[HB_RDT_LINE_MAX];
+  unsigned long long mask;
+  int top = nways;
+  int i;
+
+  for (i = 0; i < napps; i++) {
+    top -= apps[i].ways;
+    mask = apps[i].ways > 0 ? ((1ULL << apps[i].ways) - 1) << top : 0;
+    format_schemata(buf, sizeof(buf), mask, apps[i].mb);
+    if (write_file(apps[i].dir, "schemata", buf)) {
+      fprintf(stderr, "Failed to write the schemata of %d: %s\n", apps[i].pid, strerror(errno));
+    }
+  }
+  mask = (1ULL << (confine_default ? top : nways)) - 1;
+  format_schemata(buf, sizeof(buf), mask, default_mb);
+  if (write_file(root, "schemata", buf)) {
+    fprintf(stderr, "Failed to write the default schemata: %s\n", strerror(errno));
+  }
+}
+
+/**
+ * Moves every thread of pid into the group dir (one id per write, as
+ * resctrl requires).
+ */
+static void assign_tasks(int pid, const char* dir) {
+  char path[64];
+  char id[16];
+  DIR* d;
+  struct dirent* ent;
+  int tid;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  d = opendir(path);
+  if (d == NULL) {
+    return;
+  }
+  while ((ent = readdir(d)) != NULL) {
+    if ((tid = atoi(ent->d_name)) > 0) {
+      snprintf(id, sizeof(id), "%d\n", tid);
+      write_file(dir, "tasks", id);
+    }
+  }
+  closedir(d);
+}
+
+static int attach_app(int pid) {
+  hb_rdt_app* app = &apps[napps];
+
+  memset(app, 0, sizeof(*app));
+  if (heart_rate_monitor_init(&app->hrm, pid)) {
+    fprintf(stderr, "Failed to attach to the heartbeats of %d\n", pid);
+    heart_rate_monitor_finish(&app->hrm);
+    return -1;
+  }
+  app->pid = pid;
+  snprintf(app->dir, sizeof(app->dir), "%s/hb-%d", root, pid);
+  if (mkdir(app->dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create resource group %s: %s\n", app->dir, strerror(errno));
+    heart_rate_monitor_finish(&app->hrm);
+    return -1;
+  }
+  app->mb = mb_max;
+  app->change_beat = -1;
+  app->mbm_bytes = -1;
+  napps++;
+  return 0;
+}
+
+static void release_app(int i) {
+  assign_tasks(apps[i].pid, root);
+  if (rmdir(apps[i].dir) && errno != ENOENT) {
+    fprintf(stderr, "Left resource group %s: %s\n", apps[i].dir, strerror(errno));
+  }
+  heart_rate_monitor_finish(&apps[i].hrm);
+  apps[i] = apps[--napps];
+}
+
+/**
+ * Sums a monitoring counter of group dir over its L3 domains. Returns -1
+ * without monitoring.
+ */
+static int64_t read_mon(const char* dir, const char* counter) {
+  char path[PATH_MAX];
+  char rel[PATH_MAX];
+  char buf[64];
+  DIR* d;
+  struct dirent* ent;
+  int64_t sum = -1;
+
+  snprintf(path, sizeof(path), "%s/mon_data", dir);
+  d = opendir(path);
+  if (d == NULL) {
+    return -1;
+  }
+  while ((ent = readdir(d)) != NULL) {
+    if (strncmp(ent->d_name, "mon_L3_", 7) != 0) {
+      continue;
+    }
+    snprintf(rel, sizeof(rel), "%s/%s", ent->d_name, counter);
+    if (read_file(path, rel, buf, sizeof(buf)) == 0 && buf[0] >= '0' && buf[0] <= '9') {
+      sum = (sum < 0 ? 0 : sum) + atoll(buf);
+    }
+  }
+  closedir(d);
+  return sum;
+}
+
+/**
+ * Takes one step towards the targets. Returns 1 if the allocation changed.
+ */
+static int control_app(hb_rdt_app* app, const hrm_snapshot_t* snap) {
+  int free_ways = nways - held_ways() - (confine_default ? min_ways : 0);
+
+  if (app->change_beat >= 0 && snap->beat - app->change_beat < snap->effective_window) {
+    return 0;
+  }
+  if (snap->window_rate <= 0) {
+    return 0;
+  }
+  if (snap->window_rate < snap->min_rate) {
+    if (mba && app->mb < mb_max) {
+      app->mb = app->mb + mb_gran < mb_max ? app->mb + mb_gran : mb_max;
+    } else if (cat && free_ways > 0) {
+      app->ways++;
+    } else if (mba && confine_default && default_mb > mb_min) {
+      default_mb = default_mb - mb_gran > mb_min ? default_mb - mb_gran : mb_min;
+    } else {
+      return 0;
+    }
+  } else if (snap->max_rate > 0 && snap->window_rate > snap->max_rate) {
+    if (mba && default_mb < mb_max) {
+      default_mb = default_mb + mb_gran < mb_max ? default_mb + mb_gran : mb_max;
+    } else if (cat && app->ways > min_ways) {
+      app->ways--;
+    } else if (mba && app->mb > mb_min) {
+      app->mb = app->mb - mb_gran > mb_min ? app->mb - mb_gran : mb_min;
+    } else {
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+  app->change_beat = snap->beat;
+  return 1;
+}
+
+static void report(hb_rdt_app* app, const hrm_snapshot_t* snap, int monitor) {
+  int64_t occupancy = -1;
+  int64_t bytes;
+  int64_t t;
+  double mbps = -1;
+
+  if (monitor) {
+    occupancy = read_mon(app->dir, "llc_occupancy");
+    bytes = read_mon(app->dir, "mbm_total_bytes");
+    t = now_ns();
+    if (bytes >= 0 && app->mbm_bytes >= 0 && t > app->mbm_time) {
+      mbps = (double) (bytes - app->mbm_bytes) / (double) (t - app->mbm_time) * 1000.0;
+    }
+    app->mbm_bytes = bytes;
+    app->mbm_time = t;
+  }
+  printf("%d: rate %.2f [%.2f, %.2f] ways %d mb %" PRId64 " default mb %" PRId64,
+         app->pid, snap->window_rate, snap->min_rate, snap->max_rate,
+         app->ways, app->mb, default_mb);
+  if (occupancy >= 0) {
+    printf(" llc %" PRId64 " KB", occupancy / 1024);
+  }
+  if (mbps >= 0) {
+    printf(" bw %.1f MB/s", mbps);
+  }
+  printf("\n");
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s [-R root] [-i poll_ms] [-d] [-m] pid...\n", prog);
+}
+
+int main(int argc, char** argv) {
+  heart_rate_monitor_t* hrms[HB_RDT_MAX_APPS];
+  hrm_snapshot_t snaps[HB_RDT_MAX_APPS];
+  struct sigaction sa;
+  struct timespec poll;
+  int64_t poll_ms = HB_RDT_DEFAULT_POLL_MS;
+  int monitor = 0;
+  int changed;
+  int opt;
+  int i;
+
+  snprintf(root, sizeof(root), "%s", getenv("HEARTBEAT_RESCTRL_ROOT") != NULL ?
+           getenv("HEARTBEAT_RESCTRL_ROOT") : HB_RDT_DEFAULT_ROOT);
+  while ((opt = getopt(argc, argv, "R:i:dmh")) != -1) {
+    switch (opt) {
+      case 'R':
+        snprintf(root, sizeof(root), "%s", optarg);
+        break;
+      case 'i':
+        poll_ms = atol(optarg);
+        break;
+      case 'd':
+        confine_default = 1;
+        break;
+      case 'm':
+        monitor = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind == argc || poll_ms <= 0 || argc - optind > HB_RDT_MAX_APPS) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (probe_resctrl()) {
+    return 1;
+  }
+
+  for (i = optind; i < argc; i++) {
+    attach_app(atoi(argv[i]));
+  }
+  if (napps == 0) {
+    return 1;
+  }
+  // start by sharing the ways evenly with the default group
+  for (i = 0; i < napps; i++) {
+    apps[i].ways = cat ? nways / (napps + 1) : 0;
+    if (cat && apps[i].ways < min_ways) {
+      apps[i].ways = min_ways;
+    }
+  }
+  if (cat && held_ways() + (confine_default ? min_ways : 0) > nways) {
+    fprintf(stderr, "Not enough cache ways for %d applications\n", napps);
+    while (napps > 0) {
+      release_app(napps - 1);
+    }
+    return 1;
+  }
+  apply_schemata();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  poll.tv_sec = poll_ms / 1000;
+  poll.tv_nsec = (poll_ms % 1000) * 1000000;
+  while (running && napps > 0) {
+    changed = 0;
+    for (i = napps - 1; i >= 0; i--) {
+      if (kill(apps[i].pid, 0) && errno == ESRCH) {
+        release_app(i);
+        changed = 1;
+      }
+    }
+    for (i = 0; i < napps; i++) {
+      // threads started since the last poll join the group too
+      assign_tasks(apps[i].pid, apps[i].dir);
+      hrms[i] = &apps[i].hrm;
+    }
+    hrm_snapshot_many(hrms, napps, snaps);
+    for (i = 0; i < napps; i++) {
+      if (snaps[i].valid) {
+        changed |= control_app(&apps[i], &snaps[i]);
+        report(&apps[i], &snaps[i], monitor);
+      }
+    }
+    if (changed) {
+      apply_schemata();
+    }
+    fflush(stdout);
+    nanosleep(&poll, NULL);
+  }
+
+  while (napps > 0) {
+    release_app(napps - 1);
+  }
+  default_mb = mb_max;
+  confine_default = 0;
+  apply_schemata();
+  return 0;
+}
@@ -0,0 +1,311 @@
+/**
+ * Convert heartbeat text logs to Chrome Trace Event Format JSON, which can be
+ * loaded in chrome://tracing or the Perfetto UI alongside application traces.
+ *
+ * Each heartbeat becomes an instant event, the interval since the previous
+ * heartbeat becomes a slice, and rates (plus accuracy and power when the log
+ * has them) become counter tracks. Logs written by any of the heartbeat
+ * implementations are accepted; columns are identified from the header line.
+ * Input is processed one line at a time, so memory use does not depend on the
+ * size of the logs.
+ *
+ * Usage:
+ *   hb-trace-export [-o output] [-c counter_stride] [-t offset_ns] log...
+ *
+ * Each log is shown as its own process in the trace.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+
+#define HB_TRACE_MAX_COLS 32
+
+/* Columns we know how to export */
+typedef enum {
+  COL_BEAT,
+  COL_TAG,
+  COL_TIMESTAMP,
+  COL_GLOBAL_RATE,
+  COL_WINDOW_RATE,
+  COL_INSTANT_RATE,
+  COL_GLOBAL_ACCURACY,
+  COL_WINDOW_ACCURACY,
+  COL_INSTANT_ACCURACY,
+  COL_GLOBAL_POWER,
+  COL_WINDOW_POWER,
+  COL_INSTANT_POWER,
+  COL_COUNT
+} hb_trace_col;
+
+static const char* hb_trace_col_names[COL_COUNT] = {
+  "beat",
+  "tag",
+  "timestamp",
+  "global_rate",
+  "window_rate",
+  "instant_rate",
+  "global_accuracy",
+  "window_accuracy",
+  "instant_accuracy",
+  "global_power",
+  "window_power",
+  "instant_power",
+};
+
+typedef struct {
+  FILE* out;
+  int first_event;
+  long counter_stride;
+  int64_t offset_ns;
+} hb_trace_ctx;
+
+/**
+ * Lower-case a header name and replace spaces with underscores so that the
+ * "Global Rate" and "Global_Rate" spellings match.
+ */
+static void normalize_name(char* name) {
+  for (; *name != '\0'; name++) {
+    *name = (*name == ' ') ? '_' : (char) tolower((unsigned char) *name);
+  }
+}
+
+/**
+ * Split the header line into column names. Logs separate columns with tabs
+ * or with runs of spaces, and some names themselves contain single spaces.
+ */
+static int parse_header(char* line, int* cols) {
+  char* names[HB_TRACE_MAX_COLS];
+  int n = 0;
+  int i;
+  int j;
+  char* p = line;
+  int tabs = strchr(line, '\t') != NULL;
+
+  while (*p != '\0' && n < HB_TRACE_MAX_COLS) {
+    char* end;
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    names[n++] = p;
+    if (tabs) {
+      end = strpbrk(p, "\t\r\n");
+    } else {
+      for (end = p; *end != '\0' && *end != '\r' && *end != '\n' &&
+           !(end[0] == ' ' && end[1] == ' '); end++);
+    }
+    if (end == NULL || *end == '\0') {
+      break;
+    }
+    *end = '\0';
+    p = end + 1;
+  }
+
+  for (j = 0; j < COL_COUNT; j++) {
+    cols[j] = -1;
+  }
+  for (i = 0; i < n; i++) {
+    normalize_name(names[i]);
+    // trim trailing spaces left by single-space separators at line end
+    for (j = (int) strlen(names[i]) - 1; j >= 0 && names[i][j] == '_'; j--) {
+      names[i][j] = '\0';
+    }
+    for (j = 0; j < COL_COUNT; j++) {
+      if (strcmp(names[i], hb_trace_col_names[j]) == 0) {
+        cols[j] = i;
+      }
+    }
+  }
+  return (cols[COL_BEAT] < 0 || cols[COL_TIMESTAMP] < 0) ? -1 : 0;
+}
+
+static void begin_event(hb_trace_ctx* ctx) {
+  fputs(ctx->first_event ? "\n" : ",\n", ctx->out);
+  ctx->first_event = 0;
+}
+
+/**
+ * Timestamps are printed in microseconds, as the format requires.
+ */
+static void print_us(FILE* out, int64_t ns) {
+  fprintf(out, "%"PRId64".%03d", ns / 1000, (int) ((ns % 1000 + 1000) % 1000));
+}
+
+/**
+ * JSON has no representation for inf/nan, which rates take on when two beats
+ * share a timestamp; those are written as 0.
+ */
+static double json_num(double val) {
+  return isfinite(val) ? val : 0.0;
+}
+
+static void emit_counter(hb_trace_ctx* ctx, int pid, int64_t ts, const char* name,
+                         const double* vals, const int* cols, int global_col) {
+  if (cols[global_col] < 0 && cols[global_col + 1] < 0 && cols[global_col + 2] < 0) {
+    return;
+  }
+  begin_event(ctx);
+  fprintf(ctx->out, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%d,\"ts\":", name, pid);
+  print_us(ctx->out, ts);
+  fprintf(ctx->out, ",\"args\":{\"global\":%.6f,\"window\":%.6f,\"instant\":%.6f}}",
+          json_num(vals[global_col]), json_num(vals[global_col + 1]),
+          json_num(vals[global_col + 2]));
+}
+
+static int export_log(hb_trace_ctx* ctx, const char* filename, int pid) {
+  FILE* in;
+  char* line = NULL;
+  size_t cap = 0;
+  int cols[COL_COUNT];
+  double vals[COL_COUNT];
+  char* fields[HB_TRACE_MAX_COLS];
+  int nfields;
+  int i;
+  int64_t beat;
+  int64_t ts;
+  int64_t prev_ts = -1;
+  int tag;
+  int prev_tag = 0;
+  long nbeats = 0;
+
+  in = fopen(filename, "r");
+  if (in == NULL) {
+    perror("Failed to open heartbeat log");
+    return -1;
+  }
+  if (getline(&line, &cap, in) < 0 || parse_header(line, cols)) {
+    fprintf(stderr, "%s: not a heartbeat log (missing header)\n", filename);
+    free(line);
+    fclose(in);
+    return -1;
+  }
+
+  begin_event(ctx);
+  fprintf(ctx->out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"heartbeats: ", pid);
+  for (i = 0; filename[i] != '\0'; i++) {
+    if (filename[i] == '"' || filename[i] == '\\') {
+      fputc('\\', ctx->out);
+    }
+    fputc(filename[i], ctx->out);
+  }
+  fputs("\"}}", ctx->out);
+
+  while (getline(&line, &cap, in) >= 0) {
+    char* tok = strtok(line, " \t\r\n");
+    for (nfields = 0; tok != NULL && nfields < HB_TRACE_MAX_COLS; nfields++) {
+      fields[nfields] = tok;
+      tok = strtok(NULL, " \t\r\n");
+    }
+    if (nfields <= cols[COL_BEAT] || nfields <= cols[COL_TIMESTAMP]) {
+      continue;
+    }
+    for (i = 0; i < COL_COUNT; i++) {
+      vals[i] = (cols[i] >= 0 && cols[i] < nfields) ? strtod(fields[cols[i]], NULL) : 0.0;
+    }
+    beat = strtoll(fields[cols[COL_BEAT]], NULL, 10);
+    ts = strtoll(fields[cols[COL_TIMESTAMP]], NULL, 10) + ctx->offset_ns;
+    tag = (cols[COL_TAG] >= 0 && cols[COL_TAG] < nfields) ? atoi(fields[cols[COL_TAG]]) : 0;
+
+    if (prev_ts >= 0 && ts >= prev_ts) {
+      begin_event(ctx);
+      fprintf(ctx->out, "{\"name\":\"beat %"PRId64"\",\"cat\":\"heartbeat\",\"ph\":\"X\","
+              "\"pid\":%d,\"tid\":0,\"ts\":", beat, pid);
+      print_us(ctx->out, prev_ts);
+      fputs(",\"dur\":", ctx->out);
+      print_us(ctx->out, ts - prev_ts);
+      fprintf(ctx->out, ",\"args\":{\"tag\":%d,\"prev_tag\":%d}}", tag, prev_tag);
+    }
+
+    begin_event(ctx);
+    fprintf(ctx->out, "{\"name\":\"heartbeat\",\"cat\":\"heartbeat\",\"ph\":\"i\",\"s\":\"t\","
+            "\"pid\":%d,\"tid\":0,\"ts\":", pid);
+    print_us(ctx->out, ts);
+    fprintf(ctx->out, ",\"args\":{\"beat\":%"PRId64",\"tag\":%d}}", beat, tag);
+
+    if (nbeats % ctx->counter_stride == 0) {
+      emit_counter(ctx, pid, ts, "rate", vals, cols, COL_GLOBAL_RATE);
+      emit_counter(ctx, pid, ts, "accuracy", vals, cols, COL_GLOBAL_ACCURACY);
+      emit_counter(ctx, pid, ts, "power", vals, cols, COL_GLOBAL_POWER);
+    }
+
+    prev_ts = ts;
+    prev_tag = tag;
+    nbeats++;
+  }
+
+  free(line);
+  fclose(in);
+  return 0;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s [-o output] [-c counter_stride] [-t offset_ns] log...\n", prog);
+}
+
+int main(int argc, char** argv) {
+  hb_trace_ctx ctx;
+  const char* output = NULL;
+  int opt;
+  int i;
+  int ret = 0;
+
+  ctx.out = stdout;
+  ctx.first_event = 1;
+  ctx.counter_stride = 1;
+  ctx.offset_ns = 0;
+
+  while ((opt = getopt(argc, argv, "o:c:t:h")) != -1) {
+    switch (opt) {
+      case 'o':
+        output = optarg;
+        break;
+      case 'c':
+        ctx.counter_stride = atol(optarg);
+        if (ctx.counter_stride <= 0) {
+          fprintf(stderr, "Counter stride must be > 0\n");
+          return 1;
+        }
+        break;
+      case 't':
+        ctx.offset_ns = strtoll(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (output != NULL) {
+    ctx.out = fopen(output, "w");
+    if (ctx.out == NULL) {
+      perror("Failed to open output file");
+      return 1;
+    }
+  }
+
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", ctx.out);
+  for (i = optind; i < argc; i++) {
+    if (export_log(&ctx, argv[i], i - optind + 1)) {
+      ret = 1;
+    }
+  }
+  fputs("\n]}\n", ctx.out);
+
+  if (output != NULL) {
+    fclose(ctx.out);
+  }
+  return ret;
+}
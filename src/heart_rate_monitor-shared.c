@@ -6,10 +6,35 @@
 
 #include "heart_rate_monitor.h"
 #include "heartbeat-types.h"
+#include "heartbeat-reduce-internal.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/shm.h>
 
+/* Attempts at reading an application that is in the middle of a heartbeat */
+#define HRM_SNAPSHOT_RETRIES 16
+/* Applications whose state is prefetched ahead of the one being read */
+#define HRM_SNAPSHOT_PREFETCH 8
+
+/**
+ * Returns the number of records of the log segment shmid, so that a reader
+ * never indexes past the log it has attached, whatever the state says.
+ */
+static int64_t hrm_log_depth(int shmid, int64_t record_size) {
+  struct shmid_ds ds;
+  if (record_size <= 0 || shmctl(shmid, IPC_STAT, &ds) < 0) {
+    return 0;
+  }
+  return (int64_t) (ds.shm_segsz / (size_t) record_size);
+}
+
+size_t hrm_monitor_size(void) {
+  return sizeof(heart_rate_monitor_t);
+}
+
 /**
        *
        * @param hrm pointer to heart_rate_monitor_t
@@ -23,6 +48,8 @@ int heart_rate_monitor_init(heart_rate_monitor_t* hrm,
   int rc = 0;
 
   key = pid;
+  hrm->log = NULL;
+  hrm->log_depth = 0;
   printf("Attaching mem %d, %d\n", pid, key);
 
     if((shmid1 = shmget(((key<<1)|1), 1*sizeof(HB_global_state_t), 0666)) < 0) {
@@ -36,6 +63,10 @@ int heart_rate_monitor_init(heart_rate_monitor_t* hrm,
   if(rc != 0)
     return rc;
 
+  // an odd generation means a resize is under way; the even value before it
+  // makes the next hrm_refresh() pick up the new log
+  hrm->generation = __atomic_load_n(&hrm->state->log_generation, __ATOMIC_ACQUIRE) & ~(uint64_t) 1;
+
 #if 1
   if((shmid2 = shmget(((key<<1)), hrm->state->buffer_depth*sizeof(heartbeat_record_t), 0666)) < 0) {
     rc = 2;
@@ -43,6 +74,8 @@ int heart_rate_monitor_init(heart_rate_monitor_t* hrm,
 
   if ((hrm->log = (heartbeat_record_t*) shmat(shmid2, NULL, 0)) == (heartbeat_record_t*) -1) {
     rc = 2;
+  } else {
+    hrm->log_depth = hrm_log_depth(shmid2, hrm->state->record_size);
   }
 #endif
 
@@ -57,7 +90,52 @@ int heart_rate_monitor_init(heart_rate_monitor_t* hrm,
        * @param heart pointer to heart_rate_monitor_t
        */
 void heart_rate_monitor_finish(heart_rate_monitor_t* heart) {
+  if (heart->log != NULL && heart->log != (heartbeat_record_t*) -1) {
+    shmdt(heart->log);
+  }
+  if (heart->state != NULL && heart->state != (HB_global_state_t*) -1) {
+    shmdt(heart->state);
+  }
+  heart->log = NULL;
+  heart->state = NULL;
+}
+
+/**
+       *
+       * @param hrm pointer to heart_rate_monitor_t
+       * @return int
+       */
+int hrm_refresh(heart_rate_monitor_t volatile * hrm) {
+  uint64_t gen = __atomic_load_n(&hrm->state->log_generation, __ATOMIC_ACQUIRE);
+  heartbeat_record_t* log;
+  int shmid;
 
+  if (gen == hrm->generation) {
+    return 0;
+  }
+  for (;;) {
+    while (gen & 1) {
+      sched_yield();
+      gen = __atomic_load_n(&hrm->state->log_generation, __ATOMIC_ACQUIRE);
+    }
+    if ((shmid = shmget(hrm->state->pid << 1, 0, 0666)) < 0 ||
+	(log = (heartbeat_record_t*) shmat(shmid, NULL, 0)) == (heartbeat_record_t*) -1) {
+      return -1;
+    }
+    if (__atomic_load_n(&hrm->state->log_generation, __ATOMIC_ACQUIRE) == gen) {
+      break;
+    }
+    // resized again while attaching
+    shmdt(log);
+    gen = __atomic_load_n(&hrm->state->log_generation, __ATOMIC_ACQUIRE);
+  }
+  if (hrm->log != NULL && hrm->log != (heartbeat_record_t*) -1) {
+    shmdt(hrm->log);
+  }
+  hrm->log = log;
+  hrm->log_depth = hrm_log_depth(shmid, hrm->state->record_size);
+  hrm->generation = gen;
+  return 1;
 }
 
 /**
@@ -67,6 +145,7 @@ void heart_rate_monitor_finish(heart_rate_monitor_t* heart) {
        */
 int hrm_get_current(heart_rate_monitor_t volatile * hb,
 		     heartbeat_record_t volatile * record) {
+  hrm_refresh(hb);
   //memcpy(record, &hb->log[hb->state->read_index], sizeof(heartbeat_record_t));
     if(hb->state->valid) {
       memcpy(record,
@@ -77,6 +156,160 @@ int hrm_get_current(heart_rate_monitor_t volatile * hb,
     return !hb->state->valid;
 }
 
+static inline const char* hrm_record(heart_rate_monitor_t volatile * hrm, int64_t index) {
+  return (const char*) hrm->log + index * hrm->state->record_size;
+}
+
+/**
+ * Copies one application's state into s under its heartbeat sequence lock.
+ * Returns s->valid.
+ */
+static int hrm_snapshot_one(heart_rate_monitor_t volatile * hrm,
+			    hrm_snapshot_t* s) {
+  HB_global_state_t volatile * st = hrm->state;
+  const char* rec;
+  const double* extra;
+  uint64_t seq;
+  int64_t index;
+  int tries;
+
+  memset(s, 0, sizeof(*s));
+  for (tries = 0; tries < HRM_SNAPSHOT_RETRIES; tries++) {
+    if (hrm_refresh(hrm) < 0) {
+      break;
+    }
+    seq = __atomic_load_n(&st->beat_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      // let a preempted writer finish its heartbeat
+      sched_yield();
+      continue;
+    }
+    index = st->read_index;
+    if (!st->valid || index < 0 || index >= hrm->log_depth) {
+      s->valid = 0;
+    } else {
+      rec = hrm_record(hrm, index);
+      s->valid = 1;
+      s->features = st->features;
+      s->beat = ((const heartbeat_record_t*) rec)->beat;
+      s->tag = ((const heartbeat_record_t*) rec)->tag;
+      s->timestamp = ((const heartbeat_record_t*) rec)->timestamp;
+      s->global_rate = ((const heartbeat_record_t*) rec)->global_rate;
+      s->window_rate = ((const heartbeat_record_t*) rec)->window_rate;
+      s->instant_rate = ((const heartbeat_record_t*) rec)->instant_rate;
+      // accuracy, then power, follow the rates in the layouts that have them
+      extra = (const double*) (rec + offsetof(heartbeat_record_t, instant_rate) + sizeof(double));
+      if (s->features & HB_FEATURE_ACCURACY) {
+	memcpy(s->accuracy, extra, sizeof(s->accuracy));
+	extra += 3;
+      }
+      if (s->features & HB_FEATURE_POWER) {
+	memcpy(s->power, extra, sizeof(s->power));
+      }
+      memcpy(&s->ipc, rec + HB_RECORD_COUNTERS_OFFSET(s->features), 3 * sizeof(double));
+      s->min_rate = st->min_heartrate;
+      s->max_rate = st->max_heartrate;
+      s->window_size = st->window_size;
+      s->effective_window = st->effective_window;
+      // levels for now, extrapolated once the capture time is known
+      s->forecast_rate = st->rate_level;
+      s->forecast_power = st->power_level;
+      s->rate_trend = st->rate_trend;
+      s->power_trend = st->power_trend;
+      s->global_cpu_rate = st->global_cpu_rate;
+      s->window_cpu_rate = st->window_cpu_rate;
+      s->instant_cpu_rate = st->instant_cpu_rate;
+      s->progress = st->work_goal > 0 ? (double) st->work_done / (double) st->work_goal : 0;
+      s->eta = st->eta;
+      s->eta_low = st->eta_low;
+      s->eta_high = st->eta_high;
+    }
+    s->pid = st->pid;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&st->beat_seq, __ATOMIC_RELAXED) == seq &&
+	__atomic_load_n(&st->log_generation, __ATOMIC_RELAXED) == hrm->generation) {
+      return s->valid;
+    }
+  }
+  s->valid = 0;
+  return 0;
+}
+
+/**
+ * Starts loading the cache lines hrm_snapshot_one() reads from the state.
+ */
+static inline void hrm_prefetch_state(heart_rate_monitor_t volatile * hrm) {
+  HB_global_state_t volatile * st = hrm->state;
+  __builtin_prefetch((const void*) st);
+  __builtin_prefetch((const void*) &st->rate_level);
+  __builtin_prefetch((const void*) &st->beat_seq);
+}
+
+/**
+ * Starts loading the current record; its read_index was prefetched earlier.
+ */
+static inline void hrm_prefetch_record(heart_rate_monitor_t volatile * hrm) {
+  int64_t index = hrm->state->read_index;
+  const char* rec;
+  if (index >= 0 && index < hrm->log_depth) {
+    rec = hrm_record(hrm, index);
+    __builtin_prefetch(rec);
+    __builtin_prefetch(rec + hrm->state->record_size - 1);
+  }
+}
+
+/**
+       *
+       * @param hrms array of n pointers to heart_rate_monitor_t
+       * @param n int64_t
+       * @param out array of n hrm_snapshot_t
+       * @return int64_t
+       */
+int64_t hrm_snapshot_many(heart_rate_monitor_t* const* hrms,
+			  int64_t n,
+			  hrm_snapshot_t* out) {
+  struct timespec ts;
+  int64_t now;
+  int64_t valid = 0;
+  int64_t i;
+
+  // the state of application i + HRM_SNAPSHOT_PREFETCH and the record of
+  // application i + HRM_SNAPSHOT_PREFETCH / 2 are in flight while i is read
+  for (i = 0; i < n && i < HRM_SNAPSHOT_PREFETCH; i++) {
+    hrm_prefetch_state(hrms[i]);
+  }
+  for (i = 0; i < n && i < HRM_SNAPSHOT_PREFETCH / 2; i++) {
+    hrm_prefetch_record(hrms[i]);
+  }
+  for (i = 0; i < n; i++) {
+    if (i + HRM_SNAPSHOT_PREFETCH < n) {
+      hrm_prefetch_state(hrms[i + HRM_SNAPSHOT_PREFETCH]);
+    }
+    if (i + HRM_SNAPSHOT_PREFETCH / 2 < n) {
+      hrm_prefetch_record(hrms[i + HRM_SNAPSHOT_PREFETCH / 2]);
+    }
+    valid += hrm_snapshot_one(hrms[i], &out[i]);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+  for (i = 0; i < n; i++) {
+    out[i].capture_time = now;
+    if (out[i].valid) {
+      out[i].age = now - out[i].timestamp;
+      out[i].forecast_rate += out[i].rate_trend * (double) out[i].age;
+      out[i].forecast_power += out[i].power_trend * (double) out[i].age;
+      if (out[i].forecast_rate < 0) {
+	out[i].forecast_rate = 0;
+      }
+      if (out[i].forecast_power < 0) {
+	out[i].forecast_power = 0;
+      }
+    }
+  }
+  return valid;
+}
+
 /**
        *
        * @param hb pointer to heart_rate_monitor_t
@@ -85,7 +318,8 @@ int hrm_get_current(heart_rate_monitor_t volatile * hb,
 int hrm_get_history(heart_rate_monitor_t volatile * hb,
 		     heartbeat_record_t volatile * record,
 		     int n) {
-  if(hb->state->counter > hb->state->buffer_index) {
+  hrm_refresh(hb);
+  if(hb->state->counter - hb->state->log_start > hb->state->buffer_index) {
      memcpy(record,
 	    &hb->log[hb->state->buffer_index],
 	    (size_t)(hb->state->buffer_index*hb->state->buffer_depth)*sizeof(heartbeat_record_t));
@@ -102,12 +336,35 @@ int hrm_get_history(heart_rate_monitor_t volatile * hb,
   }
 }
 
+/**
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @param n int64_t
+       * @param fields uint32_t
+       * @param out pointer to hb_reduction_t
+       * @return int64_t
+       */
+int64_t hrm_reduce_history(heart_rate_monitor_t volatile * hb,
+			   int64_t n,
+			   uint32_t fields,
+			   hb_reduction_t* out) {
+  hrm_refresh(hb);
+  return HB_reduce_ring((const void*) hb->log,
+			hb->state->record_size,
+			hb->state->features,
+			hb->state->buffer_depth,
+			hb->state->buffer_index,
+			hb->state->counter - hb->state->log_start,
+			n, fields, out);
+}
+
 /**
        *
        * @param hb pointer to heart_rate_monitor_t
        * @return double
        */
 double hrm_get_global_rate(heart_rate_monitor_t volatile * hb) {
+  hrm_refresh(hb);
   return hb->log[hb->state->counter].global_rate;
 }
 
@@ -117,6 +374,7 @@ double hrm_get_global_rate(heart_rate_monitor_t volatile * hb) {
        * @return double
        */
 double hrm_get_windowed_rate(heart_rate_monitor_t volatile * hb) {
+  hrm_refresh(hb);
   return hb->log[hb->state->counter].window_rate;
 }
 
@@ -147,3 +405,167 @@ int64_t hrm_get_window_size(heart_rate_monitor_t volatile * hb) {
   return hb->state->window_size;
 }
 
+/**
+       * Multi-producer enqueue: claim a position by advancing the head,
+       * fill the slot, then publish it through its sequence number.
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @param cmd pointer to hb_command_t
+       * @return int
+       */
+int hrm_post_command(heart_rate_monitor_t volatile * hb,
+		     const hb_command_t* cmd) {
+  HB_global_state_t* state = hb->state;
+  uint64_t pos = __atomic_load_n(&state->command_head, __ATOMIC_RELAXED);
+  _HB_command_t* slot;
+
+  for (;;) {
+    int64_t dif;
+    slot = &state->commands[pos & (HB_COMMAND_SLOTS - 1)];
+    dif = (int64_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&state->command_head, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	break;
+      }
+    } else if (dif < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&state->command_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->type = cmd->type;
+  slot->flags = cmd->flags;
+  slot->arg = cmd->arg;
+  slot->value[0] = cmd->value[0];
+  slot->value[1] = cmd->value[1];
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int hrm_get_rusage(heart_rate_monitor_t volatile * hb, hb_rusage_t* rusage) {
+  uint64_t seq;
+  int tries;
+  for (tries = 0; tries < HRM_SNAPSHOT_RETRIES; tries++) {
+    seq = __atomic_load_n(&hb->state->rusage_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      // let a preempted writer finish its sample
+      sched_yield();
+      continue;
+    }
+    memcpy(rusage, (const void*) &hb->state->rusage, sizeof(*rusage));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hb->state->rusage_seq, __ATOMIC_RELAXED) == seq) {
+      return rusage->beats > 0 ? 0 : -1;
+    }
+  }
+  // the writer is stuck in a sample (stopped or died in one)
+  return -1;
+}
+
+double hrm_get_progress(heart_rate_monitor_t volatile * hb) {
+  int64_t goal = hb->state->work_goal;
+  return goal > 0 ? (double) hb->state->work_done / (double) goal : 0;
+}
+
+int64_t hrm_get_eta(heart_rate_monitor_t volatile * hb,
+		    int64_t* low,
+		    int64_t* high) {
+  uint64_t seq;
+  int64_t eta;
+  int64_t l;
+  int64_t h;
+  int tries;
+  for (tries = 0; tries < HRM_SNAPSHOT_RETRIES; tries++) {
+    seq = __atomic_load_n(&hb->state->beat_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      // let a preempted writer finish its heartbeat
+      sched_yield();
+      continue;
+    }
+    eta = hb->state->eta;
+    l = hb->state->eta_low;
+    h = hb->state->eta_high;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hb->state->beat_seq, __ATOMIC_RELAXED) == seq) {
+      if (low != NULL) {
+	*low = l;
+      }
+      if (high != NULL) {
+	*high = h;
+      }
+      return eta;
+    }
+  }
+  // the application is stuck in a heartbeat (stopped or died in one)
+  return 0;
+}
+
+double hrm_get_global_cpu_rate(heart_rate_monitor_t volatile * hb) {
+  return hb->state->global_cpu_rate;
+}
+
+double hrm_get_windowed_cpu_rate(heart_rate_monitor_t volatile * hb) {
+  return hb->state->window_cpu_rate;
+}
+
+double hrm_get_instant_cpu_rate(heart_rate_monitor_t volatile * hb) {
+  return hb->state->instant_cpu_rate;
+}
+
+int64_t hrm_get_pacing_time(heart_rate_monitor_t volatile * hb) {
+  return hb->state->pace_time;
+}
+
+/**
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @param horizon_ns int64_t
+       * @return double
+       */
+double hrm_get_forecast_rate(heart_rate_monitor_t volatile * hb,
+			     int64_t horizon_ns) {
+  double rate = hb->state->rate_level + hb->state->rate_trend * (double) horizon_ns;
+  return rate > 0 ? rate : 0;
+}
+
+/**
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @param horizon_ns int64_t
+       * @return double
+       */
+double hrm_get_forecast_power(heart_rate_monitor_t volatile * hb,
+			      int64_t horizon_ns) {
+  double power = hb->state->power_level + hb->state->power_trend * (double) horizon_ns;
+  return power > 0 ? power : 0;
+}
+
+/**
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @return int64_t
+       */
+int64_t hrm_get_effective_window_size(heart_rate_monitor_t volatile * hb) {
+  return hb->state->effective_window;
+}
+
+/**
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @return int64_t
+       */
+int64_t hrm_get_record_size(heart_rate_monitor_t volatile * hb) {
+  return hb->state->record_size;
+}
+
+/**
+       *
+       * @param hb pointer to heart_rate_monitor_t
+       * @return int64_t
+       */
+int64_t hrm_get_features(heart_rate_monitor_t volatile * hb) {
+  return hb->state->features;
+}
+
@@ -34,7 +34,7 @@ static inline void finish_energy_readings(uint64_t num_energy_impls,
           fprintf(stderr, "Error finishing energy reading from: %s\n",
                   energy_source);
         } else {
-          printf("Finished energy reading from: %s\n", energy_source);
+          fprintf(stderr, "Finished energy reading from: %s\n", energy_source);
         }
       }
 
@@ -65,6 +65,11 @@ heartbeat_t* heartbeat_acc_pow_init(int64_t window_size,
   }
   // set to NULL so free doesn't fail in finish function if we have to abort
   hb->window = NULL;
+  hb->counters = NULL;
+  hb->rusage_schedstat_fd = -1;
+  hb->rusage_sched_fd = -1;
+  hb->work_window = NULL;
+  hb->cpu_window = NULL;
   hb->accuracy_window = NULL;
   hb->power_window = NULL;
   hb->text_file = NULL;
@@ -97,7 +102,6 @@ heartbeat_t* heartbeat_acc_pow_init(int64_t window_size,
     return NULL;
   }
   snprintf(hb->filename, sizeof(hb->filename), "%s/%d", enabled_dir, hb->state->pid);
-  printf("%s\n", hb->filename);
 
   hb->log = HB_alloc_log(hb->state->pid, buffer_depth);
   if(hb->log == NULL) {
@@ -113,6 +117,24 @@ heartbeat_t* heartbeat_acc_pow_init(int64_t window_size,
     heartbeat_finish(hb);
     return NULL;
   }
+  hb->work_window = (int64_t*) malloc((size_t)window_size*sizeof(int64_t));
+  if (hb->work_window == NULL) {
+    perror("Failed to malloc work window");
+    heartbeat_finish(hb);
+    return NULL;
+  }
+  hb->cpu_window = (int64_t*) malloc((size_t) window_size * sizeof(int64_t));
+  if (hb->cpu_window == NULL) {
+    perror("Failed to malloc CPU time window");
+    heartbeat_finish(hb);
+    return NULL;
+  }
+  hb->window_work = 0;
+  hb->total_work = 0;
+  hb->flush_index = 0;
+  hb->adaptive = 0;
+  hb->forecast_alpha = HB_FORECAST_ALPHA;
+  hb->forecast_beta = HB_FORECAST_BETA;
   hb->accuracy_window = (double*) malloc((size_t)window_size*sizeof(double));
   if (hb->accuracy_window == NULL) {
     perror("Failed to malloc accuracy window");
@@ -136,6 +158,18 @@ heartbeat_t* heartbeat_acc_pow_init(int64_t window_size,
   hb->state->buffer_index = 0;
   hb->state->read_index = 0;
   hb->state->buffer_depth = buffer_depth;
+  hb->state->record_size = sizeof(heartbeat_record_t);
+  hb->state->features = HB_RECORD_FEATURES;
+  hb->state->effective_window = window_size;
+  HB_forecast_reset(hb);
+  HB_command_reset(hb);
+  HB_rusage_reset(hb);
+  HB_cpu_reset(hb, HB_CPU_CLOCK_NONE);
+  HB_eta_reset(hb);
+  HB_pace_reset(hb);
+  hb->state->log_generation = 0;
+  hb->state->log_start = 0;
+  hb->state->beat_seq = 0;
   pthread_mutex_init(&hb->mutex, NULL);
   hb->steady_state = 0;
   hb->state->valid = 0;
@@ -172,7 +206,7 @@ heartbeat_t* heartbeat_acc_pow_init(int64_t window_size,
           heartbeat_finish(hb);
           return NULL;
         }
-        printf("Initialized energy reading from: %s\n", hb_energy_src);
+        fprintf(stderr, "Initialized energy reading from: %s\n", hb_energy_src);
       }
     }
   }
@@ -197,7 +231,7 @@ heartbeat_t* heartbeat_init(int64_t window_size,
  *
  * @param hb pointer to heartbeat_t
  */
-static void hb_flush_buffer(heartbeat_t volatile * hb) {
+void HB_flush_buffer(heartbeat_t volatile * hb) {
   int64_t i;
   int64_t nrecords = hb->state->buffer_index; // buffer_depth
 
@@ -205,7 +239,7 @@ static void hb_flush_buffer(heartbeat_t volatile * hb) {
   //	 (long long int) nrecords);
 
   if(hb->text_file != NULL) {
-    for(i = 0; i < nrecords; i++) {
+    for(i = hb->flush_index; i < nrecords; i++) {
       fprintf(hb->text_file,
               "%lld    %d    %lld    %f    %f    %f    %f    %f    %f    %f    %f    %f\n",
               (long long int) hb->log[i].beat,
@@ -224,16 +258,21 @@ static void hb_flush_buffer(heartbeat_t volatile * hb) {
 
     fflush(hb->text_file);
   }
+  hb->flush_index = 0;
 }
 
 void heartbeat_finish(heartbeat_t* hb) {
   if (hb != NULL) {
     pthread_mutex_destroy(&hb->mutex);
+    HB_counters_close(hb->counters);
+    HB_rusage_finish(hb);
     free(hb->window);
+    free(hb->work_window);
+    free(hb->cpu_window);
     free(hb->accuracy_window);
     free(hb->power_window);
     if(hb->text_file != NULL) {
-      hb_flush_buffer(hb);
+      HB_flush_buffer(hb);
       fclose(hb->text_file);
     }
     remove(hb->filename);
@@ -251,6 +290,7 @@ void heartbeat_finish(heartbeat_t* hb) {
  *
  * @param hb pointer to heartbeat_t
  * @param time int64_t
+ * @param work int64_t
  * @param accuracy double
  * @param accuracy_rate double
  * @param energy double
@@ -258,12 +298,14 @@ void heartbeat_finish(heartbeat_t* hb) {
  */
 static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
     int64_t time,
+    int64_t work,
     double accuracy,
     double* accuracy_rate,
     double energy,
     double* power_rate) {
   int i;
   double average_time = 0;
+  double average_work;
   double average_accuracy = 0;
   double average_power = 0;
   double fps;
@@ -273,6 +315,8 @@ static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
 
   if(!hb->steady_state) {  // not yet reached a full window of heartbeats
     hb->window[hb->current_index] = time;
+    hb->work_window[hb->current_index] = work;
+    hb->window_work += work;
     hb->accuracy_window[hb->current_index] = accuracy;
     hb->power_window[hb->current_index] = energy;
 
@@ -283,6 +327,7 @@ static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
     }
     hb->last_window_time       = window_time = average_time;
     average_time               = average_time     / ((double) hb->current_index+1);
+    average_work               = (double) hb->window_work / ((double) hb->current_index+1);
     average_accuracy           = average_accuracy / ((double) hb->current_index+1);
     hb->last_window_energy     = window_energy = average_power;
     average_power              = average_power    / hb->last_window_time;
@@ -316,6 +361,8 @@ static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
     average_accuracy += (double) accuracy /  (double) hb->state->window_size;
     window_time += (double) time;
     window_energy += energy;
+    hb->window_work += work - hb->work_window[hb->current_index];
+    average_work = (double) hb->window_work / (double) hb->state->window_size;
 
 
 
@@ -326,6 +373,7 @@ static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
 
 
     hb->window[hb->current_index] = time;
+    hb->work_window[hb->current_index] = work;
     hb->accuracy_window[hb->current_index] = accuracy;
     hb->power_window[hb->current_index] = energy;
 
@@ -334,7 +382,7 @@ static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
     if( hb->current_index == hb->state->window_size)
       hb->current_index = 0;
   }
-  fps = (1.0 / (float) average_time)*1000000000;
+  fps = (average_work / (float) average_time)*1000000000;
 
   *accuracy_rate = average_accuracy;
 
@@ -345,16 +393,28 @@ static inline float hb_window_average_accuracy(heartbeat_t volatile * hb,
   return (float)fps;
 }
 
-int64_t heartbeat_acc( heartbeat_t* hb, int tag, double accuracy ) {
+/**
+ * Registers a heartbeat for n units of work
+ *
+ * @param hb pointer to heartbeat_t
+ * @param tag integer
+ * @param accuracy double
+ * @param n int64_t
+ */
+static int64_t heartbeat_acc_n( heartbeat_t* hb, int tag, double accuracy, int64_t n ) {
   struct timespec time_info;
   int64_t time;
   int64_t old_last_time;
+  hb_command_t cmds[HB_COMMAND_SLOTS];
+  int ncmds;
   double old_last_energy;
   double energy = 0.0;
   double energy_tmp;
   uint64_t i;
 
   pthread_mutex_lock(&hb->mutex);
+  HB_pace(hb, n);
+  HB_beat_begin(hb);
   //printf("Registering Heartbeat\n");
   old_last_time = hb->last_timestamp;
   old_last_energy = hb->last_energy;
@@ -376,6 +436,7 @@ int64_t heartbeat_acc( heartbeat_t* hb, int tag, double accuracy ) {
 
   hb->last_timestamp = time;
   hb->last_energy = energy;
+  hb->total_work += n;
 
   if(hb->first_timestamp == -1) {
     //printf("In heartbeat - first time stamp\n");
@@ -393,6 +454,9 @@ int64_t heartbeat_acc( heartbeat_t* hb, int tag, double accuracy ) {
     hb->log[0].window_rate = 0;
     hb->log[0].instant_rate = 0;
     hb->log[0].global_rate = 0;
+    HB_counters_record(hb, 0, n);
+    // CPU-time rates start from the first beat like the wall-clock ones
+    HB_cpu_reset(hb, hb->state->cpu_clock);
     hb->log[0].window_accuracy = accuracy;
     hb->log[0].instant_accuracy = accuracy;
     hb->log[0].global_accuracy = accuracy;
@@ -410,16 +474,23 @@ int64_t heartbeat_acc( heartbeat_t* hb, int tag, double accuracy ) {
     double window_power;
     int64_t index =  hb->state->buffer_index;
     hb->last_timestamp = time;
+    double adaptive_heartrate = HB_adaptive_window_rate(hb, time-old_last_time, n);
+    HB_cpu_rate_update(hb, n);
+    HB_eta_update(hb, time, time - old_last_time, n);
     double window_heartrate = hb_window_average_accuracy(hb,
                               time-old_last_time,
+                              n,
                               accuracy,
                               &window_accuracy,
                               energy - old_last_energy,
                               &window_power);
+    if (hb->adaptive) {
+      window_heartrate = adaptive_heartrate;
+    }
     double global_heartrate =
-      (((double) hb->state->counter+1) /
+      (((double) hb->total_work) /
        ((double) (time - hb->first_timestamp)))*1000000000.0;
-    double instant_heartrate = 1.0 /(((double) (time - old_last_time))) *
+    double instant_heartrate = ((double) n) /(((double) (time - old_last_time))) *
                                1000000000.0;
 
     hb->global_accuracy += accuracy;
@@ -440,29 +511,45 @@ int64_t heartbeat_acc( heartbeat_t* hb, int tag, double accuracy ) {
     hb->log[index].window_rate      = window_heartrate;
     hb->log[index].instant_rate     = instant_heartrate;
     hb->log[index].global_rate      = global_heartrate;
+    HB_counters_record(hb, index, n);
     hb->log[index].window_accuracy  = window_accuracy;
     hb->log[index].instant_accuracy = instant_accuracy;
     hb->log[index].global_accuracy  = global_accuracy;
     hb->log[index].window_power     = window_power;
     hb->log[index].instant_power    = instant_power;
     hb->log[index].global_power     = global_power;
+    HB_forecast_update(hb, time, time - old_last_time, instant_heartrate, instant_power);
     hb->state->buffer_index++;
     hb->state->counter++;
     hb->state->read_index++;
 
     if(hb->state->buffer_index%hb->state->buffer_depth == 0) {
       if(hb->text_file != NULL)
-        hb_flush_buffer(hb);
+        HB_flush_buffer(hb);
       hb->state->buffer_index = 0;
     }
     if(hb->state->read_index%hb->state->buffer_depth == 0) {
       hb->state->read_index = 0;
     }
   }
+  HB_beat_end(hb);
+  HB_rusage_poll(hb, time);
+  ncmds = HB_command_poll(hb, cmds);
   pthread_mutex_unlock(&hb->mutex);
+  if (ncmds > 0) {
+    HB_command_dispatch(hb, cmds, ncmds);
+  }
   return time;
 }
 
+int64_t heartbeat_acc(heartbeat_t* hb, int tag, double accuracy) {
+  return heartbeat_acc_n(hb, tag, accuracy, 1);
+}
+
 int64_t heartbeat(heartbeat_t* hb, int tag) {
-  return heartbeat_acc(hb, tag, 0.0);
+  return heartbeat_acc_n(hb, tag, 0.0, 1);
+}
+
+int64_t heartbeat_n(heartbeat_t* hb, int tag, int64_t n) {
+  return heartbeat_acc_n(hb, tag, 0.0, n);
 }
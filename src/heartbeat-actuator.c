@@ -0,0 +1,472 @@
+/**
+ * Actuators for affinity, cpufreq, cgroup CPU bandwidth, powercap limits
+ * and simulated core frequency.
+ *
+ * @see heartbeat-actuator.h
+ */
+#define _GNU_SOURCE
+#include "heartbeat-actuator.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include "sim_api.h"
+
+/* weight of the newest measurement in cost_ns */
+#define HB_ACTUATOR_COST_SMOOTHING 0.125
+/* the smallest quota cpu.max accepts (us) */
+#define HB_ACTUATOR_CGROUP_MIN_QUOTA 1000
+#define HB_ACTUATOR_SIM_MIN_MHZ 100
+#define HB_ACTUATOR_SIM_MAX_MHZ 10000
+
+struct hb_actuator {
+  hb_actuator_info_t info;
+  int (*apply)(hb_actuator_t* a, double value);
+  double (*read)(hb_actuator_t* a);
+  void (*release)(hb_actuator_t* a);
+  /* last setting applied, NAN if none */
+  double last;
+  double* values;
+  /* file written by apply and file read back, -1 if unused */
+  int fd;
+  int read_fd;
+  int id;
+  DIR* tasks;
+  int* cpus;
+  int64_t period;
+};
+
+static int64_t hb_actuator_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+static hb_actuator_t* hb_actuator_new(const char* name, const char* unit) {
+  hb_actuator_t* a = (hb_actuator_t*) calloc(1, sizeof(hb_actuator_t));
+  if (a == NULL) {
+    return NULL;
+  }
+  a->info.name = name;
+  a->info.unit = unit;
+  a->info.kind = HB_ACTUATOR_CONTINUOUS;
+  a->last = NAN;
+  a->fd = -1;
+  a->read_fd = -1;
+  return a;
+}
+
+/**
+ * Makes the knob discrete with settings values[0..n), which must increase.
+ * Takes ownership of values.
+ */
+static void hb_actuator_discrete(hb_actuator_t* a, double* values, int64_t n) {
+  a->values = values;
+  a->info.kind = HB_ACTUATOR_DISCRETE;
+  a->info.values = values;
+  a->info.nvalues = n;
+  a->info.min = values[0];
+  a->info.max = values[n - 1];
+}
+
+static int hb_actuator_write(int fd, const char* text) {
+  size_t len = strlen(text);
+  return pwrite(fd, text, len, 0) == (ssize_t) len ? 0 : -1;
+}
+
+/**
+ * Reads a whole small file through a cached descriptor.
+ */
+static int hb_actuator_read(int fd, char* buf, size_t size) {
+  ssize_t len = pread(fd, buf, size - 1, 0);
+  if (len <= 0) {
+    return -1;
+  }
+  buf[len] = '\0';
+  return 0;
+}
+
+static int hb_actuator_read_path(const char* dir, const char* file, char* buf, size_t size) {
+  char path[PATH_MAX];
+  int fd;
+  int rc;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  rc = hb_actuator_read(fd, buf, size);
+  close(fd);
+  return rc;
+}
+
+static int hb_actuator_open_path(const char* dir, const char* file, int flags) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  return open(path, flags | O_CLOEXEC);
+}
+
+void hb_actuator_close(hb_actuator_t* a) {
+  if (a == NULL) {
+    return;
+  }
+  if (a->release != NULL) {
+    a->release(a);
+  }
+  if (a->fd >= 0) {
+    close(a->fd);
+  }
+  if (a->read_fd >= 0) {
+    close(a->read_fd);
+  }
+  free(a->values);
+  free(a);
+}
+
+int hb_actuator_set(hb_actuator_t* a, double value) {
+  const double* v = a->info.values;
+  int64_t lo = 0;
+  int64_t hi = a->info.nvalues - 1;
+  int64_t mid;
+  int64_t start;
+  int rc;
+
+  if (value < a->info.min) {
+    value = a->info.min;
+  } else if (value > a->info.max) {
+    value = a->info.max;
+  }
+  if (a->info.kind == HB_ACTUATOR_DISCRETE) {
+    // nearest setting: v[lo] <= value < v[lo + 1]
+    while (hi - lo > 1) {
+      mid = (lo + hi) / 2;
+      if (v[mid] <= value) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    value = value - v[lo] <= v[hi] - value ? v[lo] : v[hi];
+  }
+  if (value == a->last) {
+    return 0;
+  }
+  start = hb_actuator_now();
+  rc = a->apply(a, value);
+  a->info.cost_ns += (int64_t) (HB_ACTUATOR_COST_SMOOTHING *
+                                (double) (hb_actuator_now() - start - a->info.cost_ns));
+  a->last = rc == 0 ? value : NAN;
+  return rc;
+}
+
+double hb_actuator_get(hb_actuator_t* a) {
+  return a->read(a);
+}
+
+void hb_actuator_invalidate(hb_actuator_t* a) {
+  a->last = NAN;
+}
+
+const hb_actuator_info_t* hb_actuator_info(hb_actuator_t* a) {
+  return &a->info;
+}
+
+/*
+ * Affinity
+ */
+
+static int hb_affinity_apply(hb_actuator_t* a, double value) {
+  cpu_set_t set;
+  struct dirent* ent;
+  int64_t n = (int64_t) value;
+  int64_t i;
+  int tid;
+  int rc = -1;
+
+  CPU_ZERO(&set);
+  for (i = 0; i < n; i++) {
+    CPU_SET(a->cpus[i], &set);
+  }
+  // every thread, not just the main one as taskset -p does
+  rewinddir(a->tasks);
+  while ((ent = readdir(a->tasks)) != NULL) {
+    if ((tid = atoi(ent->d_name)) > 0 && sched_setaffinity(tid, sizeof(set), &set) == 0) {
+      rc = 0;
+    }
+  }
+  return rc;
+}
+
+static double hb_affinity_read(hb_actuator_t* a) {
+  cpu_set_t set;
+  if (sched_getaffinity(a->id, sizeof(set), &set)) {
+    return -1;
+  }
+  return (double) CPU_COUNT(&set);
+}
+
+static void hb_affinity_release(hb_actuator_t* a) {
+  if (a->tasks != NULL) {
+    closedir(a->tasks);
+  }
+  free(a->cpus);
+}
+
+hb_actuator_t* hb_actuator_affinity(int pid) {
+  hb_actuator_t* a;
+  cpu_set_t set;
+  char path[64];
+  double* values;
+  int n = 0;
+  int cpu;
+
+  if (sched_getaffinity(pid, sizeof(set), &set) || CPU_COUNT(&set) == 0) {
+    return NULL;
+  }
+  a = hb_actuator_new("affinity", "CPUs");
+  if (a == NULL) {
+    return NULL;
+  }
+  a->id = pid;
+  a->apply = hb_affinity_apply;
+  a->read = hb_affinity_read;
+  a->release = hb_affinity_release;
+  a->info.latency_ns = 1000000;
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  a->tasks = opendir(path);
+  a->cpus = (int*) malloc((size_t) CPU_COUNT(&set) * sizeof(int));
+  values = (double*) malloc((size_t) CPU_COUNT(&set) * sizeof(double));
+  if (a->tasks == NULL || a->cpus == NULL || values == NULL) {
+    free(values);
+    hb_actuator_close(a);
+    return NULL;
+  }
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      a->cpus[n] = cpu;
+      values[n] = (double) (n + 1);
+      n++;
+    }
+  }
+  hb_actuator_discrete(a, values, n);
+  return a;
+}
+
+/*
+ * cpufreq
+ */
+
+static int hb_cpufreq_apply(hb_actuator_t* a, double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld\n", (long long) value);
+  return hb_actuator_write(a->fd, buf);
+}
+
+static double hb_cpufreq_read(hb_actuator_t* a) {
+  char buf[32];
+  return hb_actuator_read(a->read_fd, buf, sizeof(buf)) ? -1 : atof(buf);
+}
+
+static int hb_compare_double(const void* x, const void* y) {
+  double a = *(const double*) x;
+  double b = *(const double*) y;
+  return (a > b) - (a < b);
+}
+
+hb_actuator_t* hb_actuator_cpufreq(int cpu) {
+  hb_actuator_t* a;
+  char dir[64];
+  char buf[4096];
+  char* p;
+  char* end;
+  double* values;
+  int64_t n = 0;
+
+  snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d/cpufreq", cpu);
+  a = hb_actuator_new("cpufreq", "kHz");
+  if (a == NULL) {
+    return NULL;
+  }
+  a->id = cpu;
+  a->apply = hb_cpufreq_apply;
+  a->read = hb_cpufreq_read;
+  if (hb_actuator_read_path(dir, "scaling_governor", buf, sizeof(buf)) == 0 &&
+      strncmp(buf, "userspace", 9) == 0) {
+    a->fd = hb_actuator_open_path(dir, "scaling_setspeed", O_WRONLY);
+  } else {
+    a->fd = hb_actuator_open_path(dir, "scaling_max_freq", O_WRONLY);
+  }
+  a->read_fd = hb_actuator_open_path(dir, "scaling_cur_freq", O_RDONLY);
+  if (a->fd < 0 || a->read_fd < 0) {
+    hb_actuator_close(a);
+    return NULL;
+  }
+  if (hb_actuator_read_path(dir, "cpuinfo_transition_latency", buf, sizeof(buf)) == 0) {
+    a->info.latency_ns = atoll(buf);
+  }
+
+  if (hb_actuator_read_path(dir, "scaling_available_frequencies", buf, sizeof(buf)) == 0 &&
+      (values = (double*) malloc(sizeof(buf) / 2 * sizeof(double))) != NULL) {
+    for (p = buf; ; p = end) {
+      values[n] = strtod(p, &end);
+      if (end == p) {
+        break;
+      }
+      n++;
+    }
+    if (n > 0) {
+      qsort(values, (size_t) n, sizeof(double), hb_compare_double);
+      hb_actuator_discrete(a, values, n);
+      return a;
+    }
+    free(values);
+  }
+  if (hb_actuator_read_path(dir, "cpuinfo_min_freq", buf, sizeof(buf)) ||
+      (a->info.min = atof(buf), hb_actuator_read_path(dir, "cpuinfo_max_freq", buf, sizeof(buf)))) {
+    hb_actuator_close(a);
+    return NULL;
+  }
+  a->info.max = atof(buf);
+  return a;
+}
+
+/*
+ * cgroup v2 cpu.max
+ */
+
+static int hb_cgroup_apply(hb_actuator_t* a, double value) {
+  char buf[64];
+  if (value >= a->info.max) {
+    snprintf(buf, sizeof(buf), "max %lld\n", (long long) a->period);
+  } else {
+    snprintf(buf, sizeof(buf), "%lld %lld\n",
+             (long long) (value * (double) a->period), (long long) a->period);
+  }
+  return hb_actuator_write(a->fd, buf);
+}
+
+static double hb_cgroup_read(hb_actuator_t* a) {
+  char buf[64];
+  long long period;
+  if (hb_actuator_read(a->fd, buf, sizeof(buf))) {
+    return -1;
+  }
+  if (strncmp(buf, "max", 3) == 0) {
+    return a->info.max;
+  }
+  period = strtoll(strchr(buf, ' ') != NULL ? strchr(buf, ' ') : "0", NULL, 10);
+  return period > 0 ? atof(buf) / (double) period : -1;
+}
+
+hb_actuator_t* hb_actuator_cgroup_cpu(const char* dir) {
+  hb_actuator_t* a;
+  char buf[64];
+  char* space;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  a = hb_actuator_new("cgroup", "CPUs");
+  if (a == NULL) {
+    return NULL;
+  }
+  a->apply = hb_cgroup_apply;
+  a->read = hb_cgroup_read;
+  a->fd = hb_actuator_open_path(dir, "cpu.max", O_RDWR);
+  if (a->fd < 0 || hb_actuator_read(a->fd, buf, sizeof(buf)) ||
+      (space = strchr(buf, ' ')) == NULL || (a->period = atoll(space + 1)) <= 0) {
+    hb_actuator_close(a);
+    return NULL;
+  }
+  a->info.min = (double) HB_ACTUATOR_CGROUP_MIN_QUOTA / (double) a->period;
+  a->info.max = (double) (ncpus > 0 ? ncpus : 1);
+  // the quota is enforced per period (us)
+  a->info.latency_ns = a->period * 1000;
+  return a;
+}
+
+/*
+ * powercap
+ */
+
+static int hb_powercap_apply(hb_actuator_t* a, double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld\n", (long long) (value * 1000000.0));
+  return hb_actuator_write(a->fd, buf);
+}
+
+static double hb_powercap_read(hb_actuator_t* a) {
+  char buf[32];
+  return hb_actuator_read(a->fd, buf, sizeof(buf)) ? -1 : atof(buf) / 1000000.0;
+}
+
+hb_actuator_t* hb_actuator_powercap(const char* dir) {
+  hb_actuator_t* a;
+  char buf[32];
+
+  a = hb_actuator_new("powercap", "W");
+  if (a == NULL) {
+    return NULL;
+  }
+  a->apply = hb_powercap_apply;
+  a->read = hb_powercap_read;
+  a->fd = hb_actuator_open_path(dir, "constraint_0_power_limit_uw", O_RDWR);
+  if (a->fd < 0) {
+    hb_actuator_close(a);
+    return NULL;
+  }
+  a->info.min = 1;
+  // zones that do not report a maximum keep the limit they have as one
+  if (hb_actuator_read_path(dir, "constraint_0_max_power_uw", buf, sizeof(buf)) == 0 &&
+      atof(buf) > 0) {
+    a->info.max = atof(buf) / 1000000.0;
+  } else {
+    a->info.max = hb_powercap_read(a);
+  }
+  if (a->info.max < a->info.min) {
+    hb_actuator_close(a);
+    return NULL;
+  }
+  // the limit applies to the average over the time window
+  if (hb_actuator_read_path(dir, "constraint_0_time_window_us", buf, sizeof(buf)) == 0) {
+    a->info.latency_ns = atoll(buf) * 1000;
+  }
+  return a;
+}
+
+/*
+ * Simulated core frequency
+ */
+
+static int hb_simfreq_apply(hb_actuator_t* a, double value) {
+  SimSetFreqMHz(a->id, (unsigned long) value);
+  return 0;
+}
+
+static double hb_simfreq_read(hb_actuator_t* a) {
+  return (double) SimGetFreqMHz(a->id);
+}
+
+hb_actuator_t* hb_actuator_simfreq(int proc) {
+  hb_actuator_t* a;
+
+  if (!SimInSimulator()) {
+    return NULL;
+  }
+  a = hb_actuator_new("simfreq", "MHz");
+  if (a == NULL) {
+    return NULL;
+  }
+  a->id = proc;
+  a->apply = hb_simfreq_apply;
+  a->read = hb_simfreq_read;
+  a->info.min = HB_ACTUATOR_SIM_MIN_MHZ;
+  a->info.max = HB_ACTUATOR_SIM_MAX_MHZ;
+  return a;
+}
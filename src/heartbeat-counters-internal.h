@@ -0,0 +1,45 @@
+/**
+ * Hardware performance counters sampled at each heartbeat.
+ *
+ * A perf_event group (cycles, instructions, last-level cache misses and
+ * reference cycles) counts the thread that opened it. Samples are read in
+ * user space with rdpmc where the kernel allows it, and with one read() of
+ * the group otherwise.
+ */
+#ifndef _HEARTBEAT_COUNTERS_INTERNAL_H_
+#define _HEARTBEAT_COUNTERS_INTERNAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct _HB_counters;
+
+/**
+ * Opens and starts the counters for the calling thread.
+ *
+ * @return the counters, or NULL if cycles and instructions cannot be counted
+ */
+struct _HB_counters* HB_counters_open(void);
+
+void HB_counters_close(struct _HB_counters* c);
+
+/**
+ * Computes the counters over the interval since the previous sample: IPC,
+ * LLC misses per unit of work (n) and effective MHz while running. All are 0
+ * on the first sample, when called from a thread other than the one that
+ * opened the counters, and for events the CPU does not provide.
+ */
+void HB_counters_sample(struct _HB_counters* c,
+                        int64_t n,
+                        double* ipc,
+                        double* misses,
+                        double* mhz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,240 @@
+/**
+ * Hardware performance counters sampled at each heartbeat.
+ *
+ * Each event of the group has its perf_event page mapped. When the kernel
+ * sets cap_user_rdpmc and the group is scheduled, the counts are read with
+ * rdpmc under the page's sequence lock, as described in
+ * linux/perf_event.h; otherwise the group is read with one read() call.
+ *
+ * @see heartbeat-counters-internal.h
+ */
+#define _GNU_SOURCE
+#include "heartbeat-counters-internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum {
+  HB_CTR_CYCLES,
+  HB_CTR_INSTRUCTIONS,
+  HB_CTR_MISSES,
+  HB_CTR_REF_CYCLES,
+  HB_CTR_COUNT
+};
+
+static const uint64_t hb_ctr_config[HB_CTR_COUNT] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_REF_CPU_CYCLES,
+};
+
+struct _HB_counters {
+  pthread_t owner;
+  /* -1 for events the CPU does not provide */
+  int fd[HB_CTR_COUNT];
+  /* position of each event in a group read, or -1 */
+  int pos[HB_CTR_COUNT];
+  int nopen;
+  struct perf_event_mmap_page* page[HB_CTR_COUNT];
+  size_t page_size;
+  /* reference (TSC) clock in MHz, 0 if unknown */
+  double ref_mhz;
+  int primed;
+  uint64_t last[HB_CTR_COUNT];
+  uint64_t last_running;
+};
+
+#define HB_COUNTERS_BARRIER() __asm__ volatile("" ::: "memory")
+
+static int hb_counters_open_event(uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = group_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+struct _HB_counters* HB_counters_open(void) {
+  struct _HB_counters* c;
+  struct perf_event_mmap_page* pc;
+  void* p;
+  int e;
+
+  c = (struct _HB_counters*) calloc(1, sizeof(struct _HB_counters));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->owner = pthread_self();
+  c->page_size = (size_t) sysconf(_SC_PAGESIZE);
+  for (e = 0; e < HB_CTR_COUNT; e++) {
+    c->fd[e] = -1;
+  }
+  for (e = 0; e < HB_CTR_COUNT; e++) {
+    c->fd[e] = hb_counters_open_event(hb_ctr_config[e], e == 0 ? -1 : c->fd[0]);
+    c->pos[e] = c->fd[e] < 0 ? -1 : c->nopen++;
+    if (c->fd[e] < 0 && e <= HB_CTR_INSTRUCTIONS) {
+      HB_counters_close(c);
+      return NULL;
+    }
+    if (c->fd[e] >= 0) {
+      p = mmap(NULL, c->page_size, PROT_READ, MAP_SHARED, c->fd[e], 0);
+      c->page[e] = p == MAP_FAILED ? NULL : (struct perf_event_mmap_page*) p;
+    }
+  }
+  pc = c->page[HB_CTR_CYCLES];
+  if (pc != NULL && pc->cap_user_time && pc->time_mult != 0) {
+    // time_mult / 2^time_shift is nanoseconds per reference cycle
+    c->ref_mhz = 1000.0 * (double) (1ULL << pc->time_shift) / (double) pc->time_mult;
+  }
+  ioctl(c->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  if (ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+    HB_counters_close(c);
+    return NULL;
+  }
+  return c;
+}
+
+void HB_counters_close(struct _HB_counters* c) {
+  int e;
+  if (c == NULL) {
+    return;
+  }
+  for (e = HB_CTR_COUNT - 1; e >= 0; e--) {
+    if (c->page[e] != NULL) {
+      munmap(c->page[e], c->page_size);
+    }
+    if (c->fd[e] >= 0) {
+      close(c->fd[e]);
+    }
+  }
+  free(c);
+}
+
+/**
+ * Reads one count, and the group's running time if running is not NULL,
+ * without a system call. Returns -1 if that is not possible right now.
+ */
+static int hb_counters_rdpmc(const volatile struct perf_event_mmap_page* pc,
+                             uint64_t* count,
+                             uint64_t* running) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t seq;
+  uint32_t idx;
+  uint64_t value;
+  uint64_t run;
+  uint64_t cyc;
+  uint64_t quot;
+  uint64_t rem;
+  uint16_t shift;
+  int64_t pmc;
+
+  if (pc == NULL) {
+    return -1;
+  }
+  do {
+    seq = pc->lock;
+    HB_COUNTERS_BARRIER();
+    idx = pc->index;
+    if (!pc->cap_user_rdpmc || idx == 0 || (running != NULL && !pc->cap_user_time)) {
+      return -1;
+    }
+    value = pc->offset;
+    pmc = (int64_t) __builtin_ia32_rdpmc((int) idx - 1);
+    pmc <<= 64 - pc->pmc_width;
+    pmc >>= 64 - pc->pmc_width;
+    value += (uint64_t) pmc;
+    if (running != NULL) {
+      // extend time_running from the last update to now
+      shift = pc->time_shift;
+      cyc = __builtin_ia32_rdtsc();
+      quot = cyc >> shift;
+      rem = cyc & (((uint64_t) 1 << shift) - 1);
+      run = pc->time_running + pc->time_offset + quot * pc->time_mult +
+            ((rem * pc->time_mult) >> shift);
+    }
+    HB_COUNTERS_BARRIER();
+  } while (pc->lock != seq);
+  *count = value;
+  if (running != NULL) {
+    *running = run;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+static int hb_counters_read(struct _HB_counters* c, uint64_t* values, uint64_t* running) {
+  uint64_t buf[3 + HB_CTR_COUNT];
+  int e;
+  int ok = 1;
+
+  for (e = 0; e < HB_CTR_COUNT && ok; e++) {
+    if (c->fd[e] >= 0) {
+      ok = hb_counters_rdpmc(c->page[e], &values[e], e == HB_CTR_CYCLES ? running : NULL) == 0;
+    }
+  }
+  if (ok) {
+    return 0;
+  }
+  // layout with PERF_FORMAT_GROUP: nr, time_enabled, time_running, values
+  if (read(c->fd[0], buf, sizeof(buf)) < (ssize_t) ((3 + c->nopen) * sizeof(uint64_t))) {
+    return -1;
+  }
+  *running = buf[2];
+  for (e = 0; e < HB_CTR_COUNT; e++) {
+    values[e] = c->pos[e] < 0 ? 0 : buf[3 + c->pos[e]];
+  }
+  return 0;
+}
+
+void HB_counters_sample(struct _HB_counters* c,
+                        int64_t n,
+                        double* ipc,
+                        double* misses,
+                        double* mhz) {
+  uint64_t values[HB_CTR_COUNT] = {0};
+  uint64_t running = 0;
+  double cycles;
+  double ref;
+
+  *ipc = 0;
+  *misses = 0;
+  *mhz = 0;
+  if (c == NULL || !pthread_equal(c->owner, pthread_self()) ||
+      hb_counters_read(c, values, &running)) {
+    return;
+  }
+  if (c->primed) {
+    cycles = (double) (values[HB_CTR_CYCLES] - c->last[HB_CTR_CYCLES]);
+    ref = (double) (values[HB_CTR_REF_CYCLES] - c->last[HB_CTR_REF_CYCLES]);
+    if (cycles > 0) {
+      *ipc = (double) (values[HB_CTR_INSTRUCTIONS] - c->last[HB_CTR_INSTRUCTIONS]) / cycles;
+    }
+    if (c->fd[HB_CTR_MISSES] >= 0 && n > 0) {
+      *misses = (double) (values[HB_CTR_MISSES] - c->last[HB_CTR_MISSES]) / (double) n;
+    }
+    if (c->fd[HB_CTR_REF_CYCLES] >= 0 && ref > 0 && c->ref_mhz > 0) {
+      // reference cycles tick at a fixed rate only while the core is not halted
+      *mhz = cycles / ref * c->ref_mhz;
+    } else if (running > c->last_running) {
+      *mhz = cycles / (double) (running - c->last_running) * 1000.0;
+    }
+  }
+  memcpy(c->last, values, sizeof(values));
+  c->last_running = running;
+  c->primed = 1;
+}
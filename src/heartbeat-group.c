@@ -0,0 +1,441 @@
+/**
+ * Heartbeats shared by a group of processes.
+ *
+ * @see heartbeat-group.h
+ */
+#include "heartbeat-group.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define HB_GROUP_MAGIC 0x68622d6772703031ULL
+/* keys of groups stay clear of the pid-derived keys of heartbeats */
+#define HB_GROUP_KEY_BASE 0x40000000
+#define HB_GROUP_KEY_MASK 0x3fffffff
+/* attempts to join a group that is being created or removed */
+#define HB_GROUP_JOIN_RETRIES 1000
+/* attempts to read totals while slots are being freed */
+#define HB_GROUP_READ_RETRIES 16
+
+static inline int64_t hb_group_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+static key_t hb_group_key(const char* name) {
+  uint32_t h = 2166136261U;
+  // FNV-1a
+  for (; *name != '\0'; name++) {
+    h = (h ^ (uint8_t) *name) * 16777619U;
+  }
+  return (key_t) (HB_GROUP_KEY_BASE | (h & HB_GROUP_KEY_MASK));
+}
+
+static void hb_group_filename(hb_group_t* g, const char* name) {
+  const char* enabled_dir = getenv("HEARTBEAT_ENABLED_DIR");
+  g->filename[0] = '\0';
+  if (enabled_dir != NULL) {
+    snprintf(g->filename, sizeof(g->filename), "%s/group-%s", enabled_dir, name);
+  }
+}
+
+static int hb_group_map(hb_group_t* g, int shmid, int flags) {
+  g->header = (hb_group_header_t*) shmat(shmid, NULL, flags);
+  if (g->header == (hb_group_header_t*) -1) {
+    g->header = NULL;
+    return -1;
+  }
+  g->shmid = shmid;
+  g->members = (hb_group_member_t*) (g->header + 1);
+  return 0;
+}
+
+/**
+ * Waits for the creator to finish setting up the header, then checks that
+ * the segment is the group called name.
+ */
+static int hb_group_check(hb_group_t* g, const char* name) {
+  int i;
+  for (i = 0; __atomic_load_n(&g->header->magic, __ATOMIC_ACQUIRE) != HB_GROUP_MAGIC; i++) {
+    if (i == HB_GROUP_JOIN_RETRIES) {
+      return -1;
+    }
+    sched_yield();
+  }
+  if (strncmp(g->header->name, name, HB_GROUP_NAME_LEN)) {
+    fprintf(stderr, "hb_group: key of group %s is taken by group %s\n", name, g->header->name);
+    return -1;
+  }
+  g->entries = (hb_group_entry_t*) (g->members + g->header->capacity);
+  g->scratch = (hb_group_entry_t*) malloc((size_t) g->header->capacity *
+                                          g->header->window * sizeof(hb_group_entry_t));
+  return g->scratch == NULL ? -1 : 0;
+}
+
+static void hb_group_unmap(hb_group_t* g) {
+  if (g->header != NULL) {
+    shmdt(g->header);
+  }
+  free(g->scratch);
+  g->header = NULL;
+  g->scratch = NULL;
+}
+
+/**
+ * Moves the totals of member m into the group's retired totals. Readers
+ * retry while a move is under way.
+ */
+static void hb_group_retire(hb_group_header_t* h, hb_group_member_t* m) {
+  __atomic_fetch_add(&h->frees_started, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&h->retired_beats, __atomic_load_n(&m->beats, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->retired_work, __atomic_load_n(&m->total_work, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  __atomic_store_n(&m->beats, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->total_work, 0, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->frees_finished, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * 1 if slot m belonged to a process that died without leaving and is now
+ * reserved (pid -1) for the caller, with the totals and join of that process
+ * released.
+ */
+static int hb_group_reap(hb_group_header_t* h, hb_group_member_t* m) {
+  int32_t pid = __atomic_load_n(&m->pid, __ATOMIC_ACQUIRE);
+  if (pid <= 0 || !kill(pid, 0) || errno != ESRCH ||
+      !__atomic_compare_exchange_n(&m->pid, &pid, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  hb_group_retire(h, m);
+  // the caller's own join keeps this from reaching 0
+  __atomic_fetch_sub(&h->joined, 1, __ATOMIC_ACQ_REL);
+  return 1;
+}
+
+/**
+ * Claims a free slot, or the slot of a process that died without leaving.
+ */
+static hb_group_member_t* hb_group_claim(hb_group_t* g) {
+  hb_group_header_t* h = g->header;
+  hb_group_member_t* m;
+  hb_group_entry_t* ring;
+  int32_t pid;
+  uint32_t i;
+  uint32_t j;
+
+  for (i = 0; i < h->capacity; i++) {
+    m = &g->members[i];
+    pid = __atomic_load_n(&m->pid, __ATOMIC_ACQUIRE);
+    if (pid == 0 && __atomic_compare_exchange_n(&m->pid, &pid, -1, 0,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+    if (hb_group_reap(h, m)) {
+      break;
+    }
+  }
+  if (i == h->capacity) {
+    return NULL;
+  }
+
+  // beats of the previous owner would pass for new ones with the same index
+  ring = g->entries + (size_t) i * h->window;
+  __atomic_store_n(&m->head, 0, __ATOMIC_RELAXED);
+  for (j = 0; j < h->window; j++) {
+    __atomic_store_n(&ring[j].seq, 0, __ATOMIC_RELAXED);
+  }
+  m->last_timestamp = 0;
+  g->ring = ring;
+  __atomic_store_n(&m->pid, (int32_t) getpid(), __ATOMIC_RELEASE);
+  return m;
+}
+
+hb_group_t* hb_group_join(const char* name, uint32_t capacity, uint32_t window) {
+  hb_group_t* g;
+  key_t key;
+  size_t size;
+  uint64_t joined;
+  int shmid;
+  int created;
+  int tries;
+  FILE* f;
+
+  if (strlen(name) == 0 || strlen(name) >= HB_GROUP_NAME_LEN || strchr(name, '/') != NULL ||
+      capacity == 0 || window < 2) {
+    fprintf(stderr, "hb_group_join: invalid name, capacity or window\n");
+    return NULL;
+  }
+  g = (hb_group_t*) calloc(1, sizeof(hb_group_t));
+  if (g == NULL) {
+    perror("Failed to malloc heartbeat group");
+    return NULL;
+  }
+  hb_group_filename(g, name);
+  key = hb_group_key(name);
+  size = sizeof(hb_group_header_t) + (size_t) capacity * sizeof(hb_group_member_t) +
+         (size_t) capacity * window * sizeof(hb_group_entry_t);
+
+  for (tries = 0; ; tries++) {
+    if (tries == HB_GROUP_JOIN_RETRIES) {
+      fprintf(stderr, "hb_group_join: group %s is not usable\n", name);
+      free(g);
+      return NULL;
+    }
+    created = 0;
+    shmid = shmget(key, size, IPC_CREAT | IPC_EXCL | 0666);
+    if (shmid >= 0) {
+      created = 1;
+    } else if (errno != EEXIST || (shmid = shmget(key, 0, 0666)) < 0) {
+      // removed in between, try again
+      if (errno == ENOENT) {
+        continue;
+      }
+      perror("cannot get shared memory for heartbeat group");
+      free(g);
+      return NULL;
+    }
+    if (hb_group_map(g, shmid, 0)) {
+      if (errno == EINVAL || errno == EIDRM) {
+        continue;
+      }
+      perror("cannot attach shared memory to heartbeat group");
+      free(g);
+      return NULL;
+    }
+    if (created) {
+      // fresh segments are zeroed, so only the header needs setting up
+      snprintf(g->header->name, HB_GROUP_NAME_LEN, "%s", name);
+      g->header->capacity = capacity;
+      g->header->window = window;
+      __atomic_store_n(&g->header->magic, HB_GROUP_MAGIC, __ATOMIC_RELEASE);
+      if (g->filename[0] != '\0' && (f = fopen(g->filename, "w")) != NULL) {
+        fprintf(f, "%d\n", shmid);
+        fclose(f);
+      }
+    }
+    if (hb_group_check(g, name)) {
+      hb_group_unmap(g);
+      free(g);
+      return NULL;
+    }
+
+    // a group whose last member has left is about to go away
+    joined = __atomic_load_n(&g->header->joined, __ATOMIC_ACQUIRE);
+    while (!(joined & HB_GROUP_CLOSED) &&
+           !__atomic_compare_exchange_n(&g->header->joined, &joined, joined + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (!(joined & HB_GROUP_CLOSED)) {
+      break;
+    }
+    hb_group_unmap(g);
+    sched_yield();
+  }
+
+  g->member = hb_group_claim(g);
+  if (g->member == NULL) {
+    fprintf(stderr, "hb_group_join: group %s is full\n", name);
+    hb_group_leave(g);
+    return NULL;
+  }
+  return g;
+}
+
+void hb_group_leave(hb_group_t* g) {
+  hb_group_header_t* h;
+  uint64_t joined;
+  uint64_t next;
+  uint32_t i;
+
+  if (g == NULL) {
+    return;
+  }
+  h = g->header;
+  // members that died would otherwise keep the group from going away
+  for (i = 0; i < h->capacity; i++) {
+    if (&g->members[i] != g->member && hb_group_reap(h, &g->members[i])) {
+      __atomic_store_n(&g->members[i].pid, 0, __ATOMIC_RELEASE);
+    }
+  }
+  if (g->member != NULL) {
+    // the ring stays until the slot is claimed again, so recent beats
+    // still count towards the window
+    hb_group_retire(h, g->member);
+    __atomic_store_n(&g->member->pid, 0, __ATOMIC_RELEASE);
+  }
+  joined = __atomic_load_n(&h->joined, __ATOMIC_ACQUIRE);
+  do {
+    next = joined == 1 ? HB_GROUP_CLOSED : joined - 1;
+  } while (!__atomic_compare_exchange_n(&h->joined, &joined, next, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (next == HB_GROUP_CLOSED) {
+    if (g->filename[0] != '\0') {
+      remove(g->filename);
+    }
+    shmctl(g->shmid, IPC_RMID, NULL);
+  }
+  hb_group_unmap(g);
+  free(g);
+}
+
+int64_t hb_group_beat_n(hb_group_t* g, int tag, int64_t n) {
+  hb_group_header_t* h = g->header;
+  hb_group_member_t* m = g->member;
+  int64_t time = hb_group_now();
+  uint64_t index = __atomic_fetch_add(&m->head, 1, __ATOMIC_RELAXED);
+  hb_group_entry_t* e = &g->ring[index % h->window];
+  int64_t first = 0;
+
+  __atomic_store_n(&e->seq, 2 * index + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->timestamp = time;
+  e->work = n;
+  e->tag = tag;
+  e->pid = m->pid;
+  __atomic_store_n(&e->seq, 2 * index + 2, __ATOMIC_RELEASE);
+
+  __atomic_fetch_add(&m->total_work, n, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&m->beats, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->last_timestamp, time, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&h->first_timestamp, __ATOMIC_RELAXED) == 0) {
+    __atomic_compare_exchange_n(&h->first_timestamp, &first, time, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  return time;
+}
+
+hb_group_t* hb_group_attach(const char* name) {
+  hb_group_t* g;
+  int shmid;
+
+  if (strlen(name) >= HB_GROUP_NAME_LEN || (shmid = shmget(hb_group_key(name), 0, 0)) < 0) {
+    return NULL;
+  }
+  g = (hb_group_t*) calloc(1, sizeof(hb_group_t));
+  if (g == NULL) {
+    perror("Failed to malloc heartbeat group");
+    return NULL;
+  }
+  if (hb_group_map(g, shmid, SHM_RDONLY) || hb_group_check(g, name)) {
+    hb_group_unmap(g);
+    free(g);
+    return NULL;
+  }
+  return g;
+}
+
+void hb_group_detach(hb_group_t* g) {
+  if (g != NULL) {
+    hb_group_unmap(g);
+    free(g);
+  }
+}
+
+static int hb_group_compare_time(const void* x, const void* y) {
+  int64_t a = ((const hb_group_entry_t*) x)->timestamp;
+  int64_t b = ((const hb_group_entry_t*) y)->timestamp;
+  return (a < b) - (a > b);
+}
+
+/**
+ * Copies the written beats in the ring of m into out, returning how many.
+ */
+static uint32_t hb_group_gather(const hb_group_header_t* h, hb_group_member_t* m,
+                                hb_group_entry_t* ring, hb_group_entry_t* out) {
+  uint64_t head = __atomic_load_n(&m->head, __ATOMIC_ACQUIRE);
+  uint64_t index;
+  uint64_t seq;
+  hb_group_entry_t* e;
+  uint32_t n = 0;
+  uint32_t j;
+
+  for (j = 0; j < h->window && j < head; j++) {
+    index = head - 1 - j;
+    e = &ring[index % h->window];
+    seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq != 2 * index + 2) {
+      continue;
+    }
+    memcpy(&out[n], e, sizeof(hb_group_entry_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+      n++;
+    }
+  }
+  return n;
+}
+
+int hb_group_read(hb_group_t* g, hb_group_stats_t* out) {
+  hb_group_header_t* h = g->header;
+  hb_group_member_t* m;
+  hb_group_entry_t* beats = g->scratch;
+  uint64_t started;
+  uint64_t window;
+  uint64_t n;
+  uint32_t i;
+  int64_t work;
+  int64_t span;
+  int attempt;
+  int consistent = 0;
+
+  for (attempt = 0; attempt < HB_GROUP_READ_RETRIES && !consistent; attempt++) {
+    started = __atomic_load_n(&h->frees_started, __ATOMIC_SEQ_CST);
+    if (started != __atomic_load_n(&h->frees_finished, __ATOMIC_SEQ_CST)) {
+      sched_yield();
+      continue;
+    }
+    memset(out, 0, sizeof(hb_group_stats_t));
+    out->beats = __atomic_load_n(&h->retired_beats, __ATOMIC_RELAXED);
+    out->total_work = __atomic_load_n(&h->retired_work, __ATOMIC_RELAXED);
+    for (i = 0; i < h->capacity; i++) {
+      m = &g->members[i];
+      if (__atomic_load_n(&m->pid, __ATOMIC_ACQUIRE) > 0) {
+        out->members++;
+      }
+      out->beats += __atomic_load_n(&m->beats, __ATOMIC_RELAXED);
+      out->total_work += __atomic_load_n(&m->total_work, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    consistent = __atomic_load_n(&h->frees_started, __ATOMIC_SEQ_CST) == started;
+  }
+
+  // the group's window is its last window beats, whichever member made them
+  n = 0;
+  for (i = 0; i < h->capacity; i++) {
+    n += hb_group_gather(h, &g->members[i], g->entries + (size_t) i * h->window, beats + n);
+  }
+  qsort(beats, n, sizeof(hb_group_entry_t), hb_group_compare_time);
+  window = n < h->window ? n : h->window;
+
+  out->first_timestamp = __atomic_load_n(&h->first_timestamp, __ATOMIC_RELAXED);
+  if (n > 0) {
+    out->last_timestamp = beats[0].timestamp;
+    out->tag = beats[0].tag;
+    if (out->last_timestamp > out->first_timestamp) {
+      out->global_rate = (double) out->total_work /
+                         (double) (out->last_timestamp - out->first_timestamp) * 1000000000.0;
+    }
+  }
+  if (window >= 2) {
+    for (i = 0, work = 0; i + 1 < window; i++) {
+      work += beats[i].work;
+    }
+    span = beats[0].timestamp - beats[window - 1].timestamp;
+    if (span > 0) {
+      out->window_rate = (double) work / (double) span * 1000000000.0;
+    }
+    span = beats[0].timestamp - beats[1].timestamp;
+    if (span > 0) {
+      out->instant_rate = (double) beats[0].work / (double) span * 1000000000.0;
+    }
+  }
+  return consistent ? 0 : -1;
+}
@@ -0,0 +1,278 @@
+/**
+ * Slab arena of lightweight heartbeats.
+ *
+ * @see heartbeat-lite.h
+ */
+#include "heartbeat-lite.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define HB_LITE_MAGIC 0x68622d6c69746531ULL
+#define HB_LITE_NIL   0xffffffffU
+/* Attempts hb_lite_next() makes to copy a slot that is not being written */
+#define HB_LITE_RETRIES 16
+
+static inline int64_t hb_lite_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+/* seqlock writer side; a single thread writes each slot */
+static inline void hb_lite_write_begin(hb_lite_t* hb) {
+  __atomic_store_n(&hb->seq, hb->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void hb_lite_write_end(hb_lite_t* hb) {
+  __atomic_store_n(&hb->seq, hb->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int hb_lite_filename(char* buf, size_t len, int pid) {
+  const char* enabled_dir = getenv("HEARTBEAT_ENABLED_DIR");
+  if (enabled_dir == NULL) {
+    return -1;
+  }
+  snprintf(buf, len, "%s/lite-%d", enabled_dir, pid);
+  return 0;
+}
+
+hb_lite_arena_t* hb_lite_arena_init(uint32_t capacity) {
+  hb_lite_arena_t* arena;
+  FILE* f;
+  size_t size = sizeof(hb_lite_header_t) + (size_t) capacity * sizeof(hb_lite_t);
+
+  if (capacity == 0 || capacity == HB_LITE_NIL) {
+    fprintf(stderr, "hb_lite_arena_init: invalid capacity\n");
+    return NULL;
+  }
+  arena = (hb_lite_arena_t*) malloc(sizeof(hb_lite_arena_t));
+  if (arena == NULL) {
+    perror("Failed to malloc heartbeat lite arena");
+    return NULL;
+  }
+  arena->owner = 1;
+  if (hb_lite_filename(arena->filename, sizeof(arena->filename), getpid())) {
+    free(arena);
+    return NULL;
+  }
+
+  arena->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0666);
+  if (arena->shmid < 0) {
+    perror("cannot allocate shared memory for heartbeat lite arena");
+    free(arena);
+    return NULL;
+  }
+  arena->header = (hb_lite_header_t*) shmat(arena->shmid, NULL, 0);
+  if (arena->header == (hb_lite_header_t*) -1) {
+    perror("cannot attach shared memory to heartbeat lite arena");
+    shmctl(arena->shmid, IPC_RMID, NULL);
+    free(arena);
+    return NULL;
+  }
+  // fresh segments are zeroed, so only the header needs setting up
+  arena->slots = (hb_lite_t*) (arena->header + 1);
+  arena->header->pid = getpid();
+  arena->header->capacity = capacity;
+  arena->header->free_head = HB_LITE_NIL;
+  arena->header->high_water = 0;
+  arena->header->live = 0;
+  __atomic_store_n(&arena->header->magic, HB_LITE_MAGIC, __ATOMIC_RELEASE);
+
+  f = fopen(arena->filename, "w");
+  if (f == NULL) {
+    perror("Failed to register heartbeat lite arena");
+    hb_lite_arena_finish(arena);
+    return NULL;
+  }
+  fprintf(f, "%d\n", arena->shmid);
+  fclose(f);
+  return arena;
+}
+
+void hb_lite_arena_finish(hb_lite_arena_t* arena) {
+  if (arena != NULL) {
+    remove(arena->filename);
+    shmdt(arena->header);
+    shmctl(arena->shmid, IPC_RMID, NULL);
+    free(arena);
+  }
+}
+
+hb_lite_t* hb_lite_create(hb_lite_arena_t* arena, uint64_t id) {
+  hb_lite_header_t* header = arena->header;
+  uint64_t head = __atomic_load_n(&header->free_head, __ATOMIC_ACQUIRE);
+  uint64_t next;
+  uint32_t index;
+  hb_lite_t* hb;
+
+  // reuse a destroyed slot; the tag in the upper bits defeats ABA
+  while ((uint32_t) head != HB_LITE_NIL) {
+    index = (uint32_t) head;
+    next = ((head >> 32) + 1) << 32 |
+           __atomic_load_n(&arena->slots[index].next_free, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&header->free_head, &head, next, 1,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+  if ((uint32_t) head == HB_LITE_NIL) {
+    // otherwise carve a never-used slot
+    index = __atomic_fetch_add(&header->high_water, 1, __ATOMIC_RELAXED);
+    if (index >= header->capacity) {
+      __atomic_fetch_sub(&header->high_water, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  }
+
+  hb = &arena->slots[index];
+  hb_lite_write_begin(hb);
+  hb->id = id;
+  hb->tag = 0;
+  hb->counter = 0;
+  hb->total_work = 0;
+  hb->first_timestamp = -1;
+  hb->last_timestamp = -1;
+  hb->global_rate = 0;
+  hb->window_rate = 0;
+  hb->instant_rate = 0;
+  hb->live = 1;
+  hb_lite_write_end(hb);
+  __atomic_fetch_add(&header->live, 1, __ATOMIC_RELAXED);
+  return hb;
+}
+
+void hb_lite_destroy(hb_lite_arena_t* arena, hb_lite_t* hb) {
+  hb_lite_header_t* header = arena->header;
+  uint32_t index = (uint32_t) (hb - arena->slots);
+  uint64_t head = __atomic_load_n(&header->free_head, __ATOMIC_RELAXED);
+  uint64_t next;
+
+  hb_lite_write_begin(hb);
+  hb->live = 0;
+  hb_lite_write_end(hb);
+  __atomic_fetch_sub(&header->live, 1, __ATOMIC_RELAXED);
+
+  do {
+    __atomic_store_n(&hb->next_free, (uint32_t) head, __ATOMIC_RELAXED);
+    next = ((head >> 32) + 1) << 32 | index;
+  } while (!__atomic_compare_exchange_n(&header->free_head, &head, next, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+int64_t hb_lite_beat_n(hb_lite_t* hb, int tag, int64_t n) {
+  int64_t time = hb_lite_now();
+  int64_t slot = hb->counter % HB_LITE_WINDOW;
+  int64_t oldest;
+
+  hb_lite_write_begin(hb);
+  hb->tag = tag;
+  hb->total_work += n;
+  if (hb->first_timestamp == -1) {
+    hb->first_timestamp = time;
+  } else if (time > hb->last_timestamp) {
+    // the window spans from the oldest remembered beat to this one
+    oldest = hb->counter < HB_LITE_WINDOW ? 0 : slot;
+    hb->instant_rate = (double) n / (double) (time - hb->last_timestamp) * 1000000000.0;
+    hb->global_rate = (double) hb->total_work /
+                      (double) (time - hb->first_timestamp) * 1000000000.0;
+    hb->window_rate = (double) (hb->total_work - hb->window_work[oldest]) /
+                      (double) (time - hb->window_timestamp[oldest]) * 1000000000.0;
+  }
+  hb->window_timestamp[slot] = time;
+  hb->window_work[slot] = hb->total_work;
+  hb->last_timestamp = time;
+  hb->counter++;
+  hb_lite_write_end(hb);
+  return time;
+}
+
+hb_lite_arena_t* hb_lite_attach(int pid) {
+  hb_lite_arena_t* arena;
+  FILE* f;
+  int ok;
+
+  arena = (hb_lite_arena_t*) malloc(sizeof(hb_lite_arena_t));
+  if (arena == NULL) {
+    perror("Failed to malloc heartbeat lite arena");
+    return NULL;
+  }
+  arena->owner = 0;
+  if (hb_lite_filename(arena->filename, sizeof(arena->filename), pid)) {
+    free(arena);
+    return NULL;
+  }
+  f = fopen(arena->filename, "r");
+  if (f == NULL) {
+    free(arena);
+    return NULL;
+  }
+  ok = fscanf(f, "%d", &arena->shmid) == 1;
+  fclose(f);
+  if (!ok) {
+    free(arena);
+    return NULL;
+  }
+  arena->header = (hb_lite_header_t*) shmat(arena->shmid, NULL, SHM_RDONLY);
+  if (arena->header == (hb_lite_header_t*) -1 ||
+      __atomic_load_n(&arena->header->magic, __ATOMIC_ACQUIRE) != HB_LITE_MAGIC ||
+      arena->header->pid != pid) {
+    if (arena->header != (hb_lite_header_t*) -1) {
+      shmdt(arena->header);
+    }
+    free(arena);
+    return NULL;
+  }
+  arena->slots = (hb_lite_t*) (arena->header + 1);
+  return arena;
+}
+
+void hb_lite_detach(hb_lite_arena_t* arena) {
+  if (arena != NULL) {
+    shmdt(arena->header);
+    free(arena);
+  }
+}
+
+uint32_t hb_lite_count(hb_lite_arena_t* arena) {
+  return __atomic_load_n(&arena->header->live, __ATOMIC_RELAXED);
+}
+
+int hb_lite_next(hb_lite_arena_t* arena, uint32_t* cursor, hb_lite_t* out) {
+  uint32_t end = __atomic_load_n(&arena->header->high_water, __ATOMIC_ACQUIRE);
+  uint32_t seq;
+  hb_lite_t* hb;
+  int tries;
+
+  if (end > arena->header->capacity) {
+    end = arena->header->capacity;
+  }
+  for (; *cursor < end; (*cursor)++) {
+    hb = &arena->slots[*cursor];
+    for (tries = 0; tries < HB_LITE_RETRIES; tries++) {
+      seq = __atomic_load_n(&hb->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1) {
+        // let a preempted writer finish its update
+        sched_yield();
+        continue;
+      }
+      memcpy(out, hb, sizeof(hb_lite_t));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&hb->seq, __ATOMIC_RELAXED) == seq) {
+        break;
+      }
+    }
+    // a slot that stays mid-update (its writer stopped or died) is skipped
+    if (tries < HB_LITE_RETRIES && out->live) {
+      (*cursor)++;
+      return 0;
+    }
+  }
+  return -1;
+}
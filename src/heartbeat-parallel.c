@@ -0,0 +1,90 @@
+/**
+ * Per-thread iteration counters that publish aggregated heartbeats.
+ *
+ * @see heartbeat-parallel.h
+ */
+#include "heartbeat-parallel.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline int64_t hb_parallel_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+hb_parallel_t* hb_parallel_init(heartbeat_t* hb,
+                                int nthreads,
+                                int64_t chunk,
+                                int64_t quantum_ns) {
+  int i;
+  int64_t now;
+  hb_parallel_t* hbp;
+
+  if (hb == NULL || nthreads <= 0 || chunk <= 0 || quantum_ns < 0) {
+    fprintf(stderr, "hb_parallel_init: invalid arguments\n");
+    return NULL;
+  }
+
+  hbp = (hb_parallel_t*) malloc(sizeof(hb_parallel_t));
+  if (hbp == NULL) {
+    perror("Failed to malloc hb_parallel");
+    return NULL;
+  }
+  if (posix_memalign((void**) &hbp->slots, HB_PARALLEL_CACHE_LINE,
+                     (size_t) nthreads * sizeof(hb_parallel_slot_t))) {
+    perror("Failed to allocate hb_parallel slots");
+    free(hbp);
+    return NULL;
+  }
+
+  hbp->hb = hb;
+  hbp->nthreads = nthreads;
+  hbp->chunk = chunk;
+  hbp->quantum_ns = quantum_ns;
+  now = hb_parallel_now();
+  for (i = 0; i < nthreads; i++) {
+    hbp->slots[i].count = 0;
+    hbp->slots[i].next_check = chunk;
+    hbp->slots[i].last_publish = now;
+  }
+  return hbp;
+}
+
+void hb_parallel_flush(hb_parallel_t* hbp, int tid) {
+  hb_parallel_slot_t* slot = &hbp->slots[tid];
+  if (slot->count > 0) {
+    heartbeat_n(hbp->hb, tid, slot->count);
+  }
+  slot->count = 0;
+  slot->next_check = hbp->chunk;
+  if (hbp->quantum_ns > 0) {
+    slot->last_publish = hb_parallel_now();
+  }
+}
+
+void hb_parallel_tick(hb_parallel_t* hbp, int tid) {
+  hb_parallel_slot_t* slot = &hbp->slots[tid];
+  if (hbp->quantum_ns > 0 &&
+      hb_parallel_now() - slot->last_publish < hbp->quantum_ns) {
+    // not due yet, look at the clock again after another chunk
+    slot->next_check = slot->count + hbp->chunk;
+    return;
+  }
+  hb_parallel_flush(hbp, tid);
+}
+
+void hb_parallel_flush_all(hb_parallel_t* hbp) {
+  int i;
+  for (i = 0; i < hbp->nthreads; i++) {
+    hb_parallel_flush(hbp, i);
+  }
+}
+
+void hb_parallel_finish(hb_parallel_t* hbp) {
+  if (hbp != NULL) {
+    free(hbp->slots);
+    free(hbp);
+  }
+}
@@ -0,0 +1,236 @@
+/**
+ * Reading, writing and querying Pareto tables.
+ *
+ * @see heartbeat-pareto.h
+ */
+#include "heartbeat-pareto.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HB_PARETO_LINE_LEN 4096
+/* columns before the knob settings */
+#define HB_PARETO_METRICS 4
+
+static const char* hb_pareto_metrics[HB_PARETO_METRICS] = { "rate", "power", "cpus", "accuracy" };
+
+static int hb_pareto_has_power(const hb_pareto_t* table) {
+  int64_t i;
+  for (i = 0; i < table->npoints; i++) {
+    if (table->points[i].power > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static double hb_pareto_cost(const hb_pareto_point_t* p, int power) {
+  return power ? p->power : p->cpus;
+}
+
+static int hb_pareto_compare_rate(const void* x, const void* y) {
+  double a = ((const hb_pareto_point_t*) x)->rate;
+  double b = ((const hb_pareto_point_t*) y)->rate;
+  return (a > b) - (a < b);
+}
+
+/* Next whitespace-separated field of *line, NULL at the end */
+static char* hb_pareto_field(char** line) {
+  char* start = *line + strspn(*line, " \t\r\n");
+  char* end;
+  if (*start == '\0') {
+    return NULL;
+  }
+  end = start + strcspn(start, " \t\r\n");
+  *line = *end == '\0' ? end : end + 1;
+  *end = '\0';
+  return start;
+}
+
+int hb_pareto_load(hb_pareto_t* table, const char* path) {
+  FILE* f = fopen(path, "r");
+  char line[HB_PARETO_LINE_LEN];
+  char* cur;
+  char* field;
+  char* end;
+  hb_pareto_point_t* points;
+  int64_t capacity = 16;
+  int64_t column;
+  int64_t i;
+  int power;
+  int header = 0;
+
+  if (f == NULL) {
+    return -1;
+  }
+  memset(table, 0, sizeof(hb_pareto_t));
+  table->points = (hb_pareto_point_t*) malloc(capacity * sizeof(hb_pareto_point_t));
+  if (table->points == NULL) {
+    fclose(f);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    cur = line;
+    if (line[strspn(line, " \t")] == '#' || (field = hb_pareto_field(&cur)) == NULL) {
+      continue;
+    }
+    if (!header) {
+      // the metrics, then at most HB_PARETO_MAX_KNOBS knob names
+      for (column = 0; field != NULL; column++, field = hb_pareto_field(&cur)) {
+        if (column < HB_PARETO_METRICS) {
+          if (strcmp(field, hb_pareto_metrics[column])) {
+            goto fail;
+          }
+        } else if (column - HB_PARETO_METRICS < HB_PARETO_MAX_KNOBS) {
+          snprintf(table->knobs[table->nknobs++], HB_PARETO_NAME_LEN, "%s", field);
+        } else {
+          goto fail;
+        }
+      }
+      if (column < HB_PARETO_METRICS) {
+        goto fail;
+      }
+      header = 1;
+      continue;
+    }
+
+    if (table->npoints == capacity) {
+      capacity *= 2;
+      points = (hb_pareto_point_t*) realloc(table->points, capacity * sizeof(hb_pareto_point_t));
+      if (points == NULL) {
+        goto fail;
+      }
+      table->points = points;
+    }
+    points = &table->points[table->npoints];
+    memset(points, 0, sizeof(hb_pareto_point_t));
+    for (column = 0; field != NULL; column++, field = hb_pareto_field(&cur)) {
+      if (column >= HB_PARETO_METRICS + table->nknobs) {
+        goto fail;
+      }
+      double value = strtod(field, &end);
+      if (*end != '\0') {
+        goto fail;
+      }
+      switch (column) {
+        case 0: points->rate = value; break;
+        case 1: points->power = value; break;
+        case 2: points->cpus = value; break;
+        case 3: points->accuracy = value; break;
+        default: points->settings[column - HB_PARETO_METRICS] = value; break;
+      }
+    }
+    if (column != HB_PARETO_METRICS + table->nknobs) {
+      goto fail;
+    }
+    table->npoints++;
+  }
+  fclose(f);
+  f = NULL;
+  if (!header) {
+    goto fail;
+  }
+
+  // cheapest[i] makes a rate-only lookup a binary search
+  qsort(table->points, table->npoints, sizeof(hb_pareto_point_t), hb_pareto_compare_rate);
+  table->cheapest = (int64_t*) malloc((table->npoints + 1) * sizeof(int64_t));
+  if (table->cheapest == NULL) {
+    goto fail;
+  }
+  power = hb_pareto_has_power(table);
+  for (i = table->npoints - 1; i >= 0; i--) {
+    table->cheapest[i] = i;
+    if (i + 1 < table->npoints &&
+        hb_pareto_cost(&table->points[table->cheapest[i + 1]], power) <
+        hb_pareto_cost(&table->points[i], power)) {
+      table->cheapest[i] = table->cheapest[i + 1];
+    }
+  }
+  return 0;
+
+fail:
+  if (f != NULL) {
+    fclose(f);
+  }
+  hb_pareto_finish(table);
+  return -1;
+}
+
+int hb_pareto_save(const hb_pareto_t* table, const char* path) {
+  FILE* f = fopen(path, "w");
+  int64_t i;
+  int64_t k;
+
+  if (f == NULL) {
+    return -1;
+  }
+  fprintf(f, "# rate (heartbeats/s), power (W), cpus (busy CPUs), accuracy, then knob settings\n");
+  fprintf(f, "%s %s %s %s", hb_pareto_metrics[0], hb_pareto_metrics[1],
+          hb_pareto_metrics[2], hb_pareto_metrics[3]);
+  for (k = 0; k < table->nknobs; k++) {
+    fprintf(f, " %s", table->knobs[k]);
+  }
+  fprintf(f, "\n");
+  for (i = 0; i < table->npoints; i++) {
+    const hb_pareto_point_t* p = &table->points[i];
+    fprintf(f, "%.6g %.6g %.6g %.6g", p->rate, p->power, p->cpus, p->accuracy);
+    for (k = 0; k < table->nknobs; k++) {
+      fprintf(f, " %.10g", p->settings[k]);
+    }
+    fprintf(f, "\n");
+  }
+  return fclose(f) ? -1 : 0;
+}
+
+const hb_pareto_point_t* hb_pareto_lookup(const hb_pareto_t* table,
+                                          double min_rate,
+                                          double min_accuracy) {
+  const hb_pareto_point_t* best = NULL;
+  const hb_pareto_point_t* fastest = NULL;
+  int64_t lo = 0;
+  int64_t hi = table->npoints;
+  int64_t mid;
+  int64_t i;
+  int power;
+
+  if (table->npoints == 0) {
+    return NULL;
+  }
+  // first point with at least min_rate
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (table->points[mid].rate < min_rate) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (min_accuracy <= 0) {
+    return &table->points[lo < table->npoints ? table->cheapest[lo] : table->npoints - 1];
+  }
+
+  power = hb_pareto_has_power(table);
+  for (i = 0; i < table->npoints; i++) {
+    const hb_pareto_point_t* p = &table->points[i];
+    if (p->accuracy < min_accuracy) {
+      continue;
+    }
+    fastest = p;
+    if (i >= lo && (best == NULL || hb_pareto_cost(p, power) < hb_pareto_cost(best, power))) {
+      best = p;
+    }
+  }
+  if (best != NULL) {
+    return best;
+  }
+  return fastest != NULL ? fastest : &table->points[table->npoints - 1];
+}
+
+void hb_pareto_finish(hb_pareto_t* table) {
+  free(table->points);
+  free(table->cheapest);
+  table->points = NULL;
+  table->cheapest = NULL;
+  table->npoints = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _HEARTBEAT_REDUCE_INTERNAL_H_
+#define _HEARTBEAT_REDUCE_INTERNAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "heartbeat-reduce.h"
+
+/**
+ * Reduce the last n records of a heartbeat ring in place. The layout of the
+ * records is given by record_size and features (HB_FEATURE_* bits) so the
+ * same code serves every implementation and the monitor. filled is the
+ * number of records written since the log was (re)allocated.
+ *
+ * @return number of records reduced, or -1 if fields selects something the
+ * records do not have
+ */
+int64_t HB_reduce_ring(const void* log,
+                       int64_t record_size,
+                       int64_t features,
+                       int64_t buffer_depth,
+                       int64_t buffer_index,
+                       int64_t filled,
+                       int64_t n,
+                       uint32_t fields,
+                       hb_reduction_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * Statistics over heartbeat history computed directly on the shared ring.
+ *
+ * Records are an array of structs, so each field is read with a stride of
+ * record_size bytes. Kernels gather one field from several records per
+ * vector and keep running min/max/sum/sum of squares; the sums are taken
+ * relative to the first value to limit cancellation in the variance. The
+ * kernel is chosen once at run time from what the CPU supports.
+ */
+#include <math.h>
+#include <stddef.h>
+#include "heartbeat.h"
+#include "heartbeat-reduce-internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HB_REDUCE_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HB_REDUCE_NEON
+#endif
+
+/* Offset of the first field of hb_field_t in every record layout */
+#define HB_REDUCE_FIELD_BASE (3 * sizeof(int64_t))
+
+/* Counter fields follow whichever of the other fields the layout has */
+#define HB_REDUCE_FIELD_OFFSET(f, features) \
+  ((f) < HB_FIELD_IPC ? HB_REDUCE_FIELD_BASE + (size_t) (f) * sizeof(double) : \
+   (size_t) HB_RECORD_COUNTERS_OFFSET(features) + (size_t) ((f) - HB_FIELD_IPC) * sizeof(double))
+
+typedef struct {
+  double min;
+  double max;
+  double sum;
+  double sumsq;
+} hb_reduce_acc_t;
+
+typedef void (*hb_reduce_kernel_t)(const double* p,
+                                   int64_t stride,
+                                   int64_t n,
+                                   double shift,
+                                   hb_reduce_acc_t* acc);
+
+static void reduce_scalar(const double* p,
+                          int64_t stride,
+                          int64_t n,
+                          double shift,
+                          hb_reduce_acc_t* acc) {
+  int64_t i;
+  for (i = 0; i < n; i++, p += stride) {
+    double x = *p;
+    double d = x - shift;
+    acc->min = x < acc->min ? x : acc->min;
+    acc->max = x > acc->max ? x : acc->max;
+    acc->sum += d;
+    acc->sumsq += d * d;
+  }
+}
+
+#if defined(HB_REDUCE_X86)
+
+__attribute__((target("avx2,fma")))
+static void reduce_avx2(const double* p,
+                        int64_t stride,
+                        int64_t n,
+                        double shift,
+                        hb_reduce_acc_t* acc) {
+  const __m256i idx = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+  const __m256d vshift = _mm256_set1_pd(shift);
+  __m256d vmin = _mm256_set1_pd(acc->min);
+  __m256d vmax = _mm256_set1_pd(acc->max);
+  __m256d vsum = _mm256_setzero_pd();
+  __m256d vsumsq = _mm256_setzero_pd();
+  double lanes[4];
+  int64_t i;
+  int j;
+
+  for (i = 0; i + 4 <= n; i += 4, p += 4 * stride) {
+    __m256d x = _mm256_i64gather_pd(p, idx, sizeof(double));
+    __m256d d = _mm256_sub_pd(x, vshift);
+    vmin = _mm256_min_pd(vmin, x);
+    vmax = _mm256_max_pd(vmax, x);
+    vsum = _mm256_add_pd(vsum, d);
+    vsumsq = _mm256_fmadd_pd(d, d, vsumsq);
+  }
+
+  _mm256_storeu_pd(lanes, vmin);
+  for (j = 0; j < 4; j++) {
+    acc->min = lanes[j] < acc->min ? lanes[j] : acc->min;
+  }
+  _mm256_storeu_pd(lanes, vmax);
+  for (j = 0; j < 4; j++) {
+    acc->max = lanes[j] > acc->max ? lanes[j] : acc->max;
+  }
+  _mm256_storeu_pd(lanes, vsum);
+  acc->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd(lanes, vsumsq);
+  acc->sumsq += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+  reduce_scalar(p, stride, n - i, shift, acc);
+}
+
+__attribute__((target("avx512f")))
+static void reduce_avx512(const double* p,
+                          int64_t stride,
+                          int64_t n,
+                          double shift,
+                          hb_reduce_acc_t* acc) {
+  const __m512i idx = _mm512_set_epi64(7 * stride, 6 * stride, 5 * stride, 4 * stride,
+                                       3 * stride, 2 * stride, stride, 0);
+  const __m512d vshift = _mm512_set1_pd(shift);
+  __m512d vmin = _mm512_set1_pd(acc->min);
+  __m512d vmax = _mm512_set1_pd(acc->max);
+  __m512d vsum = _mm512_setzero_pd();
+  __m512d vsumsq = _mm512_setzero_pd();
+  int64_t i;
+
+  for (i = 0; i + 8 <= n; i += 8, p += 8 * stride) {
+    __m512d x = _mm512_i64gather_pd(idx, p, sizeof(double));
+    __m512d d = _mm512_sub_pd(x, vshift);
+    vmin = _mm512_min_pd(vmin, x);
+    vmax = _mm512_max_pd(vmax, x);
+    vsum = _mm512_add_pd(vsum, d);
+    vsumsq = _mm512_fmadd_pd(d, d, vsumsq);
+  }
+
+  acc->min = _mm512_reduce_min_pd(vmin);
+  acc->max = _mm512_reduce_max_pd(vmax);
+  acc->sum += _mm512_reduce_add_pd(vsum);
+  acc->sumsq += _mm512_reduce_add_pd(vsumsq);
+
+  reduce_scalar(p, stride, n - i, shift, acc);
+}
+
+#elif defined(HB_REDUCE_NEON)
+
+static void reduce_neon(const double* p,
+                        int64_t stride,
+                        int64_t n,
+                        double shift,
+                        hb_reduce_acc_t* acc) {
+  const float64x2_t vshift = vdupq_n_f64(shift);
+  float64x2_t vmin = vdupq_n_f64(acc->min);
+  float64x2_t vmax = vdupq_n_f64(acc->max);
+  float64x2_t vsum = vdupq_n_f64(0.0);
+  float64x2_t vsumsq = vdupq_n_f64(0.0);
+  int64_t i;
+
+  // no gather on NEON, but two lane loads still halve the dependent ops
+  for (i = 0; i + 2 <= n; i += 2, p += 2 * stride) {
+    float64x2_t x = vcombine_f64(vld1_f64(p), vld1_f64(p + stride));
+    float64x2_t d = vsubq_f64(x, vshift);
+    vmin = vminq_f64(vmin, x);
+    vmax = vmaxq_f64(vmax, x);
+    vsum = vaddq_f64(vsum, d);
+    vsumsq = vfmaq_f64(vsumsq, d, d);
+  }
+
+  acc->min = vminvq_f64(vmin);
+  acc->max = vmaxvq_f64(vmax);
+  acc->sum += vaddvq_f64(vsum);
+  acc->sumsq += vaddvq_f64(vsumsq);
+
+  reduce_scalar(p, stride, n - i, shift, acc);
+}
+
+#endif
+
+static hb_reduce_kernel_t reduce_kernel = NULL;
+
+static hb_reduce_kernel_t select_kernel(void) {
+#if defined(HB_REDUCE_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return reduce_avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return reduce_avx2;
+  }
+#elif defined(HB_REDUCE_NEON)
+  return reduce_neon;
+#endif
+  return reduce_scalar;
+}
+
+int64_t HB_reduce_ring(const void* log,
+                       int64_t record_size,
+                       int64_t features,
+                       int64_t buffer_depth,
+                       int64_t buffer_index,
+                       int64_t filled,
+                       int64_t n,
+                       uint32_t fields,
+                       hb_reduction_t* out) {
+  const char* base = (const char*) log;
+  int64_t stride = record_size / (int64_t) sizeof(double);
+  int64_t avail = filled < buffer_depth ? filled : buffer_depth;
+  int64_t start;
+  int64_t len[2];
+  const char* first[2];
+  hb_reduce_acc_t acc;
+  double shift;
+  double var;
+  int f;
+  int r;
+
+  if ((fields & HB_FIELDS_ACCURACY) && !(features & HB_FEATURE_ACCURACY)) {
+    return -1;
+  }
+  if ((fields & HB_FIELDS_POWER) && !(features & HB_FEATURE_POWER)) {
+    return -1;
+  }
+  if ((fields & HB_FIELDS_COUNTERS) && !(features & HB_FEATURE_COUNTERS)) {
+    return -1;
+  }
+  if (reduce_kernel == NULL) {
+    // benign race: every thread selects the same kernel
+    reduce_kernel = select_kernel();
+  }
+
+  if (n > avail) {
+    n = avail;
+  }
+  if (n < 0) {
+    n = 0;
+  }
+  out->count = n;
+  out->fields = fields;
+  if (n == 0) {
+    return 0;
+  }
+
+  // split the last n records at the wrap point, oldest first
+  start = buffer_index - n;
+  if (start >= 0) {
+    first[0] = base + start * record_size;
+    len[0] = n;
+    first[1] = NULL;
+    len[1] = 0;
+  } else {
+    first[0] = base + (buffer_depth + start) * record_size;
+    len[0] = -start;
+    first[1] = base;
+    len[1] = buffer_index;
+  }
+
+  for (f = 0; f < HB_FIELD_COUNT; f++) {
+    size_t offset = HB_REDUCE_FIELD_OFFSET(f, features);
+    if (!(fields & HB_FIELD_BIT(f))) {
+      continue;
+    }
+    acc.min = INFINITY;
+    acc.max = -INFINITY;
+    acc.sum = 0.0;
+    acc.sumsq = 0.0;
+    shift = *(const double*) (first[0] + offset);
+    shift = isfinite(shift) ? shift : 0.0;
+    for (r = 0; r < 2; r++) {
+      if (len[r] > 0) {
+        reduce_kernel((const double*) (first[r] + offset), stride, len[r], shift, &acc);
+      }
+    }
+    out->stats[f].min = acc.min;
+    out->stats[f].max = acc.max;
+    out->stats[f].mean = shift + acc.sum / (double) n;
+    var = (acc.sumsq - acc.sum * acc.sum / (double) n) / (double) n;
+    out->stats[f].stddev = var > 0.0 ? sqrt(var) : 0.0;
+  }
+  return n;
+}
@@ -29,6 +29,11 @@ heartbeat_t* heartbeat_init(int64_t window_size,
   }
   // set to NULL so free doesn't fail in finish function if we have to abort
   hb->window = NULL;
+  hb->counters = NULL;
+  hb->rusage_schedstat_fd = -1;
+  hb->rusage_sched_fd = -1;
+  hb->work_window = NULL;
+  hb->cpu_window = NULL;
   hb->text_file = NULL;
 
   hb->state = HB_alloc_state(pid);
@@ -57,7 +62,6 @@ heartbeat_t* heartbeat_init(int64_t window_size,
     return NULL;
   }
   snprintf(hb->filename, sizeof(hb->filename), "%s/%d", enabled_dir, hb->state->pid);
-  printf("%s\n", hb->filename);
 
   hb->log = HB_alloc_log(hb->state->pid, buffer_depth);
   if(hb->log == NULL) {
@@ -73,6 +77,24 @@ heartbeat_t* heartbeat_init(int64_t window_size,
     heartbeat_finish(hb);
     return NULL;
   }
+  hb->work_window = (int64_t*) malloc((size_t)window_size * sizeof(int64_t));
+  if (hb->work_window == NULL) {
+    perror("Failed to malloc work window");
+    heartbeat_finish(hb);
+    return NULL;
+  }
+  hb->cpu_window = (int64_t*) malloc((size_t) window_size * sizeof(int64_t));
+  if (hb->cpu_window == NULL) {
+    perror("Failed to malloc CPU time window");
+    heartbeat_finish(hb);
+    return NULL;
+  }
+  hb->window_work = 0;
+  hb->total_work = 0;
+  hb->flush_index = 0;
+  hb->adaptive = 0;
+  hb->forecast_alpha = HB_FORECAST_ALPHA;
+  hb->forecast_beta = HB_FORECAST_BETA;
   hb->current_index = 0;
   hb->state->min_heartrate = min_target;
   hb->state->max_heartrate = max_target;
@@ -80,6 +102,18 @@ heartbeat_t* heartbeat_init(int64_t window_size,
   hb->state->buffer_index = 0;
   hb->state->read_index = 0;
   hb->state->buffer_depth = buffer_depth;
+  hb->state->record_size = sizeof(heartbeat_record_t);
+  hb->state->features = HB_RECORD_FEATURES;
+  hb->state->effective_window = window_size;
+  HB_forecast_reset(hb);
+  HB_command_reset(hb);
+  HB_rusage_reset(hb);
+  HB_cpu_reset(hb, HB_CPU_CLOCK_NONE);
+  HB_eta_reset(hb);
+  HB_pace_reset(hb);
+  hb->state->log_generation = 0;
+  hb->state->log_start = 0;
+  hb->state->beat_seq = 0;
   pthread_mutex_init(&hb->mutex, NULL);
   hb->steady_state = 0;
   hb->state->valid = 0;
@@ -99,7 +133,7 @@ heartbeat_t* heartbeat_init(int64_t window_size,
  *
  * @param hb pointer to heartbeat_t
  */
-static void hb_flush_buffer(heartbeat_t volatile * hb) {
+void HB_flush_buffer(heartbeat_t volatile * hb) {
   int64_t i;
   int64_t nrecords = hb->state->buffer_index; // buffer_depth
 
@@ -107,7 +141,7 @@ static void hb_flush_buffer(heartbeat_t volatile * hb) {
   //	 (long long int) nrecords);
 
   if(hb->text_file != NULL) {
-    for(i = 0; i < nrecords; i++) {
+    for(i = hb->flush_index; i < nrecords; i++) {
       fprintf(hb->text_file,
 	      "%lld\t%d\t%lld\t%f\t%f\t%f\t%f\t%f\n",
 	      (long long int) hb->log[i].beat,
@@ -122,14 +156,19 @@ static void hb_flush_buffer(heartbeat_t volatile * hb) {
 
     fflush(hb->text_file);
   }
+  hb->flush_index = 0;
 }
 
 void heartbeat_finish(heartbeat_t* hb) {
   if (hb != NULL) {
     pthread_mutex_destroy(&hb->mutex);
+    HB_counters_close(hb->counters);
+    HB_rusage_finish(hb);
     free(hb->window);
+    free(hb->work_window);
+    free(hb->cpu_window);
     if(hb->text_file != NULL) {
-      hb_flush_buffer(hb);
+      HB_flush_buffer(hb);
       fclose(hb->text_file);
     }
     remove(hb->filename);
@@ -142,21 +181,27 @@ void heartbeat_finish(heartbeat_t* hb) {
  * Helper function to compute windowed heart rate
  * @param hb pointer to heartbeat_t
  * @param time int64_t
+ * @param work int64_t
  */
 static inline float hb_window_average(heartbeat_t volatile * hb,
-				      int64_t time) {
+				      int64_t time,
+				      int64_t work) {
   int i;
   double average_time = 0;
+  double average_work;
   double fps;
 
 
   if(!hb->steady_state) {
     hb->window[hb->current_index] = time;
+    hb->work_window[hb->current_index] = work;
+    hb->window_work += work;
 
     for(i = 0; i < hb->current_index+1; i++) {
       average_time += (double) hb->window[i];
     }
     average_time = average_time / ((double) hb->current_index+1);
+    average_work = (double) hb->window_work / ((double) hb->current_index+1);
     hb->last_average_time = average_time;
     hb->current_index++;
     if( hb->current_index == hb->state->window_size) {
@@ -169,27 +214,38 @@ static inline float hb_window_average(heartbeat_t volatile * hb,
       hb->last_average_time -
       ((double) hb->window[hb->current_index]/ (double) hb->state->window_size);
     average_time += (double) time /  (double) hb->state->window_size;
+    hb->window_work += work - hb->work_window[hb->current_index];
+    average_work = (double) hb->window_work / (double) hb->state->window_size;
 
     hb->last_average_time = average_time;
 
     hb->window[hb->current_index] = time;
+    hb->work_window[hb->current_index] = work;
     hb->current_index++;
 
     if( hb->current_index == hb->state->window_size)
       hb->current_index = 0;
   }
-  fps = (1.0 / (float) average_time)*1000000000;
+  fps = (average_work / (float) average_time)*1000000000;
 
   return (float)fps;
 }
 
 int64_t heartbeat( heartbeat_t* hb, int tag )
+{
+    return heartbeat_n(hb, tag, 1);
+}
+
+int64_t heartbeat_n( heartbeat_t* hb, int tag, int64_t n )
 {
     struct timespec time_info;
     int64_t time;
     int64_t old_last_time;
+    hb_command_t cmds[HB_COMMAND_SLOTS];
+    int ncmds;
 
     pthread_mutex_lock(&hb->mutex);
+    HB_beat_begin(hb);
     //printf("Registering Heartbeat\n");
     old_last_time = hb->last_timestamp;
     time = SimUser(0x123, 1) / 1000000; // get fs time and convert to ns
@@ -199,6 +255,7 @@ int64_t heartbeat( heartbeat_t* hb, int tag )
     //      - Make sure types don't clash
 
     hb->last_timestamp = time;
+    hb->total_work += n;
 
     if(hb->first_timestamp == -1) {
       //printf("In heartbeat - first time stamp\n");
@@ -213,6 +270,9 @@ int64_t heartbeat( heartbeat_t* hb, int tag )
       hb->log[0].window_rate = 0;
       hb->log[0].instant_rate = 0;
       hb->log[0].global_rate = 0;
+      HB_counters_record(hb, 0, n);
+      // CPU-time rates start from the first beat like the wall-clock ones
+      HB_cpu_reset(hb, hb->state->cpu_clock);
       hb->state->counter++;
       hb->state->buffer_index++;
       hb->state->valid = 1;
@@ -221,11 +281,17 @@ int64_t heartbeat( heartbeat_t* hb, int tag )
       //printf("In heartbeat - NOT first time stamp - read index = %d\n",hb->state->read_index );
       int64_t index =  hb->state->buffer_index;
       hb->last_timestamp = time;
-      double window_heartrate = hb_window_average(hb, time-old_last_time);
+      double adaptive_heartrate = HB_adaptive_window_rate(hb, time-old_last_time, n);
+      HB_cpu_rate_update(hb, n);
+      HB_eta_update(hb, time, time - old_last_time, n);
+      double window_heartrate = hb_window_average(hb, time-old_last_time, n);
+      if (hb->adaptive) {
+        window_heartrate = adaptive_heartrate;
+      }
       double global_heartrate =
-	(((double) hb->state->counter+1) /
+	(((double) hb->total_work) /
 	 ((double) (time - hb->first_timestamp)))*1000000000.0;
-      double instant_heartrate = 1.0 /(((double) (time - old_last_time))) *
+      double instant_heartrate = ((double) n) /(((double) (time - old_last_time))) *
 	1000000000.0;
 
       hb->log[index].beat = hb->state->counter;
@@ -234,20 +300,28 @@ int64_t heartbeat( heartbeat_t* hb, int tag )
       hb->log[index].window_rate = window_heartrate;
       hb->log[index].instant_rate = instant_heartrate;
       hb->log[index].global_rate = global_heartrate;
+      HB_counters_record(hb, index, n);
+      HB_forecast_update(hb, time, time - old_last_time, instant_heartrate, 0);
       hb->state->buffer_index++;
       hb->state->counter++;
       hb->state->read_index++;
 
       if(hb->state->buffer_index%hb->state->buffer_depth == 0) {
 	if(hb->text_file != NULL)
-	  hb_flush_buffer(hb);
+	  HB_flush_buffer(hb);
 	hb->state->buffer_index = 0;
       }
       if(hb->state->read_index%hb->state->buffer_depth == 0) {
 	hb->state->read_index = 0;
       }
     }
+    HB_beat_end(hb);
+    HB_rusage_poll(hb, time);
+    ncmds = HB_command_poll(hb, cmds);
     pthread_mutex_unlock(&hb->mutex);
+    if (ncmds > 0) {
+      HB_command_dispatch(hb, cmds, ncmds);
+    }
     return time;
 
 }
@@ -12,10 +12,20 @@
  * @author Hank Hoffmann
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/resource.h>
 #include "heartbeat-util-shared.h"
+#include "heartbeat-reduce-internal.h"
 /* The proper heartbeat implementation to include is done so in the header */
 
 /*
@@ -58,8 +68,6 @@ _heartbeat_record_t* HB_alloc_log(int pid, int64_t buffer_size) {
   _heartbeat_record_t* p = NULL;
   int shmid;
 
-  printf("Allocating log for %d, %d\n", pid, pid << 1);
-
   shmid = shmget(pid << 1, buffer_size*sizeof(_heartbeat_record_t), IPC_CREAT | 0666);
   if (shmid < 0) {
     perror("cannot allocate shared memory for heartbeat records");
@@ -78,6 +86,400 @@ _heartbeat_record_t* HB_alloc_log(int pid, int64_t buffer_size) {
   return p;
 }
 
+/**
+ * Interval per unit of work of entry i in the window arrays, the quantity
+ * whose spread determines how many beats a stable window rate needs
+ */
+static inline double hb_adaptive_sample(heartbeat_t volatile * hb, int64_t i) {
+  int64_t work = hb->work_window[i];
+  return (double) hb->window[i] / (double) (work > 0 ? work : 1);
+}
+
+/**
+ * Number of entries currently held in the window arrays
+ */
+static inline int64_t hb_adaptive_filled(heartbeat_t volatile * hb) {
+  return hb->steady_state ? hb->state->window_size : hb->current_index;
+}
+
+static void hb_adaptive_recompute(heartbeat_t volatile * hb) {
+  int64_t i;
+  int64_t filled = hb_adaptive_filled(hb);
+  hb->interval_sum = 0;
+  hb->interval_sumsq = 0;
+  for (i = 0; i < filled; i++) {
+    double x = hb_adaptive_sample(hb, i);
+    hb->interval_sum += x;
+    hb->interval_sumsq += x * x;
+  }
+}
+
+/**
+ * Restart adaptive window bookkeeping from the current window arrays.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+void HB_adaptive_reset(heartbeat_t volatile * hb) {
+  hb_adaptive_recompute(hb);
+  hb->effective_time = 0;
+  hb->effective_work = 0;
+  hb->state->effective_window = 0;
+}
+
+/**
+ * Computes the window rate for a new interval over an effective window that
+ * is sized for the requested confidence, and publishes that size. Must be
+ * called before the implementation's own window average overwrites the
+ * oldest entry of the window arrays. The window arrays (window_size entries)
+ * bound the effective window.
+ *
+ * The number of intervals whose mean has relative error rel_error at the
+ * requested confidence is (z * cv / rel_error)^2, where cv is the
+ * coefficient of variation of the interval per unit of work observed over
+ * the whole window arrays.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param time int64_t interval since the previous beat
+ * @param work int64_t work in this beat
+ * @return the window rate, or 0 if the window is not adaptive
+ */
+double HB_adaptive_window_rate(heartbeat_t volatile * hb,
+                               int64_t time,
+                               int64_t work) {
+  int64_t cap = hb->state->window_size;
+  int64_t idx = hb->current_index;
+  int64_t filled = hb_adaptive_filled(hb);
+  int64_t count;
+  int64_t target;
+  int64_t eff;
+  double x = (double) time / (double) (work > 0 ? work : 1);
+  double mean;
+  double var;
+  double need;
+
+  if (!hb->adaptive) {
+    return 0;
+  }
+
+  // spread of intervals over the whole window arrays
+  if (filled == cap) {
+    if (idx == 0) {
+      // bound floating point drift of the running sums
+      hb_adaptive_recompute(hb);
+    }
+    hb->interval_sum -= hb_adaptive_sample(hb, idx);
+    hb->interval_sumsq -= hb_adaptive_sample(hb, idx) * hb_adaptive_sample(hb, idx);
+    count = cap;
+  } else {
+    count = filled + 1;
+  }
+  hb->interval_sum += x;
+  hb->interval_sumsq += x * x;
+
+  target = hb->adaptive_min_window;
+  mean = hb->interval_sum / (double) count;
+  if (count > 1 && mean > 0) {
+    var = (hb->interval_sumsq - hb->interval_sum * mean) / (double) (count - 1);
+    need = var > 0 ? hb->adaptive_z * sqrt(var) / mean / hb->adaptive_rel_error : 0;
+    need = ceil(need * need);
+    if (need > (double) target) {
+      target = need < (double) cap ? (int64_t) need : cap;
+    }
+  }
+  if (target > count) {
+    target = count;
+  }
+
+  // the new interval is the newest entry, entry k >= 1 back is at idx - k
+  eff = hb->state->effective_window + 1;
+  hb->effective_time += time;
+  hb->effective_work += work;
+  while (eff > target) {
+    int64_t i = ((idx - (eff - 1)) % cap + cap) % cap;
+    hb->effective_time -= hb->window[i];
+    hb->effective_work -= hb->work_window[i];
+    eff--;
+  }
+  while (eff < target) {
+    int64_t i = ((idx - eff) % cap + cap) % cap;
+    hb->effective_time += hb->window[i];
+    hb->effective_work += hb->work_window[i];
+    eff++;
+  }
+  hb->state->effective_window = eff;
+
+  return hb->effective_time > 0 ?
+    (double) hb->effective_work / (double) hb->effective_time * 1000000000.0 : 0;
+}
+
+/* Standard deviations between the completion estimate and its bounds
+   (about 95% if the remaining time were normal) */
+#define HB_ETA_Z 1.96
+
+static void hb_eta_recompute(heartbeat_t volatile * hb) {
+  int64_t i;
+  int64_t filled = hb_adaptive_filled(hb);
+  hb->eta_time = 0;
+  hb->eta_work = 0;
+  hb->eta_sum = 0;
+  hb->eta_sumsq = 0;
+  for (i = 0; i < filled; i++) {
+    double x = hb_adaptive_sample(hb, i);
+    hb->eta_time += hb->window[i];
+    hb->eta_work += hb->work_window[i];
+    hb->eta_sum += x;
+    hb->eta_sumsq += x * x;
+  }
+}
+
+void HB_eta_reset(heartbeat_t volatile * hb) {
+  hb->state->work_goal = 0;
+  hb->state->work_done = hb->total_work;
+  hb->state->eta = 0;
+  hb->state->eta_low = 0;
+  hb->state->eta_high = 0;
+}
+
+/**
+ * Estimates when the remaining work will be done: the next window's worth
+ * of work at the window rate and the rest at the global rate. The bounds
+ * add the spread of the interval per unit of work over the window, summed
+ * over the remaining beats, to the disagreement between the two rates about
+ * the work beyond the window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param time int64_t timestamp of this beat
+ * @param interval int64_t interval since the previous beat
+ * @param n int64_t work in this beat
+ */
+void HB_eta_update(heartbeat_t volatile * hb, int64_t time, int64_t interval, int64_t n) {
+  int64_t cap = hb->state->window_size;
+  int64_t idx = hb->current_index;
+  int64_t count;
+  int64_t remaining;
+  double x = (double) interval / (double) (n > 0 ? n : 1);
+  double old;
+  double wrate;
+  double grate;
+  double near;
+  double far;
+  double t;
+  double mean;
+  double var = 0;
+  double disagree;
+  double sd;
+
+  hb->state->work_done = hb->total_work;
+  if (hb->state->work_goal <= 0) {
+    return;
+  }
+
+  if (hb_adaptive_filled(hb) == cap) {
+    if (idx == 0) {
+      // bound floating point drift of the running sums
+      hb_eta_recompute(hb);
+    }
+    old = hb_adaptive_sample(hb, idx);
+    hb->eta_sum -= old;
+    hb->eta_sumsq -= old * old;
+    hb->eta_time -= hb->window[idx];
+    hb->eta_work -= hb->work_window[idx];
+    count = cap;
+  } else {
+    count = hb_adaptive_filled(hb) + 1;
+  }
+  hb->eta_sum += x;
+  hb->eta_sumsq += x * x;
+  hb->eta_time += interval;
+  hb->eta_work += n;
+
+  remaining = hb->state->work_goal - hb->total_work;
+  if (remaining <= 0) {
+    if (hb->total_work - n < hb->state->work_goal) {
+      // this beat finished the work
+      hb->state->eta = time;
+      hb->state->eta_low = time;
+      hb->state->eta_high = time;
+    }
+    return;
+  }
+  wrate = hb->eta_time > 0 ? (double) hb->eta_work / (double) hb->eta_time : 0;
+  grate = time > hb->first_timestamp ?
+    (double) hb->total_work / (double) (time - hb->first_timestamp) : 0;
+  if (wrate <= 0 || grate <= 0) {
+    hb->state->eta = 0;
+    hb->state->eta_low = 0;
+    hb->state->eta_high = 0;
+    return;
+  }
+  near = (double) (remaining < hb->eta_work ? remaining : hb->eta_work);
+  far = (double) remaining - near;
+  t = near / wrate + far / grate;
+
+  mean = hb->eta_sum / (double) count;
+  if (count > 1) {
+    var = (hb->eta_sumsq - hb->eta_sum * mean) / (double) (count - 1);
+  }
+  if (var < 0) {
+    var = 0;
+  }
+  // a beat of w units varies by w times the spread per unit
+  disagree = far / wrate - far / grate;
+  sd = sqrt(var * (double) remaining * (double) hb->eta_work / (double) count +
+            disagree * disagree);
+
+  hb->state->eta = time + (int64_t) t;
+  hb->state->eta_low = time + (int64_t) (t > HB_ETA_Z * sd ? t - HB_ETA_Z * sd : 0);
+  hb->state->eta_high = time + (int64_t) (t + HB_ETA_Z * sd);
+}
+
+/**
+ * Empty the command queue and restore the default polling.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+void HB_command_reset(heartbeat_t volatile * hb) {
+  uint64_t i;
+  for (i = 0; i < HB_COMMAND_SLOTS; i++) {
+    __atomic_store_n(&hb->state->commands[i].seq, i, __ATOMIC_RELAXED);
+  }
+  hb->state->command_tail = 0;
+  __atomic_store_n(&hb->state->command_head, 0, __ATOMIC_RELEASE);
+  hb->command_handler = NULL;
+  hb->command_arg = NULL;
+  hb->command_interval = 1;
+}
+
+/**
+ * Takes the pending commands off the queue and applies built-in ones. Only
+ * the application drains the queue, always with hb->mutex held, so the
+ * consumer side needs no atomic read-modify-write.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param cmds array of HB_COMMAND_SLOTS hb_command_t receiving the commands
+ * @return number of commands taken
+ */
+int HB_command_drain(heartbeat_t volatile * hb, hb_command_t* cmds) {
+  HB_global_state_t* state = hb->state;
+  uint64_t pos = state->command_tail;
+  int n = 0;
+
+  while (n < HB_COMMAND_SLOTS) {
+    _HB_command_t* slot = &state->commands[pos & (HB_COMMAND_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+      break;
+    }
+    cmds[n] = *slot;
+    __atomic_store_n(&slot->seq, pos + HB_COMMAND_SLOTS, __ATOMIC_RELEASE);
+    pos++;
+
+    switch (cmds[n].type) {
+      case HB_CMD_SET_TARGETS:
+        state->min_heartrate = cmds[n].value[0];
+        state->max_heartrate = cmds[n].value[1];
+        break;
+      default:
+        break;
+    }
+    n++;
+  }
+  state->command_tail = pos;
+  return n;
+}
+
+/**
+ * Drains the command queue if it is due, every command_interval beats.
+ * A command_interval <= 0 leaves draining to heartbeat_poll_commands().
+ *
+ * @param hb pointer to heartbeat_t
+ * @param cmds array of HB_COMMAND_SLOTS hb_command_t receiving the commands
+ * @return number of commands taken
+ */
+int HB_command_poll(heartbeat_t volatile * hb, hb_command_t* cmds) {
+  if (hb->command_interval <= 0 ||
+      (hb->command_interval > 1 && hb->state->counter % hb->command_interval != 0)) {
+    return 0;
+  }
+  return HB_command_drain(hb, cmds);
+}
+
+/**
+ * Passes drained commands to the application's handler. Called after
+ * releasing hb->mutex so handlers may use the heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param cmds array of hb_command_t
+ * @param n number of commands
+ */
+void HB_command_dispatch(heartbeat_t volatile * hb, const hb_command_t* cmds, int n) {
+  int i;
+  hb_command_handler_t handler = hb->command_handler;
+  if (handler == NULL) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    handler(&cmds[i], hb->command_arg);
+  }
+}
+
+/**
+ * One step of Holt's linear smoothing for samples at irregular intervals;
+ * the trend is kept per nanosecond.
+ */
+static inline void hb_holt_update(double volatile * level,
+                                  double volatile * trend,
+                                  double x,
+                                  double dt,
+                                  double alpha,
+                                  double beta) {
+  double prev = *level;
+  *level = alpha * x + (1 - alpha) * (prev + *trend * dt);
+  *trend = beta * (*level - prev) / dt + (1 - beta) * *trend;
+}
+
+/**
+ * Forget the forecasts; the next update starts them from its sample.
+ *
+ * @param hb pointer to heartbeat_t
+ */
+void HB_forecast_reset(heartbeat_t volatile * hb) {
+  hb->state->forecast_timestamp = -1;
+  hb->state->rate_level = 0;
+  hb->state->rate_trend = 0;
+  hb->state->power_level = 0;
+  hb->state->power_trend = 0;
+}
+
+/**
+ * Feeds the instant rate and power of a beat to the rate and power forecasts.
+ * Implementations without power pass 0.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param time int64_t timestamp of the beat
+ * @param interval int64_t time since the previous beat
+ * @param rate double instant rate
+ * @param power double instant power
+ */
+void HB_forecast_update(heartbeat_t volatile * hb,
+                        int64_t time,
+                        int64_t interval,
+                        double rate,
+                        double power) {
+  if (interval <= 0 || !isfinite(rate) || !isfinite(power)) {
+    return;
+  }
+  if (hb->state->forecast_timestamp < 0) {
+    hb->state->rate_level = rate;
+    hb->state->power_level = power;
+  } else {
+    hb_holt_update(&hb->state->rate_level, &hb->state->rate_trend, rate,
+                   (double) interval, hb->forecast_alpha, hb->forecast_beta);
+    hb_holt_update(&hb->state->power_level, &hb->state->power_trend, power,
+                   (double) interval, hb->forecast_alpha, hb->forecast_beta);
+  }
+  hb->state->forecast_timestamp = time;
+}
+
 /*
  * Functions from heartbeat.h
  */
@@ -87,6 +489,703 @@ int64_t hb_get_window_size(heartbeat_t volatile * hb) {
   return hb->state->window_size;
 }
 
+int64_t hb_get_effective_window_size(heartbeat_t volatile * hb) {
+  return hb->state->effective_window;
+}
+
+int heartbeat_set_adaptive_window(heartbeat_t* hb,
+                                  double rel_error,
+                                  double confidence,
+                                  int64_t min_window) {
+  double lo = 0;
+  double hi = 10;
+  int i;
+
+  if (rel_error > 0 && (confidence <= 0 || confidence >= 1 || min_window < 1)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&hb->mutex);
+  if (rel_error <= 0) {
+    hb->adaptive = 0;
+    hb->state->effective_window = hb->state->window_size;
+  } else {
+    // two-sided normal quantile for the confidence level
+    for (i = 0; i < 64; i++) {
+      double z = (lo + hi) / 2;
+      if (erf(z / sqrt(2.0)) < confidence) {
+        lo = z;
+      } else {
+        hi = z;
+      }
+    }
+    hb->adaptive_z = (lo + hi) / 2;
+    hb->adaptive_rel_error = rel_error;
+    hb->adaptive_min_window = min_window < hb->state->window_size ?
+                              min_window : hb->state->window_size;
+    if (!hb->adaptive) {
+      hb->adaptive = 1;
+      HB_adaptive_reset(hb);
+    }
+  }
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+/**
+ * Moves the newest k window entries of a window array of old_size entries,
+ * the oldest of which is at start, to the front of a new array.
+ */
+#define HB_MIGRATE_WINDOW(dst, src, start, k, old_size) \
+  do { \
+    int64_t _j; \
+    for (_j = 0; _j < (k); _j++) { \
+      (dst)[_j] = (src)[((start) + _j) % (old_size)]; \
+    } \
+  } while (0)
+
+int heartbeat_set_window_size(heartbeat_t* hb, int64_t window_size) {
+  int64_t old_size;
+  int64_t filled;
+  int64_t start;
+  int64_t k;
+  int64_t j;
+  double time_sum = 0;
+  int64_t* window;
+  int64_t* work_window;
+  int64_t* cpu_window;
+  int64_t kc;
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+  double* accuracy_window;
+  double accuracy_sum = 0;
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+  double* power_window;
+  double energy_sum = 0;
+#endif
+
+  if (window_size < 1) {
+    return -1;
+  }
+
+  window = (int64_t*) malloc((size_t) window_size * sizeof(int64_t));
+  work_window = (int64_t*) malloc((size_t) window_size * sizeof(int64_t));
+  cpu_window = (int64_t*) malloc((size_t) window_size * sizeof(int64_t));
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+  accuracy_window = (double*) malloc((size_t) window_size * sizeof(double));
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+  power_window = (double*) malloc((size_t) window_size * sizeof(double));
+#endif
+  if (window == NULL || work_window == NULL || cpu_window == NULL
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+      || accuracy_window == NULL
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+      || power_window == NULL
+#endif
+      ) {
+    perror("Failed to malloc resized window");
+    free(window);
+    free(work_window);
+    free(cpu_window);
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+    free(accuracy_window);
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+    free(power_window);
+#endif
+    return -1;
+  }
+
+  pthread_mutex_lock(&hb->mutex);
+  // keep the newest entries, oldest first, so the window continues as if
+  // it had always had the new size
+  old_size = hb->state->window_size;
+  filled = hb->steady_state ? old_size : hb->current_index;
+  k = filled < window_size ? filled : window_size;
+  start = (hb->current_index - k + old_size) % old_size;
+  HB_MIGRATE_WINDOW(window, hb->window, start, k, old_size);
+  HB_MIGRATE_WINDOW(work_window, hb->work_window, start, k, old_size);
+  HB_MIGRATE_WINDOW(cpu_window, hb->cpu_window, start, k, old_size);
+  free(hb->window);
+  free(hb->work_window);
+  free(hb->cpu_window);
+  hb->window = window;
+  hb->work_window = work_window;
+  hb->cpu_window = cpu_window;
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+  HB_MIGRATE_WINDOW(accuracy_window, hb->accuracy_window, start, k, old_size);
+  free(hb->accuracy_window);
+  hb->accuracy_window = accuracy_window;
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+  HB_MIGRATE_WINDOW(power_window, hb->power_window, start, k, old_size);
+  free(hb->power_window);
+  hb->power_window = power_window;
+#endif
+
+  // running values the window averages continue from
+  hb->window_work = 0;
+  for (j = 0; j < k; j++) {
+    time_sum += (double) hb->window[j];
+    hb->window_work += hb->work_window[j];
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+    accuracy_sum += hb->accuracy_window[j];
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+    energy_sum += hb->power_window[j];
+#endif
+  }
+  // only the newest cpu_filled entries hold CPU times
+  kc = hb->cpu_filled < k ? hb->cpu_filled : k;
+  hb->cpu_filled = kc;
+  hb->window_cpu = 0;
+  hb->window_cpu_work = 0;
+  for (j = k - kc; j < k; j++) {
+    hb->window_cpu += hb->cpu_window[j];
+    hb->window_cpu_work += hb->work_window[j];
+  }
+  if (k > 0) {
+    hb->last_average_time = time_sum / (double) k;
+#if defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)
+    hb->last_average_accuracy = accuracy_sum / (double) k;
+#endif
+#if defined(HEARTBEAT_MODE_ACC_POW)
+    hb->last_window_time = time_sum;
+    hb->last_window_energy = energy_sum;
+#endif
+  }
+  hb->current_index = k % window_size;
+  hb->steady_state = k == window_size;
+  hb->state->window_size = window_size;
+
+  if (hb->adaptive) {
+    if (hb->adaptive_min_window > window_size) {
+      hb->adaptive_min_window = window_size;
+    }
+    HB_adaptive_reset(hb);
+  } else {
+    hb->state->effective_window = window_size;
+  }
+  hb_eta_recompute(hb);
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+int heartbeat_set_buffer_depth(heartbeat_t* hb, int64_t buffer_depth) {
+  _heartbeat_record_t* old_log;
+  _heartbeat_record_t* log;
+  int64_t old_depth;
+  int64_t k;
+  int shmid;
+  int rc = 0;
+
+  if (buffer_depth < 1) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&hb->mutex);
+  old_log = hb->log;
+  old_depth = hb->state->buffer_depth;
+  k = hb->state->counter - hb->state->log_start;
+  k = k < old_depth ? k : old_depth;
+  k = k < buffer_depth ? k : buffer_depth;
+  if (hb->text_file != NULL) {
+    HB_flush_buffer(hb);
+  }
+
+  // monitors wait while the generation is odd and re-attach when it changes
+  __atomic_add_fetch(&hb->state->log_generation, 1, __ATOMIC_SEQ_CST);
+
+  // the key can only name one segment: release it (the old segment lives on
+  // until everyone detaches) and create the new one under the same key
+  shmid = shmget(hb->state->pid << 1, 0, 0666);
+  if (shmid >= 0) {
+    shmctl(shmid, IPC_RMID, NULL);
+  }
+  log = HB_alloc_log(hb->state->pid, buffer_depth);
+  if (log == NULL) {
+    // put the old contents back under the key
+    log = HB_alloc_log(hb->state->pid, old_depth);
+    if (log == NULL) {
+      // monitors cannot attach any more, but the application can go on
+      __atomic_add_fetch(&hb->state->log_generation, 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&hb->mutex);
+      return -1;
+    }
+    memcpy(log, old_log, (size_t) old_depth * sizeof(heartbeat_record_t));
+    buffer_depth = old_depth;
+    k = -1;
+    rc = -1;
+  } else {
+    hb_get_history(hb, log, k);
+  }
+
+  hb->log = log;
+  shmdt(old_log);
+  if (k >= 0) {
+    hb->state->buffer_depth = buffer_depth;
+    hb->state->buffer_index = k % buffer_depth;
+    hb->state->read_index = k > 0 ? k - 1 : 0;
+    // older beats are no longer in the log even if the new one is deeper
+    hb->state->log_start = hb->state->counter - k;
+    hb->flush_index = hb->state->buffer_index;
+  }
+  __atomic_add_fetch(&hb->state->log_generation, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&hb->mutex);
+  return rc;
+}
+
+int heartbeat_set_forecast_smoothing(heartbeat_t* hb,
+                                     double alpha,
+                                     double beta) {
+  if (alpha <= 0 || alpha > 1 || beta < 0 || beta > 1) {
+    return -1;
+  }
+  pthread_mutex_lock(&hb->mutex);
+  hb->forecast_alpha = alpha;
+  hb->forecast_beta = beta;
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+void heartbeat_set_command_handler(heartbeat_t* hb,
+                                   hb_command_handler_t handler,
+                                   void* arg,
+                                   int64_t poll_interval) {
+  pthread_mutex_lock(&hb->mutex);
+  hb->command_handler = handler;
+  hb->command_arg = arg;
+  hb->command_interval = poll_interval;
+  pthread_mutex_unlock(&hb->mutex);
+}
+
+int heartbeat_poll_commands(heartbeat_t* hb) {
+  hb_command_t cmds[HB_COMMAND_SLOTS];
+  int n;
+
+  pthread_mutex_lock(&hb->mutex);
+  n = HB_command_drain(hb, cmds);
+  pthread_mutex_unlock(&hb->mutex);
+  HB_command_dispatch(hb, cmds, n);
+  return n;
+}
+
+static inline int64_t hb_rusage_tv_ns(struct timeval tv) {
+  return (int64_t) tv.tv_sec * 1000000000 + (int64_t) tv.tv_usec * 1000;
+}
+
+/**
+ * Reads the cumulative resource usage of the calling thread.
+ */
+static void hb_rusage_read(heartbeat_t volatile * hb, _HB_rusage_t* u) {
+  struct rusage ru;
+  char buf[4096];
+  ssize_t len;
+  char* p;
+  long long v;
+
+  memset(u, 0, sizeof(*u));
+  if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+    u->utime = hb_rusage_tv_ns(ru.ru_utime);
+    u->stime = hb_rusage_tv_ns(ru.ru_stime);
+    u->nvcsw = ru.ru_nvcsw;
+    u->nivcsw = ru.ru_nivcsw;
+    u->majflt = ru.ru_majflt;
+    u->minflt = ru.ru_minflt;
+  }
+  // schedstat: time on a CPU, time waiting on a runqueue, timeslices
+  u->run_delay = -1;
+  if (hb->rusage_schedstat_fd >= 0 &&
+      (len = pread(hb->rusage_schedstat_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[len] = '\0';
+    if (sscanf(buf, "%*s %lld", &v) == 1) {
+      u->run_delay = v;
+    }
+  }
+  u->migrations = -1;
+  if (hb->rusage_sched_fd >= 0 &&
+      (len = pread(hb->rusage_sched_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[len] = '\0';
+    p = strstr(buf, "se.nr_migrations");
+    if (p != NULL && (p = strchr(p, ':')) != NULL) {
+      u->migrations = strtoll(p + 1, NULL, 10);
+    }
+  }
+}
+
+/* Attempts hb_get_rusage() makes to read a sample that is not being written */
+#define HB_RUSAGE_RETRIES 16
+
+static void hb_rusage_stop(heartbeat_t volatile * hb) {
+  if (hb->rusage_schedstat_fd >= 0) {
+    close(hb->rusage_schedstat_fd);
+  }
+  if (hb->rusage_sched_fd >= 0) {
+    close(hb->rusage_sched_fd);
+  }
+  hb->rusage_schedstat_fd = -1;
+  hb->rusage_sched_fd = -1;
+  hb->rusage_interval = 0;
+}
+
+void HB_rusage_reset(heartbeat_t volatile * hb) {
+  hb_rusage_stop(hb);
+  hb->state->rusage_seq = 0;
+  memset((void*) &hb->state->rusage, 0, sizeof(hb->state->rusage));
+}
+
+void HB_rusage_finish(heartbeat_t volatile * hb) {
+  hb_rusage_stop(hb);
+}
+
+void HB_rusage_poll(heartbeat_t volatile * hb, int64_t time) {
+  _HB_rusage_t now;
+  _HB_rusage_t* last = (_HB_rusage_t*) &hb->rusage_last;
+  _HB_rusage_t* out = (_HB_rusage_t*) &hb->state->rusage;
+
+  if (hb->rusage_interval <= 0 || hb->state->counter < hb->rusage_next ||
+      !pthread_equal(hb->rusage_owner, pthread_self())) {
+    return;
+  }
+  hb_rusage_read(hb, &now);
+  now.beats = hb->state->counter;
+  now.duration = time;
+  if (last->beats >= 0) {
+    __atomic_store_n(&hb->state->rusage_seq, hb->state->rusage_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    out->beats = now.beats - last->beats;
+    out->duration = now.duration - last->duration;
+    out->utime = now.utime - last->utime;
+    out->stime = now.stime - last->stime;
+    out->nvcsw = now.nvcsw - last->nvcsw;
+    out->nivcsw = now.nivcsw - last->nivcsw;
+    out->majflt = now.majflt - last->majflt;
+    out->minflt = now.minflt - last->minflt;
+    out->migrations = now.migrations < 0 || last->migrations < 0 ? -1 :
+                      now.migrations - last->migrations;
+    out->run_delay = now.run_delay < 0 || last->run_delay < 0 ? -1 :
+                     now.run_delay - last->run_delay;
+    __atomic_store_n(&hb->state->rusage_seq, hb->state->rusage_seq + 1, __ATOMIC_RELEASE);
+  }
+  *last = now;
+  hb->rusage_next = now.beats + hb->rusage_interval;
+}
+
+int heartbeat_set_rusage_sampling(heartbeat_t* hb, int64_t interval) {
+  pthread_mutex_lock(&hb->mutex);
+  hb_rusage_stop(hb);
+  if (interval > 0) {
+    hb->rusage_owner = pthread_self();
+    hb->rusage_schedstat_fd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+    hb->rusage_sched_fd = open("/proc/thread-self/sched", O_RDONLY | O_CLOEXEC);
+    // the first sample only sets the baseline
+    hb->rusage_last.beats = -1;
+    hb->rusage_next = hb->state->counter;
+    hb->rusage_interval = interval;
+  }
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+int hb_get_rusage(heartbeat_t volatile * hb, hb_rusage_t* rusage) {
+  uint64_t seq;
+  int tries;
+  for (tries = 0; tries < HB_RUSAGE_RETRIES; tries++) {
+    seq = __atomic_load_n(&hb->state->rusage_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      // let a preempted writer finish its sample
+      sched_yield();
+      continue;
+    }
+    memcpy(rusage, (const void*) &hb->state->rusage, sizeof(*rusage));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hb->state->rusage_seq, __ATOMIC_RELAXED) == seq) {
+      return rusage->beats > 0 ? 0 : -1;
+    }
+  }
+  // the writer is stuck in a sample (stopped or died in one)
+  return -1;
+}
+
+int heartbeat_enable_counters(heartbeat_t* hb) {
+  struct _HB_counters* counters = HB_counters_open();
+  if (counters == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&hb->mutex);
+  HB_counters_close(hb->counters);
+  hb->counters = counters;
+  hb->state->features |= HB_FEATURE_COUNTERS;
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+void heartbeat_disable_counters(heartbeat_t* hb) {
+  pthread_mutex_lock(&hb->mutex);
+  HB_counters_close(hb->counters);
+  hb->counters = NULL;
+  hb->state->features &= ~HB_FEATURE_COUNTERS;
+  pthread_mutex_unlock(&hb->mutex);
+}
+
+void HB_counters_record(heartbeat_t volatile * hb, int64_t index, int64_t n) {
+  double ipc;
+  double misses;
+  double mhz;
+  HB_counters_sample(hb->counters, n, &ipc, &misses, &mhz);
+  hb->log[index].ipc = ipc;
+  hb->log[index].misses = misses;
+  hb->log[index].mhz = mhz;
+}
+
+static inline int64_t hb_cpu_now(int64_t clock) {
+  struct timespec ts;
+  clock_gettime(clock == HB_CPU_CLOCK_THREAD ? CLOCK_THREAD_CPUTIME_ID :
+                CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+void HB_cpu_reset(heartbeat_t volatile * hb, int clock) {
+  hb->state->cpu_clock = clock;
+  hb->state->global_cpu_rate = 0;
+  hb->state->window_cpu_rate = 0;
+  hb->state->instant_cpu_rate = 0;
+  hb->window_cpu = 0;
+  hb->window_cpu_work = 0;
+  hb->cpu_filled = 0;
+  hb->cpu_work_start = hb->total_work;
+  hb->cpu_start = clock == HB_CPU_CLOCK_NONE ? 0 : hb_cpu_now(clock);
+  hb->cpu_last = hb->cpu_start;
+}
+
+void HB_cpu_rate_update(heartbeat_t volatile * hb, int64_t n) {
+  int64_t idx = hb->current_index;
+  int64_t cpu;
+  int64_t delta;
+
+  if (hb->state->cpu_clock == HB_CPU_CLOCK_NONE) {
+    return;
+  }
+  cpu = hb_cpu_now(hb->state->cpu_clock);
+  delta = cpu - hb->cpu_last;
+  hb->cpu_last = cpu;
+  // idx still holds the entry the window average is about to replace
+  if (hb->cpu_filled == hb->state->window_size) {
+    hb->window_cpu -= hb->cpu_window[idx];
+    hb->window_cpu_work -= hb->work_window[idx];
+  } else {
+    hb->cpu_filled++;
+  }
+  hb->cpu_window[idx] = delta;
+  hb->window_cpu += delta;
+  hb->window_cpu_work += n;
+
+  hb->state->instant_cpu_rate = delta > 0 ? (double) n / (double) delta * 1000000000.0 : 0;
+  hb->state->window_cpu_rate = hb->window_cpu > 0 ?
+    (double) hb->window_cpu_work / (double) hb->window_cpu * 1000000000.0 : 0;
+  hb->state->global_cpu_rate = cpu > hb->cpu_start ?
+    (double) (hb->total_work - hb->cpu_work_start) / (double) (cpu - hb->cpu_start) * 1000000000.0 : 0;
+}
+
+int heartbeat_set_cpu_clock(heartbeat_t* hb, int clock) {
+  if (clock != HB_CPU_CLOCK_NONE && clock != HB_CPU_CLOCK_PROCESS &&
+      clock != HB_CPU_CLOCK_THREAD) {
+    return -1;
+  }
+  pthread_mutex_lock(&hb->mutex);
+  HB_cpu_reset(hb, clock);
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+int heartbeat_set_total_work(heartbeat_t* hb, int64_t total_work) {
+  if (total_work < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&hb->mutex);
+  HB_beat_begin(hb);
+  HB_eta_reset(hb);
+  hb_eta_recompute(hb);
+  hb->state->work_goal = total_work;
+  HB_beat_end(hb);
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+double hb_get_progress(heartbeat_t volatile * hb) {
+  if (hb->state->work_goal <= 0) {
+    return 0;
+  }
+  return (double) hb->state->work_done / (double) hb->state->work_goal;
+}
+
+int64_t hb_get_eta(heartbeat_t volatile * hb, int64_t* low, int64_t* high) {
+  if (low != NULL) {
+    *low = hb->state->eta_low;
+  }
+  if (high != NULL) {
+    *high = hb->state->eta_high;
+  }
+  return hb->state->eta;
+}
+
+double hb_get_global_cpu_rate(heartbeat_t volatile * hb) {
+  return hb->state->global_cpu_rate;
+}
+
+double hb_get_windowed_cpu_rate(heartbeat_t volatile * hb) {
+  return hb->state->window_cpu_rate;
+}
+
+double hb_get_instant_cpu_rate(heartbeat_t volatile * hb) {
+  return hb->state->instant_cpu_rate;
+}
+
+/* Bounds and starting point of how long before a paced heartbeat is due it
+   stops sleeping and spins */
+#define HB_PACE_MIN_SPIN_NS 5000
+#define HB_PACE_MAX_SPIN_NS 2000000
+#define HB_PACE_DEFAULT_SPIN_NS 100000
+/* Sleeps timed to learn the starting spin when pacing is enabled */
+#define HB_PACE_CALIBRATION_SLEEPS 8
+#define HB_PACE_CALIBRATION_NS 200000
+
+static int64_t hb_pace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+/* Sleeps until time (CLOCK_REALTIME) and returns how late it woke up */
+static int64_t hb_pace_sleep_until(int64_t time) {
+  struct timespec ts;
+  int64_t now;
+  ts.tv_sec = time / 1000000000;
+  ts.tv_nsec = time % 1000000000;
+  while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  now = hb_pace_now();
+  return now > time ? now - time : 0;
+}
+
+static int64_t hb_pace_clamp_spin(int64_t spin) {
+  if (spin < HB_PACE_MIN_SPIN_NS) {
+    return HB_PACE_MIN_SPIN_NS;
+  }
+  return spin > HB_PACE_MAX_SPIN_NS ? HB_PACE_MAX_SPIN_NS : spin;
+}
+
+void HB_pace_reset(heartbeat_t volatile * hb) {
+  hb->state->pace_mode = HB_PACE_NONE;
+  hb->state->pace_time = 0;
+  hb->state->paced_beats = 0;
+  hb->pace_spin = HB_PACE_DEFAULT_SPIN_NS;
+}
+
+/**
+ * Interval after the previous beat at which a beat of n units of work
+ * brings the window rate to max: the window arrays then lose the entry at
+ * current_index (once full) and gain this beat.
+ */
+static double hb_pace_window_interval(heartbeat_t volatile * hb, int64_t n, double max) {
+  int64_t count = hb->steady_state ? hb->state->window_size : hb->current_index;
+  double time = hb->last_average_time * (double) count;
+  double work = (double) (hb->window_work + n);
+  if (hb->steady_state) {
+    time -= (double) hb->window[hb->current_index];
+    work -= (double) hb->work_window[hb->current_index];
+  }
+  return work / max * 1000000000.0 - time;
+}
+
+/**
+ * Holds a beat of n units of work back until the pacing mode allows it,
+ * sleeping until pace_spin before it is due and spinning the rest. The
+ * spin follows twice the sleeps' recent lateness.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param n int64_t
+ */
+void HB_pace(heartbeat_t volatile * hb, int64_t n) {
+  double max = hb->state->max_heartrate;
+  double interval;
+  int64_t deadline;
+  int64_t start;
+  int64_t now;
+  int64_t late;
+
+  if (hb->state->pace_mode == HB_PACE_NONE || max <= 0 || hb->first_timestamp == -1) {
+    return;
+  }
+  if (hb->state->pace_mode == HB_PACE_WINDOW) {
+    interval = hb_pace_window_interval(hb, n, max);
+  } else {
+    interval = (double) n / max * 1000000000.0;
+  }
+  if (interval <= 0) {
+    return;
+  }
+  deadline = hb->last_timestamp + (int64_t) interval;
+  start = hb_pace_now();
+  if (start >= deadline) {
+    return;
+  }
+  if (deadline - start > hb->pace_spin) {
+    // a wakeup delayed by preemption can at most double its sample, so rare
+    // outliers do not push the spin past the intervals it is learned from
+    late = 2 * hb_pace_sleep_until(deadline - hb->pace_spin) + HB_PACE_MIN_SPIN_NS;
+    if (late > 2 * hb->pace_spin) {
+      late = 2 * hb->pace_spin;
+    }
+    hb->pace_spin = hb_pace_clamp_spin(hb->pace_spin + (late - hb->pace_spin) / 8);
+  }
+  do {
+    now = hb_pace_now();
+  } while (now < deadline);
+  hb->state->pace_time += now - start;
+  hb->state->paced_beats++;
+}
+
+int heartbeat_set_pacing(heartbeat_t* hb, int mode) {
+  int64_t spin = 0;
+  int64_t late;
+  int i;
+
+  if (mode != HB_PACE_NONE && mode != HB_PACE_INSTANT && mode != HB_PACE_WINDOW) {
+    return -1;
+  }
+#if !defined(HEARTBEAT_MODE_ACC) && !defined(HEARTBEAT_MODE_ACC_POW)
+  // timestamps are simulated, sleeping would not move them
+  if (mode != HB_PACE_NONE) {
+    return -1;
+  }
+#endif
+  // start from the worst wakeup of a few sleeps rather than a guess
+  for (i = 0; mode != HB_PACE_NONE && i < HB_PACE_CALIBRATION_SLEEPS; i++) {
+    late = hb_pace_sleep_until(hb_pace_now() + HB_PACE_CALIBRATION_NS);
+    if (late > spin) {
+      spin = late;
+    }
+  }
+  pthread_mutex_lock(&hb->mutex);
+  hb->state->pace_mode = mode;
+  if (mode != HB_PACE_NONE) {
+    hb->pace_spin = hb_pace_clamp_spin(2 * spin + HB_PACE_MIN_SPIN_NS);
+  }
+  pthread_mutex_unlock(&hb->mutex);
+  return 0;
+}
+
+int64_t hb_get_pacing_time(heartbeat_t volatile * hb) {
+  return hb->state->pace_time;
+}
+
+double hb_get_forecast_rate(heartbeat_t volatile * hb, int64_t horizon_ns) {
+  double rate = hb->state->rate_level + hb->state->rate_trend * (double) horizon_ns;
+  return rate > 0 ? rate : 0;
+}
+
 int64_t hb_get_buffer_depth(heartbeat_t volatile * hb) {
   return hb->state->buffer_depth;
 }
@@ -103,7 +1202,7 @@ int64_t hb_get_history(heartbeat_t volatile * hb,
     return 0;
   }
 
-  if (n > hb->state->counter) {
+  if (n > hb->state->counter - hb->state->log_start) {
     // more records were requested than have been created
     memcpy(record,
            &hb->log[0],
@@ -142,6 +1241,19 @@ int64_t hb_get_history(heartbeat_t volatile * hb,
   return n;
 }
 
+int64_t hb_reduce_history(heartbeat_t volatile * hb,
+                          int64_t n,
+                          uint32_t fields,
+                          hb_reduction_t* out) {
+  return HB_reduce_ring((const void*) hb->log,
+                        hb->state->record_size,
+                        hb->state->features,
+                        hb->state->buffer_depth,
+                        hb->state->buffer_index,
+                        hb->state->counter - hb->state->log_start,
+                        n, fields, out);
+}
+
 double hb_get_min_rate(heartbeat_t volatile * hb) {
   return hb->state->min_heartrate;
 }
@@ -252,6 +1364,11 @@ double hb_get_instant_power(heartbeat_t volatile * hb) {
   return hb->log[hb->state->read_index].instant_power;
 }
 
+double hb_get_forecast_power(heartbeat_t volatile * hb, int64_t horizon_ns) {
+  double power = hb->state->power_level + hb->state->power_trend * (double) horizon_ns;
+  return power > 0 ? power : 0;
+}
+
 double hbr_get_global_power(heartbeat_record_t volatile * hbr) {
   return hbr->global_power;
 }
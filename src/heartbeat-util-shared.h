@@ -18,11 +18,81 @@ extern "C" {
 #include "heartbeat.h"
 #include "heartbeat-types.h"
 #endif
+#include "heartbeat-counters-internal.h"
+
+/* Default smoothing of the rate and power forecasts */
+#define HB_FORECAST_ALPHA 0.2
+#define HB_FORECAST_BETA  0.05
 
 _HB_global_state_t* HB_alloc_state(int pid);
 
 _heartbeat_record_t* HB_alloc_log(int pid, int64_t buffer_size);
 
+void HB_adaptive_reset(heartbeat_t volatile * hb);
+
+/* Writes unflushed records to the text log; defined by each implementation */
+void HB_flush_buffer(heartbeat_t volatile * hb);
+
+void HB_command_reset(heartbeat_t volatile * hb);
+
+int HB_command_drain(heartbeat_t volatile * hb, hb_command_t* cmds);
+
+int HB_command_poll(heartbeat_t volatile * hb, hb_command_t* cmds);
+
+void HB_command_dispatch(heartbeat_t volatile * hb, const hb_command_t* cmds, int n);
+
+void HB_forecast_reset(heartbeat_t volatile * hb);
+
+void HB_forecast_update(heartbeat_t volatile * hb,
+                        int64_t time,
+                        int64_t interval,
+                        double rate,
+                        double power);
+
+/* Bracket a heartbeat's updates of the state and log so that monitors can
+   read them consistently (see hrm_snapshot_many()) */
+static inline void HB_beat_begin(heartbeat_t volatile * hb) {
+  __atomic_store_n(&hb->state->beat_seq, hb->state->beat_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void HB_beat_end(heartbeat_t volatile * hb) {
+  __atomic_store_n(&hb->state->beat_seq, hb->state->beat_seq + 1, __ATOMIC_RELEASE);
+}
+
+void HB_rusage_reset(heartbeat_t volatile * hb);
+
+void HB_rusage_finish(heartbeat_t volatile * hb);
+
+/* Publishes resource usage deltas if a sample is due; time is the beat's */
+void HB_rusage_poll(heartbeat_t volatile * hb, int64_t time);
+
+void HB_eta_reset(heartbeat_t volatile * hb);
+
+/* Updates progress and the completion estimate for a beat of n units of
+   work that took interval; call before the window average advances
+   current_index */
+void HB_eta_update(heartbeat_t volatile * hb, int64_t time, int64_t interval, int64_t n);
+
+void HB_pace_reset(heartbeat_t volatile * hb);
+
+/* Delays a beat of n units of work as the pacing mode requires; call holding
+   the mutex, before HB_beat_begin() and reading the beat's time */
+void HB_pace(heartbeat_t volatile * hb, int64_t n);
+
+void HB_cpu_reset(heartbeat_t volatile * hb, int clock);
+
+/* Updates the CPU-time rates for a beat of n units of work; call before the
+   window average advances current_index */
+void HB_cpu_rate_update(heartbeat_t volatile * hb, int64_t n);
+
+/* Fills the counter fields of log[index] for a beat of n units of work */
+void HB_counters_record(heartbeat_t volatile * hb, int64_t index, int64_t n);
+
+double HB_adaptive_window_rate(heartbeat_t volatile * hb,
+                               int64_t time,
+                               int64_t work);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,78 @@
+/** \file
+ *  \brief Example: OpenMP parallel loop
+ *  \version 1.0
+ *  \example parallel-omp.c
+ *  Counts iterations of an OpenMP parallel for loop per thread and publishes
+ *  one heartbeat per chunk of iterations.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "heartbeat.h"
+#include "heartbeat-parallel.h"
+
+heartbeat_t* heart;
+
+/**
+       *
+       * @param argv[1]: total number of iterations
+       * @param argv[2]: iterations per published heartbeat
+       */
+int main(int argc, char** argv) {
+   int nthreads = 1;
+
+   if ( argc != 3 )
+   {
+      printf("usage:\n");
+      printf("  parallel-omp num_iterations, chunk\n");
+      return -1;
+   }
+   if(getenv("HEARTBEAT_ENABLED_DIR") == NULL) {
+     fprintf(stderr, "ERROR: need to define environment variable HEARTBEAT_ENABLED_DIR (see README)\n");
+     return 1;
+   }
+
+   long i;
+   const long MAX = atol(argv[1]);
+   const int64_t CHUNK = atol(argv[2]);
+   double sum = 0.0;
+
+#ifdef _OPENMP
+   nthreads = omp_get_max_threads();
+#endif
+
+   heart = heartbeat_init(100, 1000, NULL, 0, 1000000000);
+   if (heart == NULL) {
+     fprintf(stderr, "Error allocating heartbeat data\n");
+     return 1;
+   }
+   hb_parallel_t* hbp = hb_parallel_init(heart, nthreads, CHUNK, 0);
+   if (hbp == NULL) {
+     heartbeat_finish(heart);
+     return 1;
+   }
+   // mark the start of the region
+   heartbeat_n(heart, -1, 0);
+
+#pragma omp parallel for reduction(+:sum)
+   for(i = 0; i < MAX; i++) {
+     sum += sqrt((double) i);
+#ifdef _OPENMP
+     hb_parallel_iter(hbp, omp_get_thread_num());
+#else
+     hb_parallel_iter(hbp, 0);
+#endif
+   }
+   hb_parallel_flush_all(hbp);
+
+   printf("Threads: %d, Result: %f\n", nthreads, sum);
+   printf("Global heart rate: %f, Current heart rate: %f\n",
+   hb_get_global_rate(heart), hb_get_windowed_rate(heart));
+
+   hb_parallel_finish(hbp);
+   heartbeat_finish(heart);
+   return 0;
+}
@@ -0,0 +1,105 @@
+/** \file
+ *  \brief Example: Thread pool
+ *  \version 1.0
+ *  \example parallel-pthread.c
+ *  A pool of pthreads draining a shared task counter, publishing aggregated
+ *  heartbeats per time quantum rather than per task.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "heartbeat.h"
+#include "heartbeat-parallel.h"
+
+heartbeat_t* heart;
+hb_parallel_t* hbp;
+
+typedef struct {
+  int id;
+  long max;
+  double result;
+} worker_t;
+
+static long next_task = 0;
+
+/**
+       *
+       * @param arg pointer to worker_t
+       */
+static void* worker(void* arg) {
+  worker_t* w = (worker_t*) arg;
+  long task;
+
+  while ((task = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED)) < w->max) {
+    w->result += sqrt((double) task);
+    hb_parallel_iter(hbp, w->id);
+  }
+  hb_parallel_flush(hbp, w->id);
+  return NULL;
+}
+
+/**
+       *
+       * @param argv[1]: total number of tasks
+       * @param argv[2]: number of worker threads
+       * @param argv[3]: heartbeat quantum in microseconds
+       */
+int main(int argc, char** argv) {
+
+   if ( argc != 4 )
+   {
+      printf("usage:\n");
+      printf("  parallel-pthread num_tasks, num_threads, quantum_us\n");
+      return -1;
+   }
+   if(getenv("HEARTBEAT_ENABLED_DIR") == NULL) {
+     fprintf(stderr, "ERROR: need to define environment variable HEARTBEAT_ENABLED_DIR (see README)\n");
+     return 1;
+   }
+
+   int i;
+   const long MAX = atol(argv[1]);
+   const int NTHREADS = atoi(argv[2]);
+   const int64_t QUANTUM = (int64_t) atol(argv[3]) * 1000;
+   double sum = 0.0;
+
+   if (NTHREADS <= 0) {
+     fprintf(stderr, "ERROR: need at least one thread\n");
+     return 1;
+   }
+   pthread_t threads[NTHREADS];
+   worker_t workers[NTHREADS];
+
+   heart = heartbeat_init(100, 1000, NULL, 0, 1000000000);
+   if (heart == NULL) {
+     fprintf(stderr, "Error allocating heartbeat data\n");
+     return 1;
+   }
+   // check the clock every 256 tasks, publish once per quantum
+   hbp = hb_parallel_init(heart, NTHREADS, 256, QUANTUM);
+   if (hbp == NULL) {
+     heartbeat_finish(heart);
+     return 1;
+   }
+   heartbeat_n(heart, -1, 0);
+
+   for(i = 0; i < NTHREADS; i++) {
+     workers[i].id = i;
+     workers[i].max = MAX;
+     workers[i].result = 0.0;
+     pthread_create(&threads[i], NULL, worker, &workers[i]);
+   }
+   for(i = 0; i < NTHREADS; i++) {
+     pthread_join(threads[i], NULL);
+     sum += workers[i].result;
+   }
+
+   printf("Threads: %d, Result: %f\n", NTHREADS, sum);
+   printf("Global heart rate: %f, Current heart rate: %f\n",
+   hb_get_global_rate(heart), hb_get_windowed_rate(heart));
+
+   hb_parallel_finish(hbp);
+   heartbeat_finish(heart);
+   return 0;
+}
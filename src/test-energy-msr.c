@@ -0,0 +1,113 @@
+/**
+ * Reads energy from fake Intel MSR files through HEARTBEAT_ENERGY_MSR_PATH:
+ * regular files holding the power unit and energy status registers at their
+ * addresses. Checks the unit scaling, that the upper 32 bits of the status
+ * registers are ignored, that a wrap of the 32-bit counter is accumulated,
+ * and the sum over several MSRs of the core (PP0) domain.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hb-energy-msr.h"
+
+#define TEST_POWER_UNIT   0x606
+#define TEST_PKG_ENERGY   0x611
+#define TEST_PP0_ENERGY   0x639
+
+static char test_dir[] = "/tmp/test-energy-msr-XXXXXX";
+
+static int test_write_msr(int cpu, long long reg, uint64_t value) {
+  char path[PATH_MAX];
+  int fd;
+  int rc = 0;
+
+  snprintf(path, sizeof(path), "%s/msr%d", test_dir, cpu);
+  fd = open(path, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0 || pwrite(fd, &value, sizeof(value), reg) != (ssize_t) sizeof(value)) {
+    perror("test_write_msr");
+    rc = -1;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return rc;
+}
+
+/* Energy unit of 1/2^bits J, in the layout of MSR_RAPL_POWER_UNIT */
+static uint64_t test_unit(int bits) {
+  return 0xA0003ULL | ((uint64_t) bits << 8);
+}
+
+static int test_check(const char* step, double got, double want) {
+  if (got < want - 1e-12 || got > want + 1e-12) {
+    fprintf(stderr, "%s: read %.9f J, want %.9f J\n", step, got, want);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  char path[PATH_MAX];
+  int checks = 0;
+  int failures = 0;
+  int i;
+
+  if (mkdtemp(test_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/msr%%d", test_dir);
+  setenv(HB_ENERGY_MSR_PATH_ENV_VAR, path, 1);
+  setenv(HB_ENERGY_MSR_VENDOR_ENV_VAR, "intel", 1);
+  unsetenv(HB_ENERGY_MSR_ENV_VAR);
+  unsetenv(HB_ENERGY_MSR_DOMAIN_ENV_VAR);
+
+  // package energy of cpu0 in 1/2^14 J, just below a wrap, with junk above
+  // the 32-bit counter
+  if (test_write_msr(0, TEST_POWER_UNIT, test_unit(14)) ||
+      test_write_msr(0, TEST_PKG_ENERGY, 0xDEAD00000000ULL | 0xFFFFFF00ULL) ||
+      hb_energy_init_msr()) {
+    failures++;
+  } else {
+    if (strcmp(hb_energy_get_source_msr(), "X86 MSR (Intel package)")) {
+      fprintf(stderr, "source: %s\n", hb_energy_get_source_msr());
+      failures++;
+    }
+    failures += test_check("unchanged", hb_energy_read_total_msr(0, 0), 0.0);
+    test_write_msr(0, TEST_PKG_ENERGY, 0xBEEF00000000ULL | 0x100ULL);
+    failures += test_check("wrap", hb_energy_read_total_msr(0, 0), 512.0 / 16384.0);
+    test_write_msr(0, TEST_PKG_ENERGY, 0x4100ULL);
+    failures += test_check("after wrap", hb_energy_read_total_msr(0, 0), 1.0 + 512.0 / 16384.0);
+    checks += 4;
+    hb_energy_finish_msr();
+  }
+
+  // core energy summed over two CPUs with different units
+  setenv(HB_ENERGY_MSR_ENV_VAR, "0,1", 1);
+  setenv(HB_ENERGY_MSR_DOMAIN_ENV_VAR, "core", 1);
+  if (test_write_msr(0, TEST_PP0_ENERGY, 1000) ||
+      test_write_msr(1, TEST_POWER_UNIT, test_unit(16)) ||
+      test_write_msr(1, TEST_PP0_ENERGY, 5000) ||
+      hb_energy_init_msr()) {
+    failures++;
+  } else {
+    test_write_msr(0, TEST_PP0_ENERGY, 1000 + 3 * 16384);
+    test_write_msr(1, TEST_PP0_ENERGY, 5000 + 65536 / 2);
+    failures += test_check("core", hb_energy_read_total_msr(0, 0), 3.5);
+    checks++;
+    hb_energy_finish_msr();
+  }
+
+  for (i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "%s/msr%d", test_dir, i);
+    unlink(path);
+  }
+  rmdir(test_dir);
+
+  printf("%s: %d checks, %d failures\n", argc > 0 ? argv[0] : "test-energy-msr", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+/**
+ * Checks that every heartbeat reduction kernel the CPU supports agrees with
+ * the scalar kernel, over wrapped and unwrapped ranges of each record layout
+ * and ranges shorter than a vector.
+ *
+ * The kernels are private to heartbeat-reduce.c, which is included here so
+ * that HB_reduce_ring() can be run with each of them in turn.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heartbeat-reduce.c"
+
+#define TEST_DEPTH 37
+/* Largest record: accuracy, power and counters */
+#define TEST_MAX_DOUBLES 15
+
+typedef struct {
+  const char* name;
+  hb_reduce_kernel_t kernel;
+} test_kernel_t;
+
+static int64_t test_record_size(int64_t features) {
+  // every layout ends with the counter fields
+  return HB_RECORD_COUNTERS_OFFSET(features) + 3 * (int64_t) sizeof(double);
+}
+
+static uint32_t test_fields(int64_t features) {
+  uint32_t fields = HB_FIELDS_RATE;
+  if (features & HB_FEATURE_ACCURACY) {
+    fields |= HB_FIELDS_ACCURACY;
+  }
+  if (features & HB_FEATURE_POWER) {
+    fields |= HB_FIELDS_POWER;
+  }
+  if (features & HB_FEATURE_COUNTERS) {
+    fields |= HB_FIELDS_COUNTERS;
+  }
+  return fields;
+}
+
+static int test_close(double a, double b) {
+  double scale = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+  return fabs(a - b) <= 1e-9 * (scale > 1.0 ? scale : 1.0);
+}
+
+static void test_fill(double* log, int64_t doubles) {
+  int64_t i;
+  for (i = 0; i < doubles; i++) {
+    // a large offset and spread exercise the shifted sums
+    log[i] = 1000.0 + (double) (rand() % 100000) / 7.0 - (double) (rand() % 3) * 250.0;
+  }
+}
+
+/* Runs one range with kernel and the scalar kernel; returns failures */
+static int test_range(const test_kernel_t* k,
+                      const double* log,
+                      int64_t features,
+                      int64_t buffer_index,
+                      int64_t filled,
+                      int64_t n) {
+  int64_t record_size = test_record_size(features);
+  uint32_t fields = test_fields(features);
+  hb_reduction_t want;
+  hb_reduction_t got;
+  int64_t want_n;
+  int64_t got_n;
+  int failures = 0;
+  int f;
+
+  reduce_kernel = reduce_scalar;
+  want_n = HB_reduce_ring(log, record_size, features, TEST_DEPTH, buffer_index,
+                          filled, n, fields, &want);
+  reduce_kernel = k->kernel;
+  got_n = HB_reduce_ring(log, record_size, features, TEST_DEPTH, buffer_index,
+                         filled, n, fields, &got);
+  if (want_n != got_n || want.count != got.count) {
+    fprintf(stderr, "%s: features %lld index %lld n %lld: count %lld, want %lld\n",
+            k->name, (long long) features, (long long) buffer_index, (long long) n,
+            (long long) got_n, (long long) want_n);
+    return 1;
+  }
+  for (f = 0; f < HB_FIELD_COUNT && want_n > 0; f++) {
+    if (!(fields & HB_FIELD_BIT(f))) {
+      continue;
+    }
+    if (got.stats[f].min != want.stats[f].min || got.stats[f].max != want.stats[f].max ||
+        !test_close(got.stats[f].mean, want.stats[f].mean) ||
+        !test_close(got.stats[f].stddev, want.stats[f].stddev)) {
+      fprintf(stderr, "%s: features %lld index %lld n %lld field %d: "
+              "%g %g %g %g, want %g %g %g %g\n",
+              k->name, (long long) features, (long long) buffer_index, (long long) n, f,
+              got.stats[f].min, got.stats[f].max, got.stats[f].mean, got.stats[f].stddev,
+              want.stats[f].min, want.stats[f].max, want.stats[f].mean, want.stats[f].stddev);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char** argv) {
+  static const int64_t layouts[] = {
+    0,
+    HB_FEATURE_ACCURACY,
+    HB_FEATURE_ACCURACY | HB_FEATURE_POWER,
+    HB_FEATURE_COUNTERS,
+    HB_FEATURE_ACCURACY | HB_FEATURE_COUNTERS,
+    HB_FEATURE_ACCURACY | HB_FEATURE_POWER | HB_FEATURE_COUNTERS,
+  };
+  static double log[TEST_DEPTH * TEST_MAX_DOUBLES];
+  test_kernel_t kernels[4];
+  int nkernels = 0;
+  int failures = 0;
+  int64_t ranges = 0;
+  int64_t index;
+  int64_t n;
+  size_t l;
+  int k;
+
+  kernels[nkernels].name = "scalar";
+  kernels[nkernels++].kernel = reduce_scalar;
+#if defined(HB_REDUCE_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    kernels[nkernels].name = "avx2";
+    kernels[nkernels++].kernel = reduce_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    kernels[nkernels].name = "avx512";
+    kernels[nkernels++].kernel = reduce_avx512;
+  }
+#elif defined(HB_REDUCE_NEON)
+  kernels[nkernels].name = "neon";
+  kernels[nkernels++].kernel = reduce_neon;
+#endif
+
+  srand(1);
+  test_fill(log, TEST_DEPTH * TEST_MAX_DOUBLES);
+  for (k = 0; k < nkernels; k++) {
+    for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+      for (index = 0; index < TEST_DEPTH; index++) {
+        // n from empty through shorter than a vector to the whole ring, so
+        // that ranges both wrap and do not
+        for (n = 0; n <= TEST_DEPTH; n++) {
+          // a full ring, and one still filling (nothing before index 0)
+          failures += test_range(&kernels[k], log, layouts[l], index, TEST_DEPTH * 2, n);
+          failures += test_range(&kernels[k], log, layouts[l], index, index, n);
+          ranges += 2;
+        }
+      }
+    }
+  }
+
+  printf("%s: %d kernels, %lld ranges, %d failures\n",
+         argc > 0 ? argv[0] : "test-reduce", nkernels, (long long) ranges, failures);
+  for (k = 0; k < nkernels; k++) {
+    printf("  %s\n", kernels[k].name);
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * Runs hb-resctrl's control steps against a fake resctrl root: a temporary
+ * directory with the info files and schemata of a two-domain L3 and MB
+ * system, and a heartbeat in this process that is always below its min
+ * target. Checks the schemata written for the application's group and the
+ * default group after each step.
+ *
+ * hb-resctrl.c is included here (with its main renamed) so that its probe,
+ * control and apply functions can be run one at a time.
+ */
+#define main hb_resctrl_main
+#include "hb-resctrl.c"
+#undef main
+#include "heartbeat.h"
+
+static char test_root[] = "/tmp/test-resctrl-XXXXXX";
+static char test_enabled[PATH_MAX];
+
+static int test_write(const char* rel, const char* text) {
+  if (write_file(test_root, rel, text)) {
+    fprintf(stderr, "Failed to write %s/%s: %s\n", test_root, rel, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int test_fake_root(void) {
+  char path[PATH_MAX];
+
+  if (mkdtemp(test_root) == NULL) {
+    perror("mkdtemp");
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/info", test_root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/info/L3", test_root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/info/MB", test_root);
+  mkdir(path, 0755);
+  snprintf(test_enabled, sizeof(test_enabled), "%s/enabled", test_root);
+  mkdir(test_enabled, 0755);
+  return test_write("schemata", "L3:0=fff;1=fff\nMB:0=100;1=100\n") ||
+         test_write("info/L3/cbm_mask", "fff\n") ||
+         test_write("info/L3/min_cbm_bits", "1\n") ||
+         test_write("info/MB/min_bandwidth", "10\n") ||
+         test_write("info/MB/bandwidth_gran", "10\n");
+}
+
+static void test_remove_root(int pid) {
+  static const char* files[] = {
+    "schemata", "tasks", "info/L3/cbm_mask", "info/L3/min_cbm_bits",
+    "info/MB/min_bandwidth", "info/MB/bandwidth_gran",
+  };
+  char path[PATH_MAX];
+  size_t i;
+
+  snprintf(path, sizeof(path), "%s/hb-%d/schemata", test_root, pid);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/hb-%d", test_root, pid);
+  rmdir(path);
+  for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    snprintf(path, sizeof(path), "%s/%s", test_root, files[i]);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/%d", test_enabled, pid);
+  unlink(path);
+  rmdir(test_enabled);
+  snprintf(path, sizeof(path), "%s/info/L3", test_root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/info/MB", test_root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/info", test_root);
+  rmdir(path);
+  rmdir(test_root);
+}
+
+/* Compares the schemata of dir with want; returns failures */
+static int test_schemata(const char* step, const char* dir, const char* want) {
+  char buf[HB_RDT_LINE_MAX];
+
+  if (read_file(dir, "schemata", buf, sizeof(buf))) {
+    fprintf(stderr, "%s: cannot read %s/schemata\n", step, dir);
+    return 1;
+  }
+  if (strcmp(buf, want)) {
+    fprintf(stderr, "%s: %s/schemata is\n%swant\n%s", step, dir, buf, want);
+    return 1;
+  }
+  return 0;
+}
+
+/* Beats until a window has passed since the last change and takes a step */
+static int test_step(heartbeat_t* hb, const char* step) {
+  struct timespec gap = { 0, 1000000 };
+  heart_rate_monitor_t* hrm = &apps[0].hrm;
+  hrm_snapshot_t snap;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    nanosleep(&gap, NULL);
+    heartbeat(hb, 0);
+  }
+  if (hrm_snapshot_many(&hrm, 1, &snap) != 1) {
+    fprintf(stderr, "%s: no snapshot\n", step);
+    return 1;
+  }
+  if (!control_app(&apps[0], &snap)) {
+    fprintf(stderr, "%s: allocation unchanged at rate %f, min %f\n",
+            step, snap.window_rate, snap.min_rate);
+    return 1;
+  }
+  apply_schemata();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  char want[HB_RDT_LINE_MAX];
+  heartbeat_t* hb;
+  int pid = getpid();
+  int steps = 0;
+  int failures = 0;
+
+  if (test_fake_root()) {
+    return 1;
+  }
+  setenv("HEARTBEAT_ENABLED_DIR", test_enabled, 1);
+  // no rate reaches the min target, so every step adds resources
+  hb = heartbeat_init(2, 16, NULL, 1e12, 0);
+  if (hb == NULL) {
+    fprintf(stderr, "Failed to create a heartbeat\n");
+    test_remove_root(pid);
+    return 1;
+  }
+  snprintf(root, sizeof(root), "%s", test_root);
+  if (probe_resctrl() || !cat || !mba || nways != 12 || nl3 != 2 || nmb != 2 ||
+      mb_max != 100 || mb_min != 10 || mb_gran != 10) {
+    fprintf(stderr, "probe: cat %d ways %d domains %d, mba %d mb %lld..%lld by %lld, domains %d\n",
+            cat, nways, nl3, mba, (long long) mb_min, (long long) mb_max,
+            (long long) mb_gran, nmb);
+    failures++;
+  } else if (attach_app(pid)) {
+    failures++;
+  } else {
+    // as hb-resctrl starts: half the ways, unthrottled
+    apps[0].ways = nways / 2;
+    apply_schemata();
+    failures += test_schemata("start", apps[0].dir, "L3:0=fc0;1=fc0\nMB:0=100;1=100\n");
+    failures += test_schemata("start", root, "L3:0=fff;1=fff\nMB:0=100;1=100\n");
+
+    // unthrottled already, so the application gets another way
+    failures += test_step(hb, "step 1");
+    failures += test_schemata("step 1", apps[0].dir, "L3:0=fe0;1=fe0\nMB:0=100;1=100\n");
+    failures += test_schemata("step 1", root, "L3:0=fff;1=fff\nMB:0=100;1=100\n");
+    steps++;
+
+    // a throttled application is unthrottled a step first
+    apps[0].mb = 50;
+    failures += test_step(hb, "step 2");
+    failures += test_schemata("step 2", apps[0].dir, "L3:0=fe0;1=fe0\nMB:0=60;1=60\n");
+    steps++;
+
+    // with -d the default group keeps only the ways below the application's
+    apps[0].mb = mb_max;
+    confine_default = 1;
+    failures += test_step(hb, "step 3");
+    failures += test_schemata("step 3", apps[0].dir, "L3:0=ff0;1=ff0\nMB:0=100;1=100\n");
+    failures += test_schemata("step 3", root, "L3:0=f;1=f\nMB:0=100;1=100\n");
+    steps++;
+
+    // out of ways, the default group is throttled instead
+    apps[0].ways = nways - min_ways;
+    failures += test_step(hb, "step 4");
+    snprintf(want, sizeof(want), "L3:0=1;1=1\nMB:0=%lld;1=%lld\n",
+             (long long) (mb_max - mb_gran), (long long) (mb_max - mb_gran));
+    failures += test_schemata("step 4", root, want);
+    steps++;
+
+    // resctrl removes a group's files with it; here they go first
+    snprintf(want, sizeof(want), "%s/schemata", apps[0].dir);
+    unlink(want);
+    release_app(0);
+  }
+  heartbeat_finish(hb);
+  test_remove_root(pid);
+
+  printf("%s: %d steps, %d failures\n", argc > 0 ? argv[0] : "test-resctrl", steps, failures);
+  return failures ? 1 : 0;
+}